@@ -314,6 +314,26 @@ DLL_DECL int chatllm_tool_completion(struct chatllm_obj *obj, const char *utf8_s
  */
 DLL_DECL int chatllm_text_tokenize(struct chatllm_obj *obj, const char *utf8_str);
 
+/**
+ * @brief tokenize a batch of texts in parallel
+ *
+ * ids of `utf8_strs[i]` are `ids[offsets[i]]` ... `ids[offsets[i + 1] - 1]`.
+ *
+ * Call it with `ids` being NULL to get the total number of ids, then call it again with a buffer large enough.
+ *
+ * @param[in] obj               model object
+ * @param[in] utf8_strs         texts
+ * @param[in] num               number of texts
+ * @param[in] purpose           -1: same as `chatllm_text_tokenize`; otherwise `EmbeddingPurpose`, same as `chatllm_embedding`
+ * @param[out] ids              buffer of ids (can be NULL)
+ * @param[in] max_ids           capacity of `ids`
+ * @param[out] offsets          buffer of `num + 1` offsets (can be NULL)
+ * @return                      total number of ids if succeeded (`ids` and `offsets` are filled only if `max_ids` is
+ *                              not less than this). otherwise -1.
+ */
+DLL_DECL int chatllm_text_tokenize_batch(struct chatllm_obj *obj, const char **utf8_strs, int num, int purpose,
+                                         int *ids, int max_ids, int *offsets);
+
 enum EmbeddingPurpose
 {
     EMBEDDING_FOR_DOC   = 0,    // for document
@@ -334,6 +354,26 @@ enum EmbeddingPurpose
  */
 DLL_DECL int chatllm_embedding(struct chatllm_obj *obj, const char *utf8_str, int purpose);
 
+/**
+ * @brief text embedding of a batch of texts
+ *
+ * texts are tokenized in parallel, and packed into as few forward passes as possible.
+ * embedding of `utf8_strs[i]` is `embeddings[i * dim]` ... `embeddings[(i + 1) * dim - 1]`.
+ *
+ * Call it with `embeddings` being NULL to get the total number of floats (`num * dim`), then call it again with a buffer large enough.
+ *
+ * @param[in] obj               model object
+ * @param[in] utf8_strs         texts
+ * @param[in] num               number of texts
+ * @param[in] purpose           purpose, see `EmbeddingPurpose`
+ * @param[out] embeddings       buffer of embeddings (can be NULL)
+ * @param[in] max_floats        capacity of `embeddings`
+ * @return                      total number of floats if succeeded (`embeddings` is filled only if `max_floats` is
+ *                              not less than this). otherwise -1.
+ */
+DLL_DECL int chatllm_embedding_batch(struct chatllm_obj *obj, const char **utf8_strs, int num, int purpose,
+                                     float *embeddings, int max_floats);
+
 /**
  * @brief question & answer ranking
  *
@@ -208,7 +208,7 @@ namespace chatllm::alphageo
     {
     public:
         AlphaGeoSelfAttention(InitContext *ctx, int hidden_size, int num_attention_heads, int max_length, int max_distance, int num_buckets)
-            : BaseAttention(ctx, hidden_size, num_attention_heads, num_attention_heads, hidden_size / num_attention_heads, max_length, false, false,
+            : BaseAttention(KVPagingDisabler(ctx), hidden_size, num_attention_heads, num_attention_heads, hidden_size / num_attention_heads, max_length, false, false,
                             max_length),
             rel_embedding(ggml::new_tensor_2d(ctx, ggml::type::GGML_TYPE_F16, num_attention_heads, num_buckets)),
             attention_scale(ggml::new_tensor_1d(ctx, ggml::type::GGML_TYPE_F32, num_attention_heads)),
@@ -311,6 +311,8 @@ namespace chatllm::alphageo
             return pos_bias;
         }
 
+        bool is_fused_attn_supported(void) const override { return false; }
+
         // k: [heads, qlen, head_size]
         // q: [heads, qlen, head_size]
         // v: [heads, head_size, klen]
@@ -303,6 +303,9 @@ namespace chatllm::baichuan::m1
         {
             const int head_size = hidden_size / BaseAttn::num_attention_heads;
 
+            // conv caches are indexed by `n_past`, which is not patched in a reused graph
+            ctx->graph_reuse.veto();
+
             // [qlen, heads, head_size]
             k = ggml::reshape_3d(ctx, k, head_size, BaseAttn::num_kv_heads, qlen);
             k = conv_k.forward(ctx, k, n_past);
@@ -410,6 +413,9 @@ namespace chatllm::baichuan::m1
                     tokenizer->set_chat_encoder(&_im_chat_encoder);
         }
 
+        // conv (FIR2) states of K & V can't be rewound
+        bool is_rewindable(void) const override { return false; }
+
     private:
         bool is_swa_layer(int layer_index) const
         {
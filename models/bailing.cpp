@@ -167,6 +167,11 @@ namespace chatllm::bailing::moe2
             }
         }
 
+        bool is_fused_attn_supported(void) const override
+        {
+            return (nullptr == mask) && QKNormedRoPEAttention<RMSNorm, BaseAttention>::is_fused_attn_supported();
+        }
+
         ggml::tensor *attn_scores_to_probs(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
             ggml::tensor *attn_scores) override
         {
@@ -1,4 +1,57 @@
 #include "bce.h"
+#include <cstring>
+#include <cmath>
+
+namespace chatllm::bce
+{
+    void PackedSequences::make_packs(const std::vector<size_t> &offsets, int max_tokens, std::vector<std::vector<int>> &packs)
+    {
+        const int num = (int)offsets.size() - 1;
+
+        packs.clear();
+        int tokens = 0;
+        for (int i = 0; i < num; i++)
+        {
+            const int len = (int)(offsets[i + 1] - offsets[i]);
+            if ((packs.size() < 1) || (tokens + len > max_tokens))
+            {
+                packs.emplace_back();
+                tokens = 0;
+            }
+            packs.back().push_back(i);
+            tokens += len;
+        }
+    }
+
+    PackedSequences::PackedSequences(const std::vector<int> &input_ids, const std::vector<size_t> &offsets, const std::vector<int> &seqs)
+    {
+        for (int s : seqs)
+        {
+            first_rows.push_back((int)ids.size());
+            ids.insert(ids.end(), input_ids.begin() + offsets[s], input_ids.begin() + offsets[s + 1]);
+            for (size_t j = 0; j < offsets[s + 1] - offsets[s]; j++)
+                positions.push_back(RobertaEmbedding::pad_index + (int)j);
+        }
+
+        const size_t len = ids.size();
+        mask.resize(len * len, -INFINITY);
+        for (size_t k = 0; k < first_rows.size(); k++)
+        {
+            const size_t start = first_rows[k];
+            const size_t end   = k + 1 < first_rows.size() ? first_rows[k + 1] : len;
+            for (size_t i = start; i < end; i++)
+                std::fill(mask.begin() + i * len + start, mask.begin() + i * len + end, 0.0f);
+        }
+    }
+
+    void PackedSequences::write_input_data(void)
+    {
+        Backend::write_tensor_data(ids_tensor, ids.data());
+        Backend::write_tensor_data(positions_tensor, positions.data());
+        Backend::write_tensor_data(mask_tensor, mask.data());
+        Backend::write_tensor_data(first_rows_tensor, first_rows.data());
+    }
+}
 
 namespace chatllm::bce::embedding
 {
@@ -91,6 +144,46 @@ namespace chatllm::bce::embedding
     {
         return config.hidden_size;
     }
+
+    void ConditionalGeneration::embedding_batch(const GenerationConfig &gen_config, const std::vector<int> &input_ids, const std::vector<size_t> &offsets,
+                                                std::vector<float> &embeddings)
+    {
+        const int num = (int)offsets.size() - 1;
+        embeddings.clear();
+        if (num < 1) return;
+        embeddings.resize((size_t)num * config.hidden_size);
+
+        // the attention can't be longer than `max_length`
+        std::vector<std::vector<int>> packs;
+        PackedSequences::make_packs(offsets, std::min(embedding_batch_tokens, config.max_length), packs);
+
+        ModelClass *model = get_typed_transformer<ModelClass>();
+        BCEFinalNorm *norm = dynamic_cast<BCEFinalNorm *>(model->final_layernorm);
+
+        before_generate(gen_config);
+
+        std::vector<float> output;
+        for (auto &pack : packs)
+        {
+            PackedSequences packed(input_ids, offsets, pack);
+            auto r = run_graph(gen_config,
+                [&](ComputeContext *ctx) {
+                    ggml::tensor *pooled = packed.forward(ctx, model);
+                    return ggml::simple_norm(ctx, pooled, norm->eps);
+                },
+                [&]() { packed.write_input_data(); },
+                output);
+            if (!r)
+            {
+                ggml::log(GGML_LOG_LEVEL_ERROR, "Out of memory");
+                embeddings.clear();
+                return;
+            }
+
+            for (size_t k = 0; k < pack.size(); k++)
+                memcpy(embeddings.data() + (size_t)pack[k] * config.hidden_size, output.data() + k * config.hidden_size, config.hidden_size * sizeof(float));
+        }
+    }
 }
 
 namespace chatllm::bce::ranker
@@ -160,6 +253,51 @@ namespace chatllm::bce::ranker
         CHATLLM_CHECK(w_ctx_.get_used_mem() == w_ctx_.get_mem_size())
             << "corrupted model weights";
     }
+
+    void ConditionalGeneration::qa_rank_batch(const GenerationConfig &gen_config, const std::vector<int> &input_ids, const std::vector<size_t> &offsets,
+                                              std::vector<float> &scores)
+    {
+        const int num = (int)offsets.size() - 1;
+        scores.clear();
+        if (num < 1) return;
+        scores.resize(num, 0.0f);
+
+        std::vector<std::vector<int>> packs;
+        PackedSequences::make_packs(offsets, std::min(embedding_batch_tokens, config.max_length), packs);
+
+        ModelClass *model = get_typed_transformer<ModelClass>();
+        RobertaClassificationHead *head = dynamic_cast<RobertaClassificationHead *>(model->final_layernorm);
+        CHATLLM_CHECK(head != nullptr) << "classification head is required";
+
+        before_generate(gen_config);
+
+        std::vector<float> output;
+        for (auto &pack : packs)
+        {
+            PackedSequences packed(input_ids, offsets, pack);
+            auto r = run_graph(gen_config,
+                [&](ComputeContext *ctx) {
+                    ggml::tensor *pooled = packed.forward(ctx, model);
+                    return head->forward_pooled(ctx, pooled);
+                },
+                [&]() { packed.write_input_data(); },
+                output);
+            if (!r)
+            {
+                // a pack needs more memory than a single pair, so pairs of this pack are scored one by one
+                ggml::log(GGML_LOG_LEVEL_WARN, "Out of memory, scoring %d pairs one by one\n", (int)pack.size());
+                for (int s : pack)
+                {
+                    std::vector<int> ids(input_ids.begin() + offsets[s], input_ids.begin() + offsets[s + 1]);
+                    scores[s] = qa_rank(gen_config, ids);
+                }
+                continue;
+            }
+
+            for (size_t k = 0; k < pack.size(); k++)
+                scores[pack[k]] = output[k];
+        }
+    }
 }
 
 namespace chatllm
@@ -2,6 +2,60 @@
 #include "../src/models.h"
 #include "../src/models_priv.h"
 
+namespace chatllm::bce
+{
+    // sequences packed into a single forward pass: each one attends only to itself, and its positions start from 0.
+    class PackedSequences
+    {
+    public:
+        // groups consecutive sequences `input_ids[offsets[i] .. offsets[i + 1])` into packs of at most `max_tokens` tokens.
+        static void make_packs(const std::vector<size_t> &offsets, int max_tokens, std::vector<std::vector<int>> &packs);
+
+        PackedSequences(const std::vector<int> &input_ids, const std::vector<size_t> &offsets, const std::vector<int> &seqs);
+
+        // output: hidden states of the first token of each sequence
+        template <class ModelClass> ggml::tensor *forward(ComputeContext *ctx, ModelClass *model)
+        {
+            const int len = (int)ids.size();
+
+            ctx->move_to_layer(LayerAllocatorManager::MiscLayer::Prolog);
+            ids_tensor          = ggml::new_tensor_1d(ctx, GGML_TYPE_I32, len);
+            positions_tensor    = ggml::new_tensor_1d(ctx, GGML_TYPE_I32, len);
+            mask_tensor         = ggml::new_tensor_2d(ctx, GGML_TYPE_F32, len, len);
+            first_rows_tensor   = ggml::new_tensor_1d(ctx, GGML_TYPE_I32, (int64_t)first_rows.size());
+
+            auto embedding = dynamic_cast<RobertaEmbedding *>(model->word_embeddings);
+            CHATLLM_CHECK(embedding != nullptr) << "Roberta embedding is required";
+            ggml::tensor *hidden_states = embedding->forward(ctx, ids_tensor, positions_tensor);
+
+            for (int i = 0; i < model->get_layer_num(); i++)
+            {
+                ctx->move_to_layer(model->get_layer(i)->get_id());
+                auto &layer = model->layers[i];
+                layer.attention.mask = mask_tensor;
+                hidden_states = layer.forward(ctx, hidden_states, 0);
+                layer.attention.mask = nullptr;
+            }
+
+            ctx->move_to_layer(LayerAllocatorManager::MiscLayer::Epilog);
+            return ggml::get_rows(ctx, hidden_states, first_rows_tensor);
+        }
+
+        void write_input_data(void);
+
+    public:
+        std::vector<int> ids;
+        std::vector<int> positions;
+        std::vector<float> mask;
+        std::vector<int> first_rows;
+    protected:
+        ggml::tensor *ids_tensor        = nullptr;
+        ggml::tensor *positions_tensor  = nullptr;
+        ggml::tensor *mask_tensor       = nullptr;
+        ggml::tensor *first_rows_tensor = nullptr;
+    };
+}
+
 namespace chatllm::bce::embedding
 {
     struct Config : public BaseConfig
@@ -16,6 +70,8 @@ namespace chatllm::bce::embedding
 
         void encode(const std::string &text, std::vector<int> &ids) const override;
 
+        bool is_thread_safe(void) const override { return true; }
+
     protected:
         void encode(const std::string &text, std::vector<int> &ids, bool add_bos, bool add_eos, int max_length) const;
     };
@@ -31,6 +87,8 @@ namespace chatllm::bce::embedding
         ConditionalGeneration(const Config &config, const RuntimeConfig &runtime_config);
         void load(ModelLoader &loader) override;
         int get_embedding_dim(void) const override;
+        void embedding_batch(const GenerationConfig &gen_config, const std::vector<int> &input_ids, const std::vector<size_t> &offsets,
+                             std::vector<float> &embeddings) override;
     public:
         Config config;
     };
@@ -62,6 +120,8 @@ namespace chatllm::bce::ranker
         ConditionalGeneration(const Config &config, const RuntimeConfig &runtime_config, ModelType type);
 
         void load(ModelLoader &loader) override;
+        void qa_rank_batch(const GenerationConfig &gen_config, const std::vector<int> &input_ids, const std::vector<size_t> &offsets,
+                           std::vector<float> &scores) override;
     public:
         Config config;
     };
@@ -17,6 +17,9 @@ namespace chatllm::glm::v1
 
         void encode(const std::string &text, std::vector<int> &ids) const override;
 
+        // `postprocess` works on whole text
+        bool decode_incremental(const std::vector<int> &ids, std::string &carry, std::string &text) const override { return false; }
+
     protected:
         std::string preprocess(const std::string &text) const override;
         std::string postprocess(const std::string &text) const override;
@@ -40,6 +40,8 @@ namespace chatllm::grok::v1
             : BaseAttention(ctx, hidden_size, num_attention_heads, num_kv_heads, head_dim, max_length, qkv_bias, o_bias)
         {}
     protected:
+        bool is_fused_attn_supported(void) const override { return false; }
+
         ggml::tensor *apply_pos_embedding_kq(ComputeContext *ctx, ggml::tensor *kq, int hidden_size, int qlen, ggml::tensor *past) const override
         {
             float max = 30.0f;
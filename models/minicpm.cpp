@@ -529,6 +529,8 @@ namespace chatllm::minicpm::emb_light
             encode(text, ids, true, true);
         }
 
+        bool is_thread_safe(void) const override { return true; }
+
     protected:
         void encode(const std::string &text, std::vector<int> &ids, bool add_bos, bool add_eos) const
         {
@@ -675,6 +677,8 @@ namespace chatllm::minicpm::ranker_light
             BaseTokenizer::encode(text, ids);
         }
 
+        bool is_thread_safe(void) const override { return true; }
+
         void encode_qa(const std::string &q, const std::string &a, std::vector<int> &ids) const override
         {
             const int max_length = this->max_length;
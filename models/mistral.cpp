@@ -836,9 +836,13 @@ Always prioritize using tools to provide the most accurate and helpful response.
             ctx->get_allocator()->alloc(attn_scale);
         }
 
+        bool is_fused_attn_supported(void) const override { return false; }
+
         ggml::tensor *calc_attn_scores(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
             ggml::tensor *key_layer, ggml::tensor *query_layer, ggml::tensor *value_layer) override
         {
+            // view of `attn_scale` depends on `n_past`, which is not patched in a reused graph
+            ctx->graph_reuse.veto();
             auto scale = ggml::view_2d(ctx, attn_scale, 1, qlen, ggml::element_size(attn_scale), n_past * ggml::element_size(attn_scale));
             query_layer = ggml::mul(ctx, query_layer, scale);
 
@@ -503,6 +503,8 @@ namespace chatllm::qwen
                 return q;
             }
 
+            bool is_fused_attn_supported(void) const override { return false; }
+
             ggml::tensor *attn_scores_to_probs(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
                                             ggml::tensor *attn_scores) override
             {
@@ -806,6 +808,8 @@ namespace chatllm::qwen
 
             void encode_embedding(const std::string &text, std::vector<int> &ids, EmbeddingPurpose purpose) const override;
 
+            bool is_thread_safe(void) const override { return true; }
+
         public:
             std::string task;
         };
@@ -73,6 +73,8 @@ namespace chatllm::qwen::v3_5
         int64_t get_param_num(bool effective_only) const;
         void before_generate(const GenerationConfig &gen_config) override;
         void set_tokenizer(BaseTokenizer *tokenizer) override;
+        // states of linear attention layers (gated delta net, conv) can't be rewound
+        bool is_rewindable(void) const override { return false; }
     protected:
         bool generate_next_token(const std::vector<int> &input_ids, const GenerationConfig &gen_config, std::vector<float> &lm_logits) override;
     private:
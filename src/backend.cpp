@@ -1,3 +1,4 @@
+#include <cmath>
 #include <cstring>
 #include <set>
 #include <stdarg.h>
@@ -88,7 +89,7 @@ namespace chatllm
     LayerBufAllocator::LayerBufAllocator(): LayerBufAllocator(nullptr, nullptr, nullptr) {}
     LayerBufAllocator::LayerBufAllocator(ggml_backend_allocator alloc, Backend *backend): LayerBufAllocator(alloc, alloc, backend) {}
     LayerBufAllocator::LayerBufAllocator(ggml_backend_allocator alloc_matrix, ggml_backend_allocator alloc_others, Backend *backend)
-        : BackendBufAllocator(backend), alloc_matrix(alloc_matrix), alloc_others(alloc_others)
+        : BackendBufAllocator(backend), alloc_matrix(alloc_matrix), alloc_others(alloc_others), mapped(0)
     {
         CHATLLM_CHECK(alloc_matrix == alloc_others) << " TODO: alloc_matrix must be alloc_others now.";
     }
@@ -97,6 +98,8 @@ namespace chatllm
     {
         BackendBufAllocator::show_info();
         ggml::log(GGML_LOG_LEVEL_INFO, "\tMatrix = %s, Others = %s\n", ggml_backend_buft_name(get_allocator(Usage::Matrix)), ggml_backend_buft_name(get_allocator(Usage::Others)));
+        if (mapped > 0)
+            ggml::log(GGML_LOG_LEVEL_INFO, "\tmapped from file = %8.2f MiB\n", mapped / 1024.0 / 1024.0);
     }
 
     BackendBuffer *LayerBufAllocator::alloc(size_t size, Usage usage)
@@ -111,6 +114,25 @@ namespace chatllm
         return r;
     }
 
+    BackendBuffer *LayerBufAllocator::alloc_mapped(void *ptr, size_t size, Usage usage, size_t &offset)
+    {
+        ggml_backend_allocator allocator = get_allocator(usage);
+        if (allocator != ggml_backend_cpu_buffer_type()) return nullptr;
+
+        // the buffer base must be aligned, while tensor data in the file is only 16-byte aligned
+        const size_t align = ggml_backend_buft_get_alignment(allocator);
+        uint8_t *base = (uint8_t *)((uintptr_t)ptr & ~(uintptr_t)(align - 1));
+        offset = (uint8_t *)ptr - base;
+
+        ggml_backend_buffer_t buf = ggml_backend_cpu_buffer_from_ptr(base, size + offset);
+        CHATLLM_CHECK(buf) << __FUNCTION__ << "() failed to map buffer of size " << size;
+
+        mapped += size;
+        auto r = new BackendBuffer(buf);
+        buffers.emplace_back(r);
+        return r;
+    }
+
     bool LayerBufAllocator::alloc(ggml::tensor *tensor, Usage usage)
     {
         BackendBuffer *buf = alloc(get_alloc_size(tensor), usage);
@@ -197,6 +219,7 @@ namespace chatllm
     void LayerBufAllocator::free_all_buffers(void)
     {
         memset(&total, 0, sizeof(total));
+        mapped = 0;
         buffers.clear();
     }
 
@@ -778,11 +801,24 @@ namespace chatllm
 
     bool BackendContext::reserve_memory(ggml_cgraph *gf)
     {
+        alloc_count++;
         return ggml_backend_sched_reserve(sched, gf);
     }
 
+    size_t BackendContext::measure_memory(ggml_cgraph *gf)
+    {
+        std::vector<size_t> sizes(ggml_backend_sched_get_n_backends(sched), 0);
+        ggml_backend_sched_reserve_size(sched, gf, sizes.data());
+
+        size_t total = 0;
+        for (auto s : sizes)
+            total += s;
+        return total;
+    }
+
     bool BackendContext::alloc_graph(ggml_cgraph *gf)
     {
+        alloc_count++;
         return ggml_backend_sched_alloc_graph(sched, gf);
     }
 
@@ -943,7 +979,6 @@ namespace chatllm
     void ComputeContext::compute(void)
     {
         backend_context->compute_graph(get_cgraph());
-        temp_params.clear();
     }
 
     void ComputeContext::synchronize(void)
@@ -961,8 +996,14 @@ namespace chatllm
         return backend_context->reserve_memory(get_cgraph());
     }
 
+    size_t ComputeContext::measure_memory(void)
+    {
+        return backend_context->measure_memory(get_cgraph());
+    }
+
     void ComputeContext::reset(void)
     {
+        temp_params.clear();
         backend_context->reset();
         if (get_ctx())
             ggml_reset(get_ctx());
@@ -970,6 +1011,69 @@ namespace chatllm
             ggml_graph_clear(get_cgraph());
     }
 
+    int ComputeContext::GraphReuse::get_klen(int n_past, int qlen, int max_len) const
+    {
+        int len = n_past + qlen;
+        if (!is_enabled()) return len;
+        len = (len + kv_padding - 1) / kv_padding * kv_padding;
+        return len <= max_len ? len : max_len;
+    }
+
+    void ComputeContext::GraphReuse::add_patcher(patcher f, int ops)
+    {
+        patchers.push_back(f);
+        patched_ops += ops;
+    }
+
+    bool ComputeContext::GraphReuse::is_reusable(int attn_layers) const
+    {
+        // per attention layer: positions, K/V cache writes, K & V reads, causal mask
+        const int OPS_PER_LAYER = 5;
+        return is_enabled() && !vetoed
+            && (attn_layers > 0) && (this->attn_layers == attn_layers)
+            && (patched_ops == OPS_PER_LAYER * attn_layers);
+    }
+
+    void ComputeContext::GraphReuse::patch(ComputeContext *ctx, int n_past)
+    {
+        for (auto &f : patchers)
+        {
+            if (f) f(ctx, n_past);
+        }
+    }
+
+    bool ComputeContext::RowPositions::is_supported(int attn_layers) const
+    {
+        // per attention layer: positions, RoPE of K & Q, K/V cache writes, causal mask
+        const int PARTS_PER_LAYER = 5;
+        return is_enabled() && (attn_layers > 0) && (handled == PARTS_PER_LAYER * attn_layers);
+    }
+
+    ggml::tensor *ComputeContext::RowPositions::get_mask(ComputeContext *ctx, int klen)
+    {
+        if (mask)
+            return mask->ne[0] == klen ? mask : nullptr;
+
+        mask = ggml_new_tensor_4d(ctx->get_ctx(), GGML_TYPE_F32, klen, 1, 1, (int64_t)n_past.size());
+        ctx->cb_new_tensor(mask);
+        ggml_set_input(mask);
+        return mask;
+    }
+
+    void ComputeContext::RowPositions::write_mask(void)
+    {
+        if (nullptr == mask) return;
+
+        const int klen = (int)mask->ne[0];
+        std::vector<float> v((size_t)klen * n_past.size());
+        for (size_t b = 0; b < n_past.size(); b++)
+        {
+            for (int j = 0; j < klen; j++)
+                v[b * klen + j] = j <= n_past[b] ? 0.0f : -INFINITY;
+        }
+        Backend::write_tensor_data(mask, v.data(), 0, v.size() * sizeof(v[0]));
+    }
+
     size_t ComputeContext::get_used_mem(void)
     {
         return ggml_used_mem(get_ctx());
@@ -47,6 +47,8 @@ namespace chatllm
 
         void from_float(ggml::type type, const float *src, void  *dst, int64_t ne0, int64_t n_rows);
         void to_float  (ggml::type type, const void  *src, float *dst, int64_t ne0, int64_t n_rows);
+        // row-wise conversion between any two types (through F32), without a full-size F32 copy
+        void convert(ggml::type src_type, const void *src, ggml::type dst_type, void *dst, int64_t ne0, int64_t n_rows);
 
         type type_of(const ggml::tensor *tensor);
         type type_of(const ggml::tensor &a);
@@ -81,7 +83,7 @@ namespace chatllm
                         ggml::tensor *tensor) = 0;
         virtual void read_scaler(const std::string &name, float *value) = 0;
         virtual bool has_tensor(const std::string &name) const = 0;
-        static void map_tensor_element(ggml::tensor *tensor, std::function<float (float)> f);
+        virtual void map_tensor_element(ggml::tensor *tensor, std::function<float (float)> f);
     };
 
     // Is `ggml_backend_buffer_type_t` a good name?
@@ -163,6 +165,11 @@ namespace chatllm
         size_t get_alloc_size(ggml::tensor *tensor) override;
         size_t get_alloc_size(ggml::tensor *tensor, Usage usage) override;
 
+        // wrap host memory (e.g. a mapped model file) without copying.
+        // returns nullptr if `usage` is not served by the plain CPU buffer type.
+        // `offset` receives the position of `ptr` within the returned buffer.
+        BackendBuffer *alloc_mapped(void *ptr, size_t size, Usage usage, size_t &offset);
+
         bool supported_by_backend(Backend *backend, ggml::tensor *tensor) override;
 
         size_t get_alignment(Usage usage) const override;
@@ -184,6 +191,7 @@ namespace chatllm
         ggml_backend_allocator alloc_matrix;
         ggml_backend_allocator alloc_others;
         std::vector<std::unique_ptr<BackendBuffer>> buffers;
+        size_t mapped;
     };
 
     class LayerAllocatorManager
@@ -347,8 +355,15 @@ namespace chatllm
 
         bool reserve_memory(ggml_cgraph *gf);
 
+        // total size of compute buffers needed by the graph (nothing is allocated)
+        size_t measure_memory(ggml_cgraph *gf);
+
         bool alloc_graph(ggml_cgraph *gf);
 
+        // number of graphs that have been reserved or allocated so far.
+        // a graph that is kept for reuse is only valid while this is unchanged.
+        uint64_t get_alloc_count(void) const { return alloc_count; }
+
         void compute_graph(ggml_cgraph *gf);
 
         void reset();
@@ -382,6 +397,7 @@ namespace chatllm
         LayerBufAllocator host_allocator;
 
     protected:
+        uint64_t            alloc_count         = 0;
         ggml_abort_callback abort_callback      = nullptr;
         void *              abort_callback_data = nullptr;
 
@@ -401,6 +417,8 @@ namespace chatllm
         struct UserOptions
         {
             bool moe_on_cpu = false;
+            // use fused attention (`ggml_flash_attn_ext`) where supported
+            bool flash_attn = false;
         };
 
         ComputeContext(BackendContext *backend_context);
@@ -429,6 +447,8 @@ namespace chatllm
 
         virtual bool reserve_memory(void);
 
+        virtual size_t measure_memory(void);
+
         virtual void reset(void);
 
         virtual size_t get_used_mem(void);
@@ -444,6 +464,76 @@ namespace chatllm
     public:
         UserOptions user_options;
 
+        // first KV cache slot (batch row) that this graph reads and writes
+        int kv_slot = 0;
+
+        // with `kv_slot_rows` unset, a batch smaller than the reserved one is broadcast to all slots
+        // (e.g. Janus prefills the conditional & unconditional rows once for all parallel images);
+        // otherwise each batch row is written to its own slot only.
+        bool kv_slot_rows = false;
+
+        // Per-row positions of a batched decoding step (`qlen == 1`), where each row (KV slot) has its own `n_past`:
+        // layers are given the largest `n_past`, and attention layers that handle the rows (positions, K/V cache writes,
+        // causal mask) count each part, so that a graph having any layer unaware of the rows can be told and rejected.
+        class RowPositions
+        {
+        public:
+            bool is_enabled(void) const { return n_past.size() > 0; }
+
+            void handle(int parts = 1) { handled += parts; }
+
+            // `attn_layers`: number of attention layers that are expected in the graph
+            bool is_supported(int attn_layers) const;
+
+            // causal mask of the rows: [batch, 1, 1, klen], shared by all layers. `nullptr` if `klen` differs from
+            // the one of the shared mask.
+            ggml::tensor *get_mask(ComputeContext *ctx, int klen);
+
+            // call after the graph is allocated
+            void write_mask(void);
+
+        public:
+            std::vector<int> n_past;
+        private:
+            int handled = 0;
+            ggml::tensor *mask = nullptr;
+        };
+
+        RowPositions row_positions;
+
+        // Graph reuse for decoding steps:
+        // K/V read from cache are padded to a multiple of `kv_padding` (masked by the causal mask),
+        // attention layers that can't take padded keys read them unpadded and veto the reuse of the graph,
+        // and every operation that depends on `n_past` registers a patcher, so a built graph
+        // can be re-targeted to another `n_past` without being built again.
+        class GraphReuse
+        {
+        public:
+            typedef std::function<void(ComputeContext *ctx, int n_past)> patcher;
+
+            bool is_enabled(void) const { return kv_padding > 0; }
+            int  get_klen(int n_past, int qlen, int max_len) const;
+
+            // `f` can be `nullptr` for operations that are unchanged within a padded length
+            void add_patcher(patcher f, int ops = 1);
+            void veto(void) { vetoed = true; }
+
+            // `attn_layers`: number of attention layers that are expected in the graph
+            bool is_reusable(int attn_layers) const;
+
+            void patch(ComputeContext *ctx, int n_past);
+
+        public:
+            int kv_padding = 0;
+            int attn_layers = 0;
+            int patched_ops = 0;
+        private:
+            bool vetoed = false;
+            std::vector<patcher> patchers;
+        };
+
+        GraphReuse graph_reuse;
+
     protected:
         virtual ggml_backend_sched_t get_sched(void);
 
@@ -4,6 +4,7 @@
 #include <codecvt>
 #include <cstring>
 #include <fcntl.h>
+#include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -412,11 +413,24 @@ namespace chatllm
     {
         is_prompt = false;
 
+        std::string printable_text;
+        if (!tokenizer->decode_incremental(output_ids, decode_carry, printable_text))
+            printable_text = decode_cached(output_ids);
+
+        if (printable_text.size() > 0)
+        {
+            call_put_chunk(is_first, printable_text);
+            is_first = false;
+        }
+    }
+
+    std::string BaseStreamer::decode_cached(const std::vector<int> &output_ids)
+    {
         token_cache.insert(token_cache.end(), output_ids.begin(), output_ids.end());
         std::string text = tokenizer->decode(token_cache);
         if (text.empty())
         {
-            return;
+            return "";
         }
 
         std::string printable_text;
@@ -436,12 +450,7 @@ namespace chatllm
                 print_len = end;
             }
         }
-
-        if (printable_text.size() > 0)
-        {
-            call_put_chunk(is_first, printable_text);
-            is_first = false;
-        }
+        return printable_text;
     }
 
     void BaseStreamer::end()
@@ -457,6 +466,12 @@ namespace chatllm
             }
         }
 
+        if (decode_carry.size() > 0)
+        {
+            call_put_chunk(is_first, decode_carry);
+            decode_carry.clear();
+        }
+
         if (interceptor)
         {
             auto it = interceptor;
@@ -468,6 +483,7 @@ namespace chatllm
         is_first = true;
         is_prompt = true;
         token_cache.clear();
+        decode_carry.clear();
         print_len = 0;
     }
 
@@ -684,6 +700,20 @@ namespace chatllm
         encode(text, ids);
     }
 
+    void BaseTokenizer::encode_batch(const std::vector<std::string> &texts, std::vector<int> &ids, std::vector<size_t> &offsets, int num_threads) const
+    {
+        tokenizer::encode_in_parallel(texts.size(), [this, &texts](size_t i, std::vector<int> &r) { encode(texts[i], r); },
+                                      ids, offsets, is_thread_safe() ? num_threads : 1);
+    }
+
+    void BaseTokenizer::encode_embedding_batch(const std::vector<std::string> &texts, std::vector<int> &ids, std::vector<size_t> &offsets,
+                                               EmbeddingPurpose purpose, int num_threads) const
+    {
+        // through the `Content` overload, which is the one customized by some tokenizers
+        tokenizer::encode_in_parallel(texts.size(), [this, &texts, purpose](size_t i, std::vector<int> &r) { encode_embedding(Content(nullptr, texts[i]), r, purpose); },
+                                      ids, offsets, is_thread_safe() ? num_threads : 1);
+    }
+
     void BaseTokenizer::encode_qa(const Content &q, const Content &a, std::vector<int> &ids) const
     {
         CHATLLM_CHECK(q.is_simple_text() && a.is_simple_text());
@@ -717,6 +747,16 @@ namespace chatllm
         return text;
     }
 
+    bool BaseTokenizer::decode_incremental(const std::vector<int> &ids, std::string &carry, std::string &text) const
+    {
+        std::vector<int> normal_ids;
+        normal_ids.reserve(ids.size());
+        for (auto id : ids)
+            if (!is_special_id(id)) normal_ids.push_back(id);
+        tp->DecodeIncremental(normal_ids, carry, &text);
+        return true;
+    }
+
     int BaseTokenizer::get_history_start(const Messages &history, int max_length) const
     {
         int start = (int)history.size() - 1;
@@ -1038,7 +1078,9 @@ namespace chatllm
         CHATLLM_CHECK(fstat(fd, &sb) == 0) << strerror(errno);
         _size = sb.st_size;
 
-        data = (char *)mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+        // private writable mapping: weights are used in place, and the rare in-place
+        // modification of a weight only copies the touched pages.
+        data = (char *)mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
         CHATLLM_CHECK(data != MAP_FAILED) << strerror(errno);
 
         CHATLLM_CHECK(close(fd) == 0) << strerror(errno);
@@ -1058,10 +1100,10 @@ namespace chatllm
 
         HANDLE hFile = (HANDLE)_get_osfhandle(fd);
 
-        HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL);
         CHATLLM_CHECK(hMapping != NULL) << strerror(errno);
 
-        data = (char *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+        data = (char *)MapViewOfFile(hMapping, FILE_MAP_COPY, 0, 0, 0);
         CloseHandle(hMapping);
 
         CHATLLM_CHECK(data != NULL) << strerror(errno);
@@ -1101,6 +1143,12 @@ namespace chatllm
         return len;
     }
 
+    void *MappedFile::get_mapped(int64_t offset, size_t len)
+    {
+        if ((offset < 0) || (offset + (int64_t)len > size())) return nullptr;
+        return data + offset;
+    }
+
     SimpleFile::SimpleFile(const std::string &path)
     {
         f = std::fopen(path.c_str(), "rb");
@@ -1140,7 +1188,7 @@ namespace chatllm
     }
 
     TensorInfo::TensorInfo(ggml::type type, int n_dim, const int64_t *ne, size_t _offset, const char *name)
-        : _offset(_offset), data(nullptr), original_type(ggml::type::GGML_TYPE_F32)
+        : _offset(_offset), data(nullptr), original_type(ggml::type::GGML_TYPE_F32), data_offset(0)
     {
         ggml::init_tensor(&tensor, type, n_dim, ne);
         usage = ggml::n_dims(&tensor) > 1 ? BackendBufAllocator::Usage::Matrix : BackendBufAllocator::Usage::Others;
@@ -1180,10 +1228,14 @@ namespace chatllm
 
         this->original_type = ggml::type_of(tensor);
         ggml::change_type(&tensor, target_type);
+        this->alloc = alloc;
+
+        if (load_mapped(reader, alloc, target_type, override_buffer_size))
+            return true;
+
         size_t alloc_size = std::max(override_buffer_size, alloc->get_alloc_size(&tensor, usage));
         data = alloc->alloc(alloc_size, usage);
         data->assign_to(&tensor);
-        this->alloc = alloc;
 
         if (reader)
             read_tensor_data(reader, _offset, 0, ggml::nbytes(&tensor), target_type);
@@ -1191,6 +1243,24 @@ namespace chatllm
         return true;
     }
 
+    bool TensorInfo::load_mapped(tokenizer::DataReader *reader, LayerBufAllocator *alloc, ggml::type target_type, size_t override_buffer_size)
+    {
+        if (target_type != original_type) return false;
+        if (override_buffer_size > ggml::nbytes(&tensor)) return false;
+
+        MappedFile *file = dynamic_cast<MappedFile *>(reader);
+        if (nullptr == file) return false;
+
+        void *p = file->get_mapped(aligned_data_start(_offset), ggml::nbytes(&tensor));
+        if (nullptr == p) return false;
+
+        data = alloc->alloc_mapped(p, ggml::nbytes(&tensor), usage, data_offset);
+        if (nullptr == data) return false;
+
+        data->assign_to(&tensor, data_offset);
+        return true;
+    }
+
     size_t TensorInfo::read_raw_tensor_data(tokenizer::DataReader *reader, size_t data_size, void *p)
     {
         reader->seek(aligned_data_start(_offset), SEEK_SET);
@@ -1219,47 +1289,50 @@ namespace chatllm
                 return read_tensor_data_f16_f32(reader, read_offset, write_offset, data_size);
             else
             {
-                std::vector<uint8_t> buf;
-                std::vector<uint8_t> buf_q;
-
                 ggml::tensor t;
-                ggml::init_tensor(&t, ggml::type::GGML_TYPE_F32, 4, src_tensor->ne);
-                buf.resize(ggml::nbytes(&t));
+                ggml::init_tensor(&t, original_type, 4, src_tensor->ne);
+                const size_t src_size = ggml::nbytes(&t);
+                ggml::init_tensor(&t, target_type, 4, src_tensor->ne);
+                const size_t dst_size = ggml::nbytes(&t);
+
+                if (data_size < dst_size)
+                    CHATLLM_CHECK(dst_size == data_size) << "size mismatch? " << dst_size << " : " << data_size;
+
+                // convert straight from the mapped file when possible
+                std::vector<uint8_t> buf_src;
+                MappedFile *file = dynamic_cast<MappedFile *>(reader);
+                const void *src = file ? file->get_mapped(aligned_data_start(read_offset), src_size) : nullptr;
+                if (nullptr == src)
+                {
+                    buf_src.resize(src_size);
+                    reader->read_buffer(buf_src.data(), buf_src.size());
+                    src = buf_src.data();
+                }
 
-                if (ggml::type::GGML_TYPE_F32 == original_type)
+                if (data->is_host())
                 {
-                    reader->read_buffer(buf.data(), buf.size());
+                    ggml::convert(original_type, src, target_type, (uint8_t *)data->get_base() + data_offset + write_offset,
+                                  ggml::get_dim(&t, 0), ggml::nrows(&t));
                 }
                 else
                 {
-                    ggml::init_tensor(&t, original_type, 4, src_tensor->ne);
-                    buf_q.resize(ggml::nbytes(&t));
-                    reader->read_buffer(buf_q.data(), buf_q.size());
-
-                    ggml::to_float(original_type, buf_q.data(), (float *)buf.data(), ggml::get_dim(&t, 0), ggml::nrows(&t));
+                    std::vector<uint8_t> buf_q(dst_size);
+                    ggml::convert(original_type, src, target_type, buf_q.data(), ggml::get_dim(&t, 0), ggml::nrows(&t));
+                    alloc->get_backend()->write_tensor_data(&tensor, buf_q.data(), write_offset, buf_q.size());
                 }
 
-                ggml::init_tensor(&t, target_type, 4, src_tensor->ne);
-                buf_q.resize(ggml::nbytes(&t));
-                ggml::from_float(target_type, (const float *)buf.data(), (void *)buf_q.data(), ggml::get_dim(&t, 0), ggml::nrows(&t));
-
-                if (data_size < buf_q.size())
-                    CHATLLM_CHECK(buf_q.size() == data_size) << "size mismatch? " << buf_q.size() << " : " << data_size;
-
-                alloc->get_backend()->write_tensor_data(&tensor, buf_q.data(), write_offset, buf_q.size());
-
-                return buf_q.size();
+                return dst_size;
             }
         }
 
 
         if (data->is_host())
         {
-            reader->read_buffer((uint8_t *)data->get_base() + write_offset, data_size);
+            reader->read_buffer((uint8_t *)data->get_base() + data_offset + write_offset, data_size);
 #if (0)
             if (std::string(tensor.name).find("embed_tokens.weight") != std::string::npos)
             {
-                int8_t *p = (int8_t *)data->get_base() + write_offset;
+                int8_t *p = (int8_t *)data->get_base() + data_offset + write_offset;
                 printf("patching emb (Q8_0)\n");
 
                 #define DIM 1536
@@ -1326,7 +1399,7 @@ namespace chatllm
         }
 
         if (data->is_host())
-            memcpy((uint8_t *)data->get_base() + write_offset, buf.data(), data_size);
+            memcpy((uint8_t *)data->get_base() + data_offset + write_offset, buf.data(), data_size);
         else
             alloc->get_backend()->write_tensor_data(&tensor, buf.data(), write_offset, data_size);
 
@@ -1347,7 +1420,7 @@ namespace chatllm
         }
 
         if (data->is_host())
-            memcpy((uint8_t *)data->get_base() + write_offset, buf.data(), data_size);
+            memcpy((uint8_t *)data->get_base() + data_offset + write_offset, buf.data(), data_size);
         else
             alloc->get_backend()->write_tensor_data(&tensor, buf.data(), write_offset, data_size);
 
@@ -1356,7 +1429,7 @@ namespace chatllm
 
     void TensorInfo::assign_to(ggml::tensor *tensor)
     {
-        data->assign_to(tensor);
+        data->assign_to(tensor, data_offset);
     }
 
     void TensorLoader::map_tensor_element(ggml::tensor *tensor, std::function<float (float)> f)
@@ -1427,6 +1500,258 @@ namespace chatllm
 
             seek(t.aligned_size(), SEEK_CUR);
         }
+
+        size_t total = 0;
+        for (auto &kv : tensor_dict)
+            total += kv.second.get_nbytes();
+        load_monitor.reset(new TensorLoadMonitor(dynamic_cast<MappedFile *>(_file.get()), total));
+    }
+
+    void ModelLoader::finish_loading(void)
+    {
+        if (load_monitor) load_monitor->finish();
+        load_monitor.reset();
+    }
+
+    void ModelLoader::map_tensor_element(ggml::tensor *tensor, std::function<float (float)> f)
+    {
+        // keep the file data before mapping: a mapped tensor may share memory with the file
+        const std::string name = translate_tensor_name(tensor->name);
+        auto search = tensor_dict.find(name);
+        if ((search != tensor_dict.end()) && (mapped_tensors.find(name) == mapped_tensors.end()))
+        {
+            TensorInfo &t = search->second;
+            ggml::tensor raw;
+            ggml::init_tensor(&raw, t.original_type, 4, t.tensor.ne);
+            auto &data = mapped_tensors[name];
+            data.resize(ggml::nbytes(&raw));
+            t.read_raw_tensor_data(_file.get(), data.size(), data.data());
+        }
+
+        TensorLoader::map_tensor_element(tensor, f);
+    }
+
+    void ModelLoader::save_converted(const std::string &path)
+    {
+        if (ff != FileFormat::GGMM)
+        {
+            ggml::log(GGML_LOG_LEVEL_WARN, "only GGMM files can be cached, skip writing %s\n", path.c_str());
+            return;
+        }
+
+        CHATLLM_CHECK(ggml_header.offset_tensors > 0) << "GGMM header broken";
+
+        std::vector<TensorInfo *> tensors;
+        for (auto &kv : tensor_dict)
+        {
+            // tensors made up by concatenation do not exist in the file
+            if (kv.second._offset > 0)
+                tensors.push_back(&kv.second);
+        }
+        std::sort(tensors.begin(), tensors.end(), [](TensorInfo *a, TensorInfo *b) { return a->_offset < b->_offset; });
+
+        const std::string tmp_path = path + ".tmp";
+        std::ofstream f(tmp_path, std::ios::binary);
+        CHATLLM_CHECK(f.is_open()) << "cannot create file " << tmp_path;
+
+        // header, meta, config and tokenizer are kept as is
+        std::vector<uint8_t> buf(ggml_header.offset_tensors);
+        _file->seek(0, SEEK_SET);
+        _file->read_buffer(buf.data(), buf.size());
+        f.write((const char *)buf.data(), buf.size());
+
+        for (auto t : tensors)
+        {
+            const ggml::type file_type = t->data ? t->original_type : ggml::type_of(t->tensor);
+            // mapped tensors are kept as in the original file, since they will be mapped again on reload
+            auto mapped = mapped_tensors.find(t->tensor.name);
+            const bool converted = (t->data != nullptr) && (file_type != ggml::type_of(t->tensor))
+                                    && (mapped == mapped_tensors.end());
+            const ggml::type type = converted ? ggml::type_of(t->tensor) : file_type;
+            const std::string name(t->tensor.name);
+
+            const int name_size = (int)name.size();
+            f.write((const char *)&name_size, sizeof(name_size));
+            f.write(name.data(), name.size());
+
+            const int ndim = ggml::n_dims(&t->tensor);
+            f.write((const char *)&ndim, sizeof(ndim));
+            for (int i = ndim - 1; i >= 0; i--)
+            {
+                const int dim_size = (int)t->tensor.ne[i];
+                f.write((const char *)&dim_size, sizeof(dim_size));
+            }
+            const int dtype = (int)type;
+            f.write((const char *)&dtype, sizeof(dtype));
+
+            const size_t pos = (size_t)f.tellp();
+            const size_t aligned = t->aligned_data_start(pos);
+            buf.assign(aligned - pos, 0);
+            f.write((const char *)buf.data(), buf.size());
+
+            if (mapped != mapped_tensors.end())
+            {
+                buf = mapped->second;
+            }
+            else if (converted)
+            {
+                buf.resize(ggml::nbytes(&t->tensor));
+                Backend::read_tensor_data(&t->tensor, buf.data());
+            }
+            else
+            {
+                ggml::tensor raw;
+                ggml::init_tensor(&raw, type, 4, t->tensor.ne);
+                buf.resize(ggml::nbytes(&raw));
+                t->read_raw_tensor_data(_file.get(), buf.size(), buf.data());
+            }
+            f.write((const char *)buf.data(), buf.size());
+        }
+
+        f.close();
+        CHATLLM_CHECK(!f.fail()) << "failed to write " << tmp_path;
+
+        std::filesystem::rename(tmp_path, path);
+        ggml::log(GGML_LOG_LEVEL_INFO, "re-quantized model cached to %s\n", path.c_str());
+    }
+
+    std::string ModelLoader::requant_cache_path(const std::string &path, const std::string &cache_dir, ggml::type type)
+    {
+        // fingerprint: size, the leading 1 MiB (header, config, tokenizer, ...) and samples across the tensor data.
+        // hashing the whole file would cost as much I/O as loading it.
+        const size_t HEAD_SIZE   = 1024 * 1024;
+        const size_t SAMPLE_SIZE = 64 * 1024;
+        const int    SAMPLES     = 64;
+
+        SimpleFile file(path);
+        const size_t size = (size_t)file.size();
+
+        uint64_t hash = 0xcbf29ce484222325ull;
+        auto update = [&hash](const uint8_t *p, size_t len) {
+            for (size_t i = 0; i < len; i++)
+            {
+                hash ^= p[i];
+                hash *= 0x100000001b3ull;
+            }
+        };
+
+        update((const uint8_t *)&size, sizeof(size));
+
+        std::vector<uint8_t> buf(HEAD_SIZE);
+        file.seek(0, SEEK_SET);
+        update(buf.data(), file.read_buffer(buf.data(), buf.size()));
+
+        if (size > HEAD_SIZE + SAMPLE_SIZE)
+        {
+            buf.resize(SAMPLE_SIZE);
+            for (int i = 1; i <= SAMPLES; i++)
+            {
+                file.seek(HEAD_SIZE + (size - HEAD_SIZE - SAMPLE_SIZE) / SAMPLES * i, SEEK_SET);
+                update(buf.data(), file.read_buffer(buf.data(), buf.size()));
+            }
+        }
+
+        std::ostringstream oss;
+        oss << std::filesystem::path(path).stem().string() << "-" << std::hex << std::setw(16) << std::setfill('0') << hash
+            << "-" << ggml::type_to_str(type) << ".bin";
+
+        std::filesystem::create_directories(cache_dir);
+        return (std::filesystem::path(cache_dir) / oss.str()).string();
+    }
+
+    TensorLoadMonitor::TensorLoadMonitor(MappedFile *file, size_t total_bytes)
+        : file(file), total_bytes(total_bytes), loaded_bytes(0), reported(0),
+          t_start(std::chrono::steady_clock::now()),
+          next(0), limit(0), stopped(false)
+    {
+        if (file)
+            worker = std::thread([this]() { prefetch_worker(); });
+    }
+
+    TensorLoadMonitor::~TensorLoadMonitor()
+    {
+        finish();
+    }
+
+    void TensorLoadMonitor::prefetch_worker(void)
+    {
+        const size_t PAGE_BYTES = 4096;
+        const size_t CHUNK_SIZE = 4 * 1024 * 1024;
+        volatile uint8_t sink = 0;
+
+        while (true)
+        {
+            size_t from = 0;
+            size_t to   = 0;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return stopped || (next < limit); });
+                if (stopped) break;
+
+                from = next;
+                to   = std::min(limit, from + CHUNK_SIZE);
+                next = to;
+            }
+
+            const uint8_t *p = (const uint8_t *)file->get_mapped(from, to - from);
+            if (nullptr == p) continue;
+            for (size_t i = 0; i < to - from; i += PAGE_BYTES)
+                sink = sink + p[i];
+        }
+    }
+
+    void TensorLoadMonitor::on_loaded(size_t offset, size_t bytes)
+    {
+        if (file)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            const size_t end = offset + bytes;
+            // restart when falling behind, or when loading jumps backwards
+            if ((next < end) || (next > end + PREFETCH_WINDOW))
+                next = end;
+            limit = std::min(end + PREFETCH_WINDOW, (size_t)file->size());
+            cv.notify_one();
+        }
+
+        loaded_bytes += bytes;
+        if (total_bytes < 1) return;
+
+        const int percent = (int)(loaded_bytes * 100 / total_bytes);
+        if (percent / 10 <= reported / 10) return;
+        reported = percent;
+
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+        ggml::log(GGML_LOG_LEVEL_INFO, "loading tensors: %3d%%, %8.2f MiB/s\n", percent,
+                  elapsed > 0 ? loaded_bytes / 1024.0 / 1024.0 / elapsed : 0.0);
+    }
+
+    void TensorLoadMonitor::finish(void)
+    {
+        if (worker.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopped = true;
+                cv.notify_one();
+            }
+            worker.join();
+        }
+
+        if (loaded_bytes < 1) return;
+
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+        ggml::log(GGML_LOG_LEVEL_INFO, "loaded %.2f MiB of tensors in %.2f s (%.2f MiB/s)\n",
+                  loaded_bytes / 1024.0 / 1024.0, elapsed, elapsed > 0 ? loaded_bytes / 1024.0 / 1024.0 / elapsed : 0.0);
+        loaded_bytes = 0;
+    }
+
+    tokenizer::DataReader *ModelLoader::open_file(const std::string &path, bool use_mmap)
+    {
+#if defined(_POSIX_MAPPED_FILES) || defined(_WIN32)
+        if (use_mmap)
+            return new MappedFile(path);
+#endif
+        return new SimpleFile(path);
     }
 
     LayerAllocatorManager *ModelLoader::alloc_manager()
@@ -1542,8 +1867,14 @@ namespace chatllm
             override_alloc_size = allocator->get_alloc_size(tensor, t.usage);
         }
 
+        const bool fresh = nullptr == t.data;
+        const size_t file_bytes = t.get_nbytes();
+
         CHATLLM_CHECK(t.load(_file.get(), allocator, tensor->type, override_alloc_size)) << "failed to load tensor: " << name;
 
+        if (fresh && load_monitor)
+            load_monitor->on_loaded(t.aligned_data_start(t._offset), file_bytes);
+
         t.assign_to(tensor);
     }
 
@@ -1605,6 +1936,8 @@ namespace chatllm
 
             size_t size = search->second.get_nbytes();
             size = t.read_tensor_data(_file.get(), search->second._offset, write_offset, size, tensor->type, &search->second.tensor);
+            if (load_monitor)
+                load_monitor->on_loaded(search->second.aligned_data_start(search->second._offset), search->second.get_nbytes());
 
             CHATLLM_CHECK(total_size >= size) << "tensor " << name << " too much data: " << total_size << " > " << size;
 
@@ -1660,9 +1993,18 @@ namespace chatllm
         ModelFactory::Result result = {nullptr, nullptr};
         if (path.size() > 0)
         {
-            loader = std::unique_ptr<ModelLoader>(new ModelLoader(path));
+            const std::string cache_dir = utils::get_opt(args.additional, "requant_cache", "");
+            std::string cache_path;
+            if ((args.re_quantize >= 0) && (cache_dir.size() > 0))
+                cache_path = ModelLoader::requant_cache_path(path, cache_dir, (ggml::type)args.re_quantize);
+            const bool cached = (cache_path.size() > 0) && std::filesystem::exists(cache_path);
+
+            loader = std::unique_ptr<ModelLoader>(new ModelLoader(cached ? cache_path : path, utils::get_opt(args.additional, "mmap", true)));
             if (!ModelFactory::load(*loader, result, args))
                 CHATLLM_THROW << "ModelFactory::load() failed";
+
+            if ((cache_path.size() > 0) && !cached)
+                loader->save_converted(cache_path);
         }
 
         tokenizer = std::move(result.tokenizer);
@@ -1741,6 +2083,116 @@ namespace chatllm
             memcpy(buffers[i].data(), sess.buffers[i].data(), buffers[i].size());
     }
 
+    PromptPrefixCache::PromptPrefixCache(int capacity) : capacity(capacity > 0 ? capacity : 0), clock(0)
+    {
+    }
+
+    void PromptPrefixCache::set_capacity(int capacity)
+    {
+        this->capacity = capacity > 0 ? capacity : 0;
+        while ((int)entries.size() > this->capacity)
+        {
+            auto oldest = std::min_element(entries.begin(), entries.end(),
+                [](const std::unique_ptr<Entry> &a, const std::unique_ptr<Entry> &b) { return a->last_used < b->last_used; });
+            entries.erase(oldest);
+        }
+    }
+
+    void PromptPrefixCache::clear(void)
+    {
+        entries.clear();
+    }
+
+    void PromptPrefixCache::hash_blocks(const std::vector<int> &ids, std::vector<uint64_t> &hashes)
+    {
+        // FNV-1a, continued from block to block
+        uint64_t h = 0xcbf29ce484222325ull;
+        hashes.clear();
+        for (size_t i = 0; i + BLOCK_SIZE <= ids.size(); i += BLOCK_SIZE)
+        {
+            for (size_t j = i; j < i + BLOCK_SIZE; j++)
+            {
+                h ^= (uint32_t)ids[j];
+                h *= 0x100000001b3ull;
+            }
+            hashes.push_back(h);
+        }
+    }
+
+    int PromptPrefixCache::match(const Entry &entry, const std::vector<int> &ids, const std::vector<uint64_t> &hashes)
+    {
+        size_t blocks = 0;
+        while ((blocks < hashes.size()) && (blocks < entry.block_hashes.size()) && (hashes[blocks] == entry.block_hashes[blocks]))
+            blocks++;
+
+        size_t n = blocks * BLOCK_SIZE;
+        while ((n < ids.size()) && (n < entry.ids.size()) && (ids[n] == entry.ids[n]))
+            n++;
+        return (int)n;
+    }
+
+    ModelSessionMemory *PromptPrefixCache::find(const std::vector<int> &ids, int &matched)
+    {
+        matched = 0;
+        if (entries.size() < 1) return nullptr;
+
+        std::vector<uint64_t> hashes;
+        hash_blocks(ids, hashes);
+
+        // only snapshots of whole prefixes are restored: a snapshot is never rewound to a shorter length,
+        // which is not possible for states other than the KV cache (e.g. recurrent states, sliding windows).
+        Entry *best = nullptr;
+        for (auto &entry : entries)
+        {
+            int n = match(*entry, ids, hashes);
+            if ((n == (int)entry->ids.size()) && (n > matched))
+            {
+                matched = n;
+                best = entry.get();
+            }
+        }
+
+        if (nullptr == best) return nullptr;
+
+        best->last_used = ++clock;
+        return &best->session;
+    }
+
+    ModelSessionMemory *PromptPrefixCache::add(const std::vector<int> &ids)
+    {
+        if (capacity < 1) return nullptr;
+
+        std::vector<uint64_t> hashes;
+        hash_blocks(ids, hashes);
+
+        Entry *entry = nullptr;
+        for (auto &e : entries)
+        {
+            if ((e->ids.size() == ids.size()) && (e->block_hashes == hashes) && (e->ids == ids))
+            {
+                entry = e.get();
+                break;
+            }
+        }
+
+        if (nullptr == entry)
+        {
+            if ((int)entries.size() >= capacity)
+            {
+                auto oldest = std::min_element(entries.begin(), entries.end(),
+                    [](const std::unique_ptr<Entry> &a, const std::unique_ptr<Entry> &b) { return a->last_used < b->last_used; });
+                entries.erase(oldest);
+            }
+            entries.push_back(std::make_unique<Entry>());
+            entry = entries.back().get();
+            entry->ids = ids;
+            entry->block_hashes = std::move(hashes);
+        }
+
+        entry->last_used = ++clock;
+        return &entry->session;
+    }
+
     void ModelSessionMemory::dump(const char *fn)
     {
         FILE *f = fopen(fn, "wb");
@@ -1794,6 +2246,9 @@ namespace chatllm
         input_ids = tokenizer->encode_history(history, gen_config.max_context_length, continuous, true, gen_config.reversed_role);
         add_ai_prefix(input_ids, gen_config, streamer);
 
+        if (!continuous && prefill_with_prefix_cache(input_ids, gen_config))
+            continuous = true;
+
         std::vector<int> output_ids = model->generate(input_ids, gen_config, continuous, completed, &performance, streamer);
         if (!completed)
         {
@@ -1828,6 +2283,9 @@ namespace chatllm
         input_ids = tokenizer->encode_history(history, gen_config.max_context_length, continuous, true, gen_config.reversed_role);
         add_ai_prefix(input_ids, gen_config, streamer);
 
+        if (!continuous && prefill_with_prefix_cache(input_ids, gen_config))
+            continuous = true;
+
         std::vector<int> output_ids = model->generate(input_ids, gen_config, continuous, completed, &performance, streamer);
         if (!completed)
         {
@@ -1942,6 +2400,131 @@ namespace chatllm
         }
     }
 
+    // drafts tokens greedily with a (smaller) model
+    class ModelDrafter : public TokenDrafter
+    {
+    public:
+        ModelDrafter(AbstractModel *model, int vocab_size) : model(model), vocab_size(vocab_size), gen_config(), base_n_past(0) {}
+
+        void begin(const std::vector<int> &input_ids, const GenerationConfig &gen_config, bool continuous, int n_past) override
+        {
+            this->gen_config = gen_config;
+            int past = continuous ? n_past : 0;
+            if (past > model->get_n_past())
+                past = model->get_n_past();
+            model->set_n_past(past);
+            pending = input_ids;
+            fed_drafts.clear();
+        }
+
+        void draft(const std::vector<int> &accepted, int max_n, std::vector<int> &drafted) override
+        {
+            drafted.clear();
+
+            // drafts that were accepted are already evaluated
+            size_t common = 0;
+            while ((common < accepted.size()) && (common < fed_drafts.size()) && (accepted[common] == fed_drafts[common]))
+                common++;
+            if (fed_drafts.size() > 0)
+                model->set_n_past(base_n_past + (int)common);
+            fed_drafts.clear();
+            pending.insert(pending.end(), accepted.begin() + common, accepted.end());
+
+            if (pending.size() < 1) return;
+            if (model->get_n_past() + (int)pending.size() + max_n >= std::min(gen_config.max_length, model->get_max_length())) return;
+
+            std::vector<float> logits;
+            if (!model->generate_next_token(pending, gen_config, logits) || (logits.size() < 1))
+            {
+                pending.clear();
+                return;
+            }
+            model->set_n_past(model->get_n_past() + (int)pending.size());
+            pending.clear();
+            base_n_past = model->get_n_past();
+
+            while (true)
+            {
+                // logits of the last token only; entries beyond the vocabulary (padding) are ignored
+                const int n = std::min((int)logits.size(), vocab_size);
+                const int next = (int)(std::max_element(logits.data(), logits.data() + n) - logits.data());
+                drafted.push_back(next);
+                if ((int)drafted.size() >= max_n) break;
+
+                if (!model->generate_next_token({next}, gen_config, logits) || (logits.size() < 1)) break;
+                model->set_n_past(model->get_n_past() + 1);
+                fed_drafts.push_back(next);
+            }
+        }
+
+    protected:
+        AbstractModel *model;
+        const int vocab_size;
+        GenerationConfig gen_config;
+        std::vector<int> pending;       // to be evaluated
+        std::vector<int> fed_drafts;    // drafts evaluated after `base_n_past`
+        int base_n_past;
+    };
+
+    void Pipeline::load_draft_model(const std::string &path, const ModelObject::extra_args &args, int max_draft_tokens)
+    {
+        if (!modelobj.loaded) return;
+
+        draft_model.reset(new ModelObject(path, args));
+        CHATLLM_CHECK(draft_model->tokenizer->get_vocab_size() == tokenizer->get_vocab_size())
+            << "draft model must share the tokenizer: vocab size " << draft_model->tokenizer->get_vocab_size() << " vs " << tokenizer->get_vocab_size();
+
+        // rejected drafts are discarded by rewinding both models
+        if (!model->is_rewindable() || !draft_model->model->is_rewindable())
+        {
+            ggml::log(GGML_LOG_LEVEL_WARN, "speculative decoding disabled: %s model can't be rewound\n",
+                model->is_rewindable() ? "draft" : "target");
+            draft_model.reset();
+            return;
+        }
+
+        drafter.reset(new ModelDrafter(draft_model->model.get(), tokenizer->get_vocab_size()));
+        model->set_drafter(max_draft_tokens > 0 ? drafter.get() : nullptr, max_draft_tokens);
+    }
+
+    bool Pipeline::prefill_with_prefix_cache(std::vector<int> &input_ids, const GenerationConfig &gen_config)
+    {
+        if ((prefix_cache.get_capacity() < 1) || (input_ids.size() < 2) || !model->is_rewindable()) return false;
+        // too long: left to `generate`, which reports it
+        if ((int)input_ids.size() >= std::min(gen_config.max_length, model->get_max_length())) return false;
+
+        // the last token is left to `generate`, which produces logits from it
+        std::vector<int> prefix(input_ids.begin(), input_ids.end() - 1);
+
+        int matched = 0;
+        bool continuous = false;
+        ModelSessionMemory *snapshot = prefix_cache.find(prefix, matched);
+        if (snapshot && (model->load_session(*snapshot) == 0))
+            continuous = true;
+        else
+            matched = 0;
+
+        if (matched < (int)prefix.size())
+        {
+            std::vector<int> remain(prefix.begin() + matched, prefix.end());
+            if (!continuous)
+                model->set_n_past(0);
+
+            // evaluate the remainder only: no token is sampled
+            std::vector<float> logits;
+            model->set_ctx((int)remain.size());
+            if (!model->generate_next_token(remain, gen_config, logits))
+                return false;
+            model->set_n_past(model->get_n_past() + (int)remain.size());
+
+            ModelSessionMemory *session = prefix_cache.add(prefix);
+            if (session) model->save_session(*session);
+        }
+
+        input_ids.erase(input_ids.begin(), input_ids.end() - 1);
+        return true;
+    }
+
     std::string Pipeline::chat_with_ext_completion(Messages &history, const std::string &external, const GenerationConfig &gen_config,
                          BaseStreamer *streamer)
     {
@@ -2016,6 +2599,29 @@ namespace chatllm
         tokenizer->encode(input, result);
     }
 
+    void Pipeline::text_tokenize(const std::vector<std::string> &inputs, const GenerationConfig &gen_config, std::vector<int> &ids, std::vector<size_t> &offsets)
+    {
+        tokenizer->encode_batch(inputs, ids, offsets);
+    }
+
+    void Pipeline::embedding_tokenize(const std::vector<std::string> &inputs, const GenerationConfig &gen_config, std::vector<int> &ids, std::vector<size_t> &offsets,
+                                      BaseTokenizer::EmbeddingPurpose purpose)
+    {
+        tokenizer->encode_embedding_batch(inputs, ids, offsets, purpose);
+    }
+
+    void Pipeline::embedding(const std::vector<int> &input_ids, const GenerationConfig &gen_config, std::vector<float> &result)
+    {
+        if (!modelobj.loaded) return;
+        model->embedding(gen_config, input_ids, result);
+    }
+
+    void Pipeline::embedding(const std::vector<int> &input_ids, const std::vector<size_t> &offsets, const GenerationConfig &gen_config, std::vector<float> &result)
+    {
+        if (!modelobj.loaded) return;
+        model->embedding_batch(gen_config, input_ids, offsets, result);
+    }
+
     void Pipeline::embedding(const Content &input, const GenerationConfig &gen_config, std::vector<float> &result, BaseTokenizer::EmbeddingPurpose purpose)
     {
         if (!modelobj.loaded) return;
@@ -2164,6 +2770,7 @@ namespace chatllm
         if (!modelobj.loaded) return;
         tokenizer->set_additional_args(args);
         model->set_additional_args(args);
+        prefix_cache.set_capacity(utils::get_opt(args, "prefix_cache", prefix_cache.get_capacity()));
     }
 
     void Pipeline::before_chat(Messages &history, const GenerationConfig &gen_config, BaseStreamer *streamer)
@@ -2176,6 +2783,7 @@ namespace chatllm
 
     RAGPipeline::RAGPipeline(const std::string &path, const ModelObject::extra_args &args,
         DistanceStrategy vec_cmp, const std::map<std::string, std::vector<std::string>> &vector_stores,
+        const std::map<std::string, std::string> &vs_indices,
         const std::string &embedding_model, const std::string &reranker_model)
         : Pipeline(path, args),
           composer(),
@@ -2185,7 +2793,7 @@ namespace chatllm
           rerank_score_threshold(0.5f),
           rag_post_extending(0),
           rerank_rewrite(false),
-          vs(vec_cmp, vector_stores),
+          vs(vec_cmp, vector_stores, args.n_threads, vs_indices, ParseANNParams(args.additional), ParseQuantParams(args.additional)),
           model_embedding(embedding_model),
           model_reranker(reranker_model.size() > 0 ? new ModelObject(reranker_model) : nullptr),
           rewrite_model(nullptr)
@@ -2197,15 +2805,18 @@ namespace chatllm
         std::vector<float> scores;
         std::vector<size_t> order;
         std::vector<int64_t> result;
+        std::vector<int> input_ids;
+        std::vector<size_t> offsets{0};
 
+        // all pairs are scored at once
         for (size_t i = 0; i < candidates.size(); i++)
         {
-            std::vector<int> input_ids;
             std::string c, m;
             vs.get()->GetRecord(candidates[i], c, m);
             model_reranker->tokenizer->encode_qa(query, c, input_ids);
-            scores.push_back(model_reranker->model->qa_rank(gen_config, input_ids));
+            offsets.push_back(input_ids.size());
         }
+        model_reranker->model->qa_rank_batch(gen_config, input_ids, offsets, scores);
 
         utils::ordering(scores, order, true);
 
@@ -2557,11 +3168,22 @@ final:
         unescape_c_sequences(context_sep);
     }
 
-    ModelPerfInfo::ModelPerfInfo()
+    ModelPerfInfo::ModelPerfInfo() : drafted_tokens(0), accepted_tokens(0)
     {
         memset(&timings, 0, sizeof(timings));
     }
 
+    void ModelPerfInfo::AccumulateDrafts(size_t drafted, size_t accepted)
+    {
+        drafted_tokens  += drafted;
+        accepted_tokens += accepted;
+    }
+
+    double ModelPerfInfo::DraftAcceptanceRate(void) const
+    {
+        return drafted_tokens > 0 ? (double)accepted_tokens / drafted_tokens : 0.0;
+    }
+
     void ModelPerfInfo::Accumulate(Type type, size_t tok_count)
     {
         timings[type].tok_count += tok_count;
@@ -2580,12 +3202,19 @@ final:
         return r;
     }
 
-    VectorStores::VectorStores(DistanceStrategy vec_cmp, const std::map<std::string, std::vector<std::string>> &vector_stores)
+    VectorStores::VectorStores(DistanceStrategy vec_cmp, const std::map<std::string, std::vector<std::string>> &vector_stores, int n_threads,
+        const std::map<std::string, std::string> &indices, const ANNParams &ann_params, const QuantParams &quant_params)
         : def_store(nullptr)
     {
         for (auto x : vector_stores)
         {
             auto p = new CVectorStore(vec_cmp, x.second);
+            p->SetThreads(n_threads);
+            p->SetQuantization(quant_params);
+
+            auto index = indices.find(x.first);
+            if (index != indices.end())
+                p->SetIndex(ParseVectorIndexType(index->second.c_str()), ann_params);
             if (nullptr == def_store) def_store = p;
 
             stores.insert(std::pair(x.first, p));
@@ -9,6 +9,9 @@
 #include <vector>
 #include <random>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "basics.h"
 #include "tokenizer.h"
 #include "vectorstore.h"
@@ -302,7 +305,21 @@ namespace chatllm
         virtual void encode_qa(const Content &q, const Content &a, std::vector<int> &ids) const;
         virtual void encode_embedding(const Content &input, std::vector<int> &ids, EmbeddingPurpose purpose) const;
 
+        // batch versions of `encode` & `encode_embedding`: texts are tokenized in parallel (`num_threads`: 0 for all cores)
+        // if the tokenizer is thread-safe, otherwise one by one.
+        // ids of texts[i] are ids[offsets[i] .. offsets[i + 1]).
+        void encode_batch(const std::vector<std::string> &texts, std::vector<int> &ids, std::vector<size_t> &offsets, int num_threads = 0) const;
+        void encode_embedding_batch(const std::vector<std::string> &texts, std::vector<int> &ids, std::vector<size_t> &offsets,
+                                    EmbeddingPurpose purpose, int num_threads = 0) const;
+
+        // true if `encode` & `encode_embedding` can be called concurrently.
+        // tokenizers that modify themselves while encoding (e.g. through `encode_history`) must not claim this.
+        virtual bool is_thread_safe(void) const { return false; }
+
         virtual std::string decode(const std::vector<int> &ids) const;
+        // decodes `ids` that follow those already decoded with the same `carry` (see `Processor::DecodeIncremental`),
+        // and appends the text to `text`. returns false if not supported, then `decode` shall be used.
+        virtual bool decode_incremental(const std::vector<int> &ids, std::string &carry, std::string &text) const;
 
         virtual std::vector<int> encode_history(const Messages &history, int max_length,
                                                 const bool incremental = false,
@@ -430,12 +447,15 @@ namespace chatllm
         ggml_context *gctx_;
     };
 
+    class KVPageTable;
+
     class InitContext : public ComputeContext
     {
     public:
         InitContext(BackendContext *backend_context = nullptr) : ComputeContext(backend_context)
         {
             cache_dtype = ggml::type::GGML_TYPE_F16;
+            v_cache_dtype = ggml::type::GGML_TYPE_F16;
         }
 
         struct ggml_context *get_ctx() override { return gctx.get(); }
@@ -443,6 +463,8 @@ namespace chatllm
         GGMLContext gctx;
         ggml::type dtype;
         ggml::type cache_dtype;
+        ggml::type v_cache_dtype;
+        KVPageTable *kv_pages = nullptr;
     };
 
     class CacheTypeChanger
@@ -615,6 +637,9 @@ namespace chatllm
         }
 
         virtual void call_put_chunk(bool first, const std::string &chunk);
+    protected:
+        // for tokenizers that can't decode incrementally: decode the whole line again
+        std::string decode_cached(const std::vector<int> &output_ids);
     public:
         bool is_prompt;
         BaseTokenizer *tokenizer;
@@ -623,6 +648,7 @@ namespace chatllm
         bool is_first;
         size_t print_len;
         std::vector<int> token_cache;
+        std::string decode_carry;
         ChunkInterceptor *interceptor; // first interceptor in the chain
     };
 
@@ -662,6 +688,9 @@ namespace chatllm
 
         size_t read_buffer(void *output, size_t len) override;
 
+        // pointer into the (copy-on-write) mapping, or nullptr if out of range
+        void *get_mapped(int64_t offset, size_t len);
+
     protected:
         char *data;
         const char *ptr;
@@ -701,6 +730,7 @@ namespace chatllm
         void assign_to(ggml::tensor *tensor);
 
     protected:
+        bool load_mapped(tokenizer::DataReader *reader, LayerBufAllocator *alloc, ggml::type target_type, size_t override_buffer_size);
         size_t read_tensor_data_f32_f16(tokenizer::DataReader *reader, size_t read_offset, size_t write_offset, size_t data_size);
         size_t read_tensor_data_f16_f32(tokenizer::DataReader *reader, size_t read_offset, size_t write_offset, size_t data_size);
 
@@ -711,13 +741,45 @@ namespace chatllm
         BackendBuffer *data;
         LayerBufAllocator *alloc;
         ggml::type original_type;
+        size_t data_offset;
+    };
+
+    // Tracks tensor loading: reports progress and throughput, and (for mapped files)
+    // pages in the data ahead of the tensor being loaded on a background thread, so that
+    // disk reads overlap with conversion and uploads.
+    class TensorLoadMonitor
+    {
+    public:
+        TensorLoadMonitor(MappedFile *file, size_t total_bytes);
+        ~TensorLoadMonitor();
+
+        void on_loaded(size_t offset, size_t bytes);
+
+        void finish(void);
+
+    protected:
+        void prefetch_worker(void);
+
+        static constexpr size_t PREFETCH_WINDOW = 256 * 1024 * 1024;
+
+        MappedFile *file;
+        const size_t total_bytes;
+        size_t loaded_bytes;
+        int reported;
+        std::chrono::steady_clock::time_point t_start;
+        std::thread worker;
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t next;
+        size_t limit;
+        bool stopped;
     };
 
     class ModelLoader : public TensorLoader
     {
     public:
-        ModelLoader(const std::string &path)
-            : ModelLoader(new SimpleFile(path))
+        ModelLoader(const std::string &path, bool use_mmap = true)
+            : ModelLoader(open_file(path, use_mmap))
         {
         }
 
@@ -753,12 +815,21 @@ namespace chatllm
                         ggml::tensor *tensor) override;
         void read_scaler(const std::string &name, float *value) override;
 
-        void map_tensor_element(ggml::tensor *tensor, std::function<float (float)> f);
+        void map_tensor_element(ggml::tensor *tensor, std::function<float (float)> f) override;
 
         bool has_tensor(const std::string &name) const override;
 
         void load_all_tensors(void);
 
+        // report loading statistics, stop prefetching
+        void finish_loading(void);
+
+        // write a GGMM copy of this file in which every loaded tensor has its loaded (converted) type
+        void save_converted(const std::string &path);
+
+        // location of the re-quantized copy of `path` (see `save_converted`) in `cache_dir`
+        static std::string requant_cache_path(const std::string &path, const std::string &cache_dir, ggml::type type);
+
         tokenizer::DataReader *get_reader()
         {
             return _file.get();
@@ -802,7 +873,10 @@ namespace chatllm
         {
         }
 
+        static tokenizer::DataReader *open_file(const std::string &path, bool use_mmap);
+
         std::unique_ptr<tokenizer::DataReader> _file;
+        std::unique_ptr<TensorLoadMonitor> load_monitor;
 
     public:
         BaseConfig basic_config;
@@ -815,6 +889,8 @@ namespace chatllm
         LayerAllocatorManager *alloc_manager(void);
         std::vector<LayerAllocatorManager *>alloc_managers;
         std::vector<std::pair<std::string, std::string>> name_translation;
+        // file data of tensors changed in place after loading (see `map_tensor_element`)
+        std::map<std::string, std::vector<uint8_t>> mapped_tensors;
 
     public:
         enum FileFormat
@@ -868,6 +944,7 @@ namespace chatllm
         float repeat_penalty;
         float frequency_penalty;
         float tfs_z;
+        float min_p = 0.05f;
         int _seed = -1;
         std::string sampling;
         std::string ai_prefix;
@@ -924,7 +1001,13 @@ namespace chatllm
 
         void Accumulate(Type type, size_t tok_count);
 
+        // speculative decoding
+        void AccumulateDrafts(size_t drafted, size_t accepted);
+        double DraftAcceptanceRate(void) const;
+
         Performance timings[Type::NUM];
+        size_t drafted_tokens;
+        size_t accepted_tokens;
 
     private:
         using Clock = std::chrono::steady_clock;
@@ -958,6 +1041,58 @@ namespace chatllm
         int n_past_offset;
     };
 
+    // Snapshots of model states right after prompts are evaluated (LRU).
+    // A new prompt sharing a prefix with a snapshot only needs to evaluate the remainder.
+    class PromptPrefixCache
+    {
+    public:
+        PromptPrefixCache(int capacity = 0);
+
+        void set_capacity(int capacity);
+        int  get_capacity(void) const { return capacity; }
+
+        // snapshot of the longest prefix of `ids` (`matched` tokens), or `nullptr`
+        ModelSessionMemory *find(const std::vector<int> &ids, int &matched);
+
+        // snapshot to be filled for `ids` (evicting the least recently used one)
+        ModelSessionMemory *add(const std::vector<int> &ids);
+
+        void clear(void);
+
+    private:
+        // prefixes are hashed in blocks of this size, so that common prefixes are found without comparing each token
+        static const int BLOCK_SIZE = 64;
+
+        struct Entry
+        {
+            std::vector<int> ids;
+            std::vector<uint64_t> block_hashes;     // hash of ids[0 .. (i + 1) * BLOCK_SIZE)
+            uint64_t last_used;
+            ModelSessionMemory session;
+        };
+
+        static void hash_blocks(const std::vector<int> &ids, std::vector<uint64_t> &hashes);
+        static int  match(const Entry &entry, const std::vector<int> &ids, const std::vector<uint64_t> &hashes);
+
+        int capacity;
+        uint64_t clock;
+        std::vector<std::unique_ptr<Entry>> entries;
+    };
+
+    // proposes tokens that are verified by a model in one pass (speculative decoding)
+    class TokenDrafter
+    {
+    public:
+        virtual ~TokenDrafter() {}
+
+        // a generation starts from `input_ids`. `n_past`: the model's `n_past` before `input_ids`
+        virtual void begin(const std::vector<int> &input_ids, const GenerationConfig &gen_config, bool continuous, int n_past) = 0;
+
+        // `accepted`: tokens appended to the context since `begin` or last call.
+        // up to `max_n` tokens that likely follow are returned in `drafted`.
+        virtual void draft(const std::vector<int> &accepted, int max_n, std::vector<int> &drafted) = 0;
+    };
+
     class AbstractModel
     {
     public:
@@ -978,10 +1113,29 @@ namespace chatllm
 
         virtual void abort_generation(void) = 0;
 
+        // speculative decoding: `drafter` proposes up to `max_draft_tokens` tokens per step (`nullptr`: disabled)
+        virtual void set_drafter(TokenDrafter *drafter, int max_draft_tokens) {}
+
+        // continuous batching
+        // each sequence owns a KV slot and its own `n_past`; sequences are admitted & retired at token granularity.
+        // must be called before the first run. returns the number of slots actually reserved.
+        virtual int  reserve_kv_slots(int num) { return 1; }
+        // returns id of the queued sequence (-1 if not supported)
+        virtual int  add_sequence(const std::vector<int> &input_ids, const GenerationConfig &gen_config, BaseStreamer *streamer = nullptr) { return -1; }
+        virtual void abort_sequence(int id) {}
+        // run one scheduling round. returns the number of sequences that are still alive (running or queued)
+        virtual int  step_sequences(ModelPerfInfo *performance = nullptr) { return 0; }
+
         virtual void embedding(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
                                     std::vector<float> &embedding) = 0;
+        // embeddings of sequences `input_ids[offsets[i] .. offsets[i + 1])`, one after another. empty on failure.
+        virtual void embedding_batch(const GenerationConfig &gen_config, const std::vector<int> &input_ids, const std::vector<size_t> &offsets,
+                                    std::vector<float> &embeddings) = 0;
         virtual float qa_rank(const GenerationConfig &gen_config,
                               const std::vector<int> &input_ids) = 0;
+        // scores of sequences `input_ids[offsets[i] .. offsets[i + 1])`
+        virtual void qa_rank_batch(const GenerationConfig &gen_config, const std::vector<int> &input_ids, const std::vector<size_t> &offsets,
+                                   std::vector<float> &scores) = 0;
         virtual int get_embedding_dim(void) const = 0;
 
         // image input
@@ -1019,6 +1173,9 @@ namespace chatllm
         virtual int get_n_past(void) = 0;
         virtual void set_n_past(int n_past) = 0;
 
+        // false if the model keeps states (e.g. recurrent or convolution states) that can't be rewound by `set_n_past`
+        virtual bool is_rewindable(void) const { return true; }
+
         virtual void shift_memory(int keep) = 0;
 
         virtual int save_session(FILE *f) const = 0;
@@ -1068,15 +1225,37 @@ namespace chatllm
 
         void abort_generation(void) override { model->abort_generation(); }
 
+        void set_drafter(TokenDrafter *drafter, int max_draft_tokens) override { model->set_drafter(drafter, max_draft_tokens); }
+
+        int  reserve_kv_slots(int num) override { return model->reserve_kv_slots(num); }
+        int  add_sequence(const std::vector<int> &input_ids, const GenerationConfig &gen_config, BaseStreamer *streamer = nullptr) override
+        {
+            return model->add_sequence(input_ids, gen_config, streamer);
+        }
+        void abort_sequence(int id) override { model->abort_sequence(id); }
+        int  step_sequences(ModelPerfInfo *performance = nullptr) override { return model->step_sequences(performance); }
+
         void embedding(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
                                     std::vector<float> &embedding) override
         {
             model->embedding(gen_config, input_ids, embedding);
         }
 
+        void embedding_batch(const GenerationConfig &gen_config, const std::vector<int> &input_ids, const std::vector<size_t> &offsets,
+                                    std::vector<float> &embeddings) override
+        {
+            model->embedding_batch(gen_config, input_ids, offsets, embeddings);
+        }
+
         float qa_rank(const GenerationConfig &gen_config,
                               const std::vector<int> &input_ids) override { return model->qa_rank(gen_config, input_ids); }
 
+        void qa_rank_batch(const GenerationConfig &gen_config, const std::vector<int> &input_ids, const std::vector<size_t> &offsets,
+                                   std::vector<float> &scores) override
+        {
+            model->qa_rank_batch(gen_config, input_ids, offsets, scores);
+        }
+
 
         void speech_synthesis(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
                                 std::vector<int16_t> &audio, int &sample_rate, int &channels) override
@@ -1138,6 +1317,7 @@ namespace chatllm
 
         int get_n_past(void) override { return model->get_n_past(); }
         void set_n_past(int n_past) override { model->set_n_past(n_past); }
+        bool is_rewindable(void) const override { return model->is_rewindable(); }
 
         void shift_memory(int keep) override { model->shift_memory(keep); }
 
@@ -1200,12 +1380,20 @@ namespace chatllm
                                     std::vector<float> &embedding) override
         {}
 
+        void embedding_batch(const GenerationConfig &gen_config, const std::vector<int> &input_ids, const std::vector<size_t> &offsets,
+                                    std::vector<float> &embeddings) override
+        {}
+
         float qa_rank(const GenerationConfig &gen_config,
                               const std::vector<int> &input_ids) override
         {
             return 0.0f;
         }
 
+        void qa_rank_batch(const GenerationConfig &gen_config, const std::vector<int> &input_ids, const std::vector<size_t> &offsets,
+                                   std::vector<float> &scores) override
+        {}
+
         int get_embedding_dim(void) const override { return -1; }
 
         int append_image(const uint8_t *rgb_pixels, int width, int height) override
@@ -1347,9 +1535,10 @@ namespace chatllm
         AbstractModel *fork_model(const extra_args &args);
 
     public:
+        // declared first: weights may live in the loader's mapping, so it must outlive the model
+        std::unique_ptr<ModelLoader> loader;
         std::unique_ptr<BaseTokenizer> tokenizer;
         std::unique_ptr<AbstractModel> model;
-        std::unique_ptr<ModelLoader> loader;
         const bool loaded;
     };
 
@@ -1399,8 +1588,20 @@ namespace chatllm
         void set_extending_method(ExtendingMethod method);
         virtual void set_additional_args(const std::map<std::string, std::string> &args);
 
+        // speculative decoding with a draft model sharing the same tokenizer
+        void load_draft_model(const std::string &path, const ModelObject::extra_args &args, int max_draft_tokens);
+
         void text_tokenize(const std::string &input, const GenerationConfig &gen_config, std::vector<int> &result);
+        // tokenizes `inputs` in parallel: ids of inputs[i] are ids[offsets[i] .. offsets[i + 1]).
+        void text_tokenize(const std::vector<std::string> &inputs, const GenerationConfig &gen_config, std::vector<int> &ids, std::vector<size_t> &offsets);
+        void embedding_tokenize(const std::vector<std::string> &inputs, const GenerationConfig &gen_config, std::vector<int> &ids, std::vector<size_t> &offsets,
+                                BaseTokenizer::EmbeddingPurpose purpose = BaseTokenizer::EmbeddingPurpose::Document);
         void embedding(const Content &input, const GenerationConfig &gen_config, std::vector<float> &result, BaseTokenizer::EmbeddingPurpose purpose = BaseTokenizer::EmbeddingPurpose::Document);
+        // embedding of tokenized input (see `embedding_tokenize`)
+        void embedding(const std::vector<int> &input_ids, const GenerationConfig &gen_config, std::vector<float> &result);
+        // embeddings of all tokenized inputs at once (see `embedding_tokenize`): embedding of input i is
+        // `result[i * get_embedding_dim()]` ... `result` is empty on failure.
+        void embedding(const std::vector<int> &input_ids, const std::vector<size_t> &offsets, const GenerationConfig &gen_config, std::vector<float> &result);
         float qa_rank(const Content &q, const Content &a, const GenerationConfig &gen_config);
 
         bool speech_synthesis(const std::string &input, const GenerationConfig &gen_config, std::vector<int16_t> &audio, int &sample_rate, int &channels);
@@ -1443,6 +1644,14 @@ namespace chatllm
 
         void add_ai_prefix(std::vector<int> &input_ids, const GenerationConfig &gen_config, BaseStreamer *streamer);
 
+        // evaluate all but the last token of `input_ids` (restoring the longest cached prefix),
+        // and leave the last token in `input_ids`. returns false if prefix cache is not used.
+        bool prefill_with_prefix_cache(std::vector<int> &input_ids, const GenerationConfig &gen_config);
+
+        PromptPrefixCache prefix_cache;
+        std::unique_ptr<ModelObject> draft_model;
+        std::unique_ptr<TokenDrafter> drafter;
+
         virtual std::string chat_with_ext_completion(Messages &history, const std::string &external, const GenerationConfig &gen_config,
                          BaseStreamer *streamer);
         virtual std::string chat_with_restart(const Messages &history, const GenerationConfig &gen_config,
@@ -1507,7 +1716,9 @@ namespace chatllm
     class VectorStores
     {
     public:
-        VectorStores(DistanceStrategy vec_cmp, const std::map<std::string, std::vector<std::string>> &vector_stores);
+        VectorStores(DistanceStrategy vec_cmp, const std::map<std::string, std::vector<std::string>> &vector_stores, int n_threads = 0,
+                     const std::map<std::string, std::string> &indices = {}, const ANNParams &ann_params = ANNParams(),
+                     const QuantParams &quant_params = QuantParams());
         ~VectorStores();
 
         bool select(const std::string &name);
@@ -1525,6 +1736,7 @@ namespace chatllm
     public:
         RAGPipeline(const std::string &path, const ModelObject::extra_args &args,
                     DistanceStrategy vec_cmp, const std::map<std::string, std::vector<std::string>> &vector_stores,
+                    const std::map<std::string, std::string> &vs_indices,
                     const std::string &embedding_model, const std::string &reranker_model = "");
 
         ~RAGPipeline() override {}
@@ -11,6 +11,7 @@
 #include <random>
 #include <regex>
 #include <string>
+#include <typeinfo>
 #include <functional>
 #include "backend.h"
 
@@ -367,6 +368,38 @@ namespace chatllm
         });
     }
 
+    void ggml::convert(ggml::type src_type, const void *src, ggml::type dst_type, void *dst, int64_t ne0, int64_t n_rows)
+    {
+        if (ggml::type::GGML_TYPE_F32 == src_type)
+        {
+            from_float(dst_type, (const float *)src, dst, ne0, n_rows);
+            return;
+        }
+        if (ggml::type::GGML_TYPE_F32 == dst_type)
+        {
+            to_float(src_type, src, (float *)dst, ne0, n_rows);
+            return;
+        }
+
+        auto to   = ggml_get_type_traits(src_type)->to_float;
+        auto from = ggml_get_type_traits(dst_type)->from_float_ref;
+        CHATLLM_CHECK(to && from) << "ggml::convert: type not supported: " << src_type << " -> " << dst_type;
+
+        const int64_t ROWS_PER_CHUNK = 16;
+        const auto s_src = ggml_row_size(src_type, ne0);
+        const auto s_dst = ggml_row_size(dst_type, ne0);
+        utils::parallel_for(0, (n_rows + ROWS_PER_CHUNK - 1) / ROWS_PER_CHUNK, [=](int64_t nth) {
+            std::vector<float> row(ne0);
+            const int64_t first = nth * ROWS_PER_CHUNK;
+            const int64_t last  = std::min(first + ROWS_PER_CHUNK, n_rows);
+            for (int64_t i = first; i < last; i++)
+            {
+                to  ((const char *)src + i * s_src, row.data(), ne0);
+                from(row.data(), (char *)dst + i * s_dst, ne0);
+            }
+        });
+    }
+
     ggml::tensor *ggml::inplace_act(ComputeContext *ctx, ActFunc act, ggml::tensor *input)
     {
         ggml::tensor *tensor = nullptr;
@@ -941,6 +974,28 @@ namespace chatllm
             ggml_soft_max_add_sinks(soft_max_result, sinks);
     }
 
+    ggml::tensor *ggml::flash_attn_ext(ComputeContext *ctx, ggml::tensor *q, ggml::tensor *k, ggml::tensor *v, ggml::tensor *mask,
+                                       float scale, float max_bias, float logit_softcap)
+    {
+        ggml::tensor *tensor = ggml_flash_attn_ext(ctx->get_ctx(), q, k, v, mask, scale, max_bias, logit_softcap);
+        ggml_flash_attn_ext_set_prec(tensor, GGML_PREC_F32);
+        ctx->cb_op_tensor(tensor);
+        return tensor;
+    }
+
+    void ggml::flash_attn_attach_sinks(ggml::tensor *flash_attn_result, ggml::tensor *sinks)
+    {
+        if (sinks)
+            ggml_flash_attn_ext_add_sinks(flash_attn_result, sinks);
+    }
+
+    ggml::tensor *ggml::fill(ComputeContext *ctx, ggml::tensor *a, float c)
+    {
+        ggml::tensor *tensor = ggml_fill(ctx->get_ctx(), a, c);
+        ctx->cb_op_tensor(tensor);
+        return tensor;
+    }
+
     ggml::tensor *ggml::sigmoid(ComputeContext *ctx, ggml::tensor *a)
     {
         ggml::tensor *tensor = ggml_sigmoid(ctx->get_ctx(), a);
@@ -962,6 +1017,12 @@ namespace chatllm
         return tensor;
     }
 
+    void ggml::diag_mask_set_n_past(ggml::tensor *diag_mask_result, int n_past)
+    {
+        CHATLLM_CHECK((diag_mask_result->op == GGML_OP_DIAG_MASK_INF) || (diag_mask_result->op == GGML_OP_DIAG_MASK_ZERO));
+        ((int32_t *)diag_mask_result->op_params)[0] = n_past;
+    }
+
     ggml::tensor *ggml::mul(ComputeContext *ctx, ggml::tensor *a, ggml::tensor *b)
     {
         ggml::tensor *tensor = ggml_mul(ctx->get_ctx(), a, b);
@@ -1394,6 +1455,14 @@ namespace chatllm
         ggml_mul_mat_set_prec(a, prec);
     }
 
+    void ggml::set_view_offset(ggml::tensor *view, size_t offset)
+    {
+        CHATLLM_CHECK(view->view_src) << "not a view: " << view->name;
+        view->view_offs = offset;
+        if (view->view_src->data)
+            view->data = (char *)view->view_src->data + offset;
+    }
+
     bool ggml::is_contiguous(const ggml::tensor *tensor)
     {
         return ggml_is_contiguous(tensor);
@@ -1833,6 +1902,17 @@ namespace chatllm
         return output;
     }
 
+    ggml::tensor *RobertaEmbedding::forward(ComputeContext *ctx, ggml::tensor *input, ggml::tensor *positions)
+    {
+        ggml::tensor *output1 = ggml::get_rows(ctx, word_weight, input);
+        ggml::tensor *output2 = ggml::get_rows(ctx, position_weight, positions);
+
+        ggml::tensor *output = ggml::add_inplace(ctx, output1, output2);
+
+        output = ln.forward(ctx, output);
+        return output;
+    }
+
     void RobertaEmbedding::load(const std::string &path, TensorLoader *loader)
     {
         Block::load(path, loader);
@@ -2001,7 +2081,12 @@ namespace chatllm
         // We "pool" the model by simply taking the hidden state corresponding to the first token.
         ggml::tensor *first_token_tensor = ggml::view_2d(ctx, hidden_states, hidden_size, 1,
                                                       hidden_size * ggml::element_size(hidden_states), 0);
-        ggml::tensor *output = dense.forward(ctx, first_token_tensor);
+        return forward_pooled(ctx, first_token_tensor);
+    }
+
+    ggml::tensor *RobertaClassificationHead::forward_pooled(ComputeContext *ctx, ggml::tensor *pooled)
+    {
+        ggml::tensor *output = dense.forward(ctx, pooled);
         output = ggml::act(ctx, act, output);
         output = out_proj.forward(ctx, output);
         output = ggml::sigmoid(ctx, output);
@@ -2207,15 +2292,28 @@ namespace chatllm
         // attn_masked = mask_past(attn_scores)
         // attn_probs = soft_max(attn_masked)
         ggml::tensor * attn_probs = nullptr;
+        ggml::tensor * row_mask = causal && ctx->row_positions.is_enabled() ? ctx->row_positions.get_mask(ctx, (int)attn_scores->ne[0]) : nullptr;
         if (mask)
         {
             attn_probs = ggml::soft_max_ext(ctx, attn_scores, mask, 1.0f, 0.0f);
         }
+        else if (row_mask)
+        {
+            attn_probs = ggml::soft_max_ext(ctx, attn_scores, row_mask, 1.0f, 0.0f);
+            ctx->row_positions.handle();
+        }
         else
         {
             ggml::tensor * attn_masked = causal ? ggml::diag_mask_inf(ctx, attn_scores, n_past)
                                                   : attn_scores;
             attn_probs = ggml::soft_max(ctx, attn_masked);
+
+            if (causal && ctx->graph_reuse.is_enabled())
+            {
+                ctx->graph_reuse.add_patcher([attn_masked](ComputeContext *ctx, int n_past) {
+                    ggml::diag_mask_set_n_past(attn_masked, n_past);
+                });
+            }
         }
 
         ggml::soft_max_attach_sinks(attn_probs, sinks);
@@ -2245,6 +2343,61 @@ namespace chatllm
         return last_attn_scores;
     }
 
+    ggml::tensor *CoreAttention::calc_attn_fused(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
+        ggml::tensor *key_layer, ggml::tensor *query_layer, ggml::tensor *value_layer)
+    {
+        const int head_size = hidden_size / num_attention_heads;
+        const int klen      = (int)ggml::get_dim(key_layer, 1);
+
+        float scale = 1.0f;
+        if (attn_scaling)
+            scale = attn_scaling_factor > 0 ? attn_scaling_factor : 1.f / sqrtf((float)head_size);
+
+        // the mask is F16 [qlen, klen]
+        ggml::tensor *attn_mask = mask;
+        if (attn_mask)
+        {
+            if (ggml::type_of(attn_mask) != ggml::type::GGML_TYPE_F16)
+                attn_mask = ggml::cast(ctx, attn_mask, ggml::type::GGML_TYPE_F16);
+            else if (!ggml::is_contiguous(attn_mask))
+                attn_mask = ggml::cont(ctx, attn_mask);
+        }
+        else if (causal && ctx->row_positions.is_enabled() && ctx->row_positions.get_mask(ctx, klen))
+        {
+            attn_mask = ggml::cast(ctx, ctx->row_positions.get_mask(ctx, klen), ggml::type::GGML_TYPE_F16);
+            ctx->row_positions.handle();
+        }
+        else if (causal)
+        {
+            ggml::tensor *zeros = ggml::fill(ctx, ggml::new_tensor_2d(ctx, ggml::type::GGML_TYPE_F32, klen, qlen), 0.0f);
+            ggml::tensor *masked = ggml::diag_mask_inf(ctx, zeros, n_past);
+            attn_mask = ggml::cast(ctx, masked, ggml::type::GGML_TYPE_F16);
+
+            if (ctx->graph_reuse.is_enabled())
+            {
+                ctx->graph_reuse.add_patcher([masked](ComputeContext *ctx, int n_past) {
+                    ggml::diag_mask_set_n_past(masked, n_past);
+                });
+            }
+        }
+
+        ggml::tensor *context_layer = ggml::flash_attn_ext(ctx, query_layer, key_layer, value_layer, attn_mask, scale, 0.0f, 0.0f); // [qlen, heads, head_size]
+        ggml::flash_attn_attach_sinks(context_layer, sinks);
+
+        last_attn_scores = ggml::reshape_3d(ctx,
+            context_layer,
+            hidden_size, qlen, ggml::get_dim(context_layer, 3));
+
+        return last_attn_scores;
+    }
+
+    ggml::tensor *CoreAttention::get_v_rows_from_cache(ComputeContext *ctx, const int hidden_size, const int n_past, const int qlen)
+    {
+        ggml::tensor *value_layer = get_v_from_cache(ctx, hidden_size, n_past, qlen);  // [heads, head_size, klen]
+        value_layer = ggml::permute(ctx, value_layer, 1, 0, 2, 3);
+        return ggml::cont(ctx, value_layer);
+    }
+
     ggml::tensor *CoreAttention::cross_attention_after_pe(ComputeContext *ctx, const int hidden_size, const int n_past, const int qlen,
                                              ggml::tensor *query_layer, ggml::tensor *key_layer, ggml::tensor *v)
     {
@@ -2260,6 +2413,12 @@ namespace chatllm
 
         key_layer = get_k_from_cache(ctx, hidden_size, n_past, qlen);
 
+        if (ctx->user_options.flash_attn && is_fused_attn_supported())
+        {
+            ggml::tensor * value_layer = get_v_rows_from_cache(ctx, hidden_size, n_past, qlen);
+            return calc_attn_fused(ctx, hidden_size, n_past, qlen, key_layer, query_layer, value_layer);
+        }
+
         ggml::tensor * value_layer = get_v_from_cache(ctx, hidden_size, n_past, qlen);
 
         ggml::tensor *attn_scores = calc_attn_scores(ctx, hidden_size, n_past, qlen, key_layer, query_layer, value_layer);
@@ -2345,6 +2504,16 @@ namespace chatllm
 
     void CoreAttention::prepare_pos_tensor(ComputeContext *ctx, const int n_past, const int qlen)
     {
+        // rows of a batched decoding step: one position per row
+        auto &rows = ctx->row_positions;
+        if (rows.is_enabled() && (qlen == 1) && (typeid(*pos_helper) == typeid(BaseTensorPosHelper)))
+        {
+            pos->ne[0] = (int64_t)rows.n_past.size();
+            Backend::write_tensor_data(pos, rows.n_past.data(), 0, rows.n_past.size() * sizeof(rows.n_past[0]));
+            rows.handle();
+            return;
+        }
+
         pos_helper->prepare_pos_tensor(ctx, pos, n_past, qlen);
     }
 
@@ -2353,8 +2522,152 @@ namespace chatllm
         prepare_pos_tensor(ctx, n_past, qlen);
     }
 
+    KVPageTable::KVPageTable(int page_size, int num_pages)
+        : page_size(page_size), num_pages(num_pages),
+          gctx({.mem_size = ggml::tensor_overhead() * Rows::MAX, .mem_buffer = nullptr, .no_alloc = true}),
+          buffer(nullptr), version(0)
+    {
+        CHATLLM_CHECK(page_size > 0) << "page size must be positive";
+
+        // row indices are graph inputs; the scheduler copies them to other backends if needed
+        for (int i = 0; i < Rows::MAX; i++)
+            rows[i] = ggml_new_tensor_1d(gctx.get(), GGML_TYPE_I32, get_pool_length());
+        buffer = ggml_backend_alloc_ctx_tensors_from_buft(gctx.get(), ggml_backend_cpu_buffer_type());
+        CHATLLM_CHECK(buffer) << "failed to allocate KV page rows";
+        v_rows.resize(get_pool_length());
+
+        release_all();
+    }
+
+    KVPageTable::~KVPageTable()
+    {
+        ggml_backend_buffer_free(buffer);
+    }
+
+    bool KVPageTable::reserve(int slot, int batch, int n_tokens)
+    {
+        const int needed = (n_tokens + page_size - 1) / page_size;
+        if ((int)tables.size() < slot + batch)
+            tables.resize(slot + batch);
+
+        // nothing changes when pages are not enough, so no page is leaked
+        int available = (int)free_pages.size();
+        int wanted = 0;
+        for (int i = slot; i < slot + batch; i++)
+        {
+            const int n = (int)tables[i].size();
+            if (n > needed)
+                available += n - needed;
+            else
+                wanted += needed - n;
+        }
+        if (wanted > available) return false;
+
+        version++;
+        for (int i = slot; i < slot + batch; i++)
+        {
+            auto &pages = tables[i];
+            while ((int)pages.size() > needed)
+            {
+                free_pages.push_back(pages.back());
+                pages.pop_back();
+            }
+        }
+        for (int i = slot; i < slot + batch; i++)
+        {
+            auto &pages = tables[i];
+            while ((int)pages.size() < needed)
+            {
+                pages.push_back(free_pages.back());
+                free_pages.pop_back();
+            }
+        }
+        return true;
+    }
+
+    void KVPageTable::release(int slot)
+    {
+        if (slot >= (int)tables.size()) return;
+        auto &pages = tables[slot];
+        free_pages.insert(free_pages.end(), pages.begin(), pages.end());
+        pages.clear();
+        version++;
+    }
+
+    void KVPageTable::release_all(void)
+    {
+        tables.clear();
+        free_pages.clear();
+        version++;
+        // lower pages are handed out first
+        for (int i = num_pages - 1; i >= 0; i--)
+            free_pages.push_back(i);
+    }
+
+    int KVPageTable::row_of(int slot, int pos) const
+    {
+        const int index = pos / page_size;
+        if ((slot >= (int)tables.size()) || (index >= (int)tables[slot].size())) return 0;
+        return tables[slot][index] * page_size + pos % page_size;
+    }
+
+    int KVPageTable::get_slot_pages(int slot) const
+    {
+        return slot < (int)tables.size() ? (int)tables[slot].size() : 0;
+    }
+
+    int KVPageTable::get_page(int slot, int index) const
+    {
+        return tables[slot][index];
+    }
+
+    ggml::tensor *KVPageTable::fill_rows(ComputeContext *ctx, Rows which, int slot, int batch, int from, int len)
+    {
+        return fill_rows(ctx, which, slot, std::vector<int>(batch, from), len);
+    }
+
+    ggml::tensor *KVPageTable::fill_rows(ComputeContext *ctx, Rows which, int slot, const std::vector<int> &from, int len)
+    {
+        const int batch = (int)from.size();
+        const int n = batch * len;
+        CHATLLM_CHECK(n <= get_pool_length()) << "too many KV rows: " << n;
+
+        // all layers ask for the same rows
+        std::vector<int> key({slot, len, version});
+        key.insert(key.end(), from.begin(), from.end());
+        if (filled[which] != key)
+        {
+            for (int b = 0; b < batch; b++)
+                for (int i = 0; i < len; i++)
+                    v_rows[b * len + i] = row_of(slot + b, from[b] + i);
+
+            Backend::write_tensor_data(rows[which], v_rows.data(), 0, n * sizeof(v_rows[0]));
+            filled[which] = key;
+        }
+
+        return ggml::view_1d(ctx, rows[which], n, 0);
+    }
+
     size_t KVCacheAttention::read_cache_data(void *buffer, size_t buffer_size) const
     {
+        if (kv_pages)
+        {
+            // pages of slot 0 in logical order: K pages, then V pages
+            const size_t k_page = ggml::row_size(k_cache) * kv_pages->page_size;
+            const size_t v_page = ggml::row_size(v_cache) * kv_pages->page_size;
+            const int    n      = kv_pages->get_slot_pages(0);
+            uint8_t *p = (uint8_t *)buffer;
+            CHATLLM_CHECK(n * (k_page + v_page) <= buffer_size) << "buffer too small";
+
+            memset(buffer, 0, buffer_size);
+            for (int i = 0; i < n; i++, p += k_page)
+                Backend::read_tensor_data(k_cache, p, kv_pages->get_page(0, i) * k_page, k_page);
+            p = (uint8_t *)buffer + ggml::nbytes(k_cache);
+            for (int i = 0; i < n; i++, p += v_page)
+                Backend::read_tensor_data(v_cache, p, kv_pages->get_page(0, i) * v_page, v_page);
+            return buffer_size;
+        }
+
         size_t r = 0;
         uint8_t *p = (uint8_t *)buffer;
         if (k_cache)
@@ -2376,6 +2689,23 @@ namespace chatllm
 
     size_t KVCacheAttention::write_cache_data(const void *buffer, size_t buffer_size)
     {
+        if (kv_pages)
+        {
+            // the model has reserved pages of slot 0 for the restored length
+            const size_t k_page = ggml::row_size(k_cache) * kv_pages->page_size;
+            const size_t v_page = ggml::row_size(v_cache) * kv_pages->page_size;
+            const int    n      = kv_pages->get_slot_pages(0);
+            const uint8_t *p = (const uint8_t *)buffer;
+            CHATLLM_CHECK(n * (k_page + v_page) <= buffer_size) << "buffer too small";
+
+            for (int i = 0; i < n; i++, p += k_page)
+                Backend::write_tensor_data(k_cache, p, kv_pages->get_page(0, i) * k_page, k_page);
+            p = (const uint8_t *)buffer + ggml::nbytes(k_cache);
+            for (int i = 0; i < n; i++, p += v_page)
+                Backend::write_tensor_data(v_cache, p, kv_pages->get_page(0, i) * v_page, v_page);
+            return buffer_size;
+        }
+
         size_t r = 0;
         const uint8_t *p = (const uint8_t *)buffer;
         if (k_cache)
@@ -2399,26 +2729,60 @@ namespace chatllm
     {
         CoreAttention::before_forward(ctx, n_past, qlen);
 
+        if (ctx->graph_reuse.is_enabled())
+        {
+            ctx->graph_reuse.attn_layers++;
+            ctx->graph_reuse.add_patcher([this, qlen](ComputeContext *ctx, int n_past) {
+                prepare_pos_tensor(ctx, n_past, qlen);
+            });
+        }
+
+        // n_past decides the page tables
+        if (kv_pages)
+            ctx->graph_reuse.veto();
+
         // shift cache
         if (shift_pending.shift > 0)
         {
+            ctx->graph_reuse.veto();
             int remain = shift_pending.total - shift_pending.shift;
-            if (remain > 0)
+            if ((remain > 0) && kv_pages)
+            {
+                ggml::tensor *src_rows = kv_pages->fill_rows(ctx, KVPageTable::Rows::ShiftSrc, 0, 1, shift_pending.shift, remain);
+                ggml::tensor *dst_rows = kv_pages->fill_rows(ctx, KVPageTable::Rows::ShiftDst, 0, 1, 0, remain);
+
+                ggml::tensor *k_remain = ggml::get_rows(ctx, k_cache, src_rows);
+                ggml::tensor *v_remain = ggml::get_rows(ctx, v_cache, src_rows);
+                ggml::build_forward_expand(ctx, ggml::set_rows(ctx, k_cache, dst_rows, k_remain));
+                ggml::build_forward_expand(ctx, ggml::set_rows(ctx, v_cache, dst_rows, v_remain));
+            }
+            else if (remain > 0)
             {
                 ggml::tensor * k_cache_remain = ggml::view_1d(ctx, k_cache, remain * k_hidden_size,
                                             ggml::row_size(k_cache) * shift_pending.shift);
                 ggml::tensor * k_cache_1d = ggml::view_1d(ctx, k_cache, remain * k_hidden_size,
                                             0);
 
-                ggml::tensor * v_cache_remain = ggml::view_2d(ctx, v_cache, remain, v_hidden_size,
-                                            cache_length * ggml::element_size(v_cache),
-                                            shift_pending.shift * ggml::element_size(v_cache));
-                ggml::tensor * v_cache_2d =     ggml::view_2d(ctx, v_cache, remain, v_hidden_size,
-                                            cache_length * ggml::element_size(v_cache),
-                                            0);
-
                 ggml::build_forward_expand(ctx, ggml::cpy(ctx, k_cache_remain, k_cache_1d));
-                ggml::build_forward_expand(ctx, ggml::cpy(ctx, v_cache_remain, v_cache_2d));
+
+                if (!v_transposed)
+                {
+                    ggml::tensor * v_cache_remain = ggml::view_1d(ctx, v_cache, remain * v_hidden_size,
+                                                ggml::row_size(v_cache) * shift_pending.shift);
+                    ggml::tensor * v_cache_1d = ggml::view_1d(ctx, v_cache, remain * v_hidden_size,
+                                                0);
+                    ggml::build_forward_expand(ctx, ggml::cpy(ctx, v_cache_remain, v_cache_1d));
+                }
+                else
+                {
+                    ggml::tensor * v_cache_remain = ggml::view_2d(ctx, v_cache, remain, v_hidden_size,
+                                                cache_length * ggml::element_size(v_cache),
+                                                shift_pending.shift * ggml::element_size(v_cache));
+                    ggml::tensor * v_cache_2d =     ggml::view_2d(ctx, v_cache, remain, v_hidden_size,
+                                                cache_length * ggml::element_size(v_cache),
+                                                0);
+                    ggml::build_forward_expand(ctx, ggml::cpy(ctx, v_cache_remain, v_cache_2d));
+                }
             }
             shift_pending.clear();
         }
@@ -2435,50 +2799,170 @@ namespace chatllm
             return;
         }
 
+        // each batch row of the input goes to its own slot: [kv_slot, kv_slot + batch),
+        // unless a smaller batch is to be broadcast to all slots (see `ComputeContext::kv_slot_rows`).
         int batch = ggml::get_dim(v, 2);
-        CHATLLM_CHECK((batch <= reserved_batch_size) && ((reserved_batch_size % batch) == 0));
+        const int slot  = ctx->kv_slot;
         batch_size = batch;
 
-        if (batch < reserved_batch_size)
+        if (!ctx->kv_slot_rows && (batch < reserved_batch_size))
         {
+            CHATLLM_CHECK((slot == 0) && ((reserved_batch_size % batch) == 0)) << "can't broadcast " << batch << " rows to " << reserved_batch_size << " KV slots";
             batch = reserved_batch_size;
             k = ggml::repeat(ctx, k, 0, 0, 0, batch);
             v = ggml::repeat(ctx, v, 0, 0, batch);
         }
 
+        CHATLLM_CHECK((slot >= 0) && (slot + batch <= reserved_batch_size)) << "KV slots out of range: " << slot << " + " << batch;
+
+        // rows of a batched decoding step are written at their own positions
+        auto &positions = ctx->row_positions;
+        const bool per_row = positions.is_enabled() && (qlen == 1) && ((int)positions.n_past.size() == batch);
+        auto row_past = [&positions, per_row, n_past](int b) { return per_row ? positions.n_past[b] : n_past; };
+        if (per_row) positions.handle();
+
+        if (kv_pages)
+        {
+            // token rows: [batch, qlen, hidden_size]
+            std::vector<int> from(batch);
+            for (int b = 0; b < batch; b++) from[b] = row_past(b);
+            ggml::tensor *rows = kv_pages->fill_rows(ctx, KVPageTable::Rows::Write, slot, from, qlen);
+
+            if (!ggml::is_contiguous(k)) k = ggml::cont(ctx, k);
+            if (!ggml::is_contiguous(v)) v = ggml::cont(ctx, v);
+            k = ggml::reshape_2d(ctx, k, k_hidden_size, qlen * batch);
+            v = ggml::reshape_2d(ctx, v, v_hidden_size, qlen * batch);
+
+            ggml::build_forward_expand(ctx, ggml::set_rows(ctx, k_cache, rows, k));
+            ggml::build_forward_expand(ctx, ggml::set_rows(ctx, v_cache, rows, v));
+            return;
+        }
+
         // save v
         // v input: [batch, qlen, hidden_size]
+        if (!v_transposed)
+        {
+            // quantized rows are written per batch row, so that each destination is contiguous
+            const int max_length = cache_length / reserved_batch_size;
+            const size_t row_size  = ggml::row_size(v_cache);
+            const size_t slot_size = row_size * max_length;
+
+            for (int b = 0; b < batch; b++)
+            {
+                ggml::tensor * Vcur = ggml::view_2d(ctx, v, v_hidden_size, qlen, v->nb[1], b * v->nb[2]);
+                ggml::tensor * v_cache_view = ggml::view_1d(ctx, v_cache, (int64_t)qlen * v_hidden_size,
+                        (slot + b) * slot_size + row_past(b) * row_size);
+                if (!ggml::is_contiguous(Vcur)) Vcur = ggml::cont(ctx, Vcur);
+                ggml::tensor * v_saved = ggml::cpy(ctx, Vcur, v_cache_view);
+
+                ggml::build_forward_expand(ctx, v_saved);
+
+                if (ctx->graph_reuse.is_enabled())
+                {
+                    ctx->graph_reuse.add_patcher([=](ComputeContext *ctx, int n_past) {
+                        ggml::set_view_offset(v_cache_view, (slot + b) * slot_size + n_past * row_size);
+                        ggml::set_view_offset(v_saved,      (slot + b) * slot_size + n_past * row_size);
+                    }, 0);
+                }
+            }
+        }
         // expected from v_cache: [batch, heads, head_size, qlen]
+        else if (per_row)
         {
-            const int max_length = cache_length / batch;
-            const int head_size  = v_hidden_size / num_kv_heads;
+            const int max_length = cache_length / reserved_batch_size;
+            const size_t es = ggml::element_size(v_cache);
+            const size_t slot_size = es * max_length * v_hidden_size;
+
+            for (int b = 0; b < batch; b++)
+            {
+                ggml::tensor * Vcur = ggml::transpose(ctx, ggml::view_2d(ctx, v, v_hidden_size, qlen, v->nb[1], b * v->nb[2]));
+                ggml::tensor * v_cache_view = ggml::view_2d(ctx, v_cache, qlen, v_hidden_size,
+                        es * max_length,
+                        (slot + b) * slot_size + row_past(b) * es);
+                ggml::build_forward_expand(ctx, ggml::cpy(ctx, Vcur, v_cache_view));
+            }
+        }
+        else
+        {
+            const int max_length = cache_length / reserved_batch_size;
+            const size_t slot_size = ggml::element_size(v_cache) * max_length * v_hidden_size;
 
             ggml::tensor * Vcur = ggml::transpose(ctx, v);
             ggml::tensor * v_cache_view = ggml::view_3d(ctx, v_cache, qlen, v_hidden_size, batch,
                     ggml::element_size(v_cache) * max_length,
-                    ggml::element_size(v_cache) * max_length * v_hidden_size,
-                    n_past * ggml::element_size(v_cache));
+                    slot_size,
+                    slot * slot_size + n_past * ggml::element_size(v_cache));
+            ggml::tensor * v_saved = ggml::cpy(ctx, Vcur, v_cache_view);
+
+            ggml::build_forward_expand(ctx, v_saved);
 
-            ggml::build_forward_expand(ctx, ggml::cpy(ctx, Vcur, v_cache_view));
+            if (ctx->graph_reuse.is_enabled())
+            {
+                const size_t es = ggml::element_size(v_cache);
+                ctx->graph_reuse.add_patcher([=](ComputeContext *ctx, int n_past) {
+                    ggml::set_view_offset(v_cache_view, slot * slot_size + n_past * es);
+                    ggml::set_view_offset(v_saved,      slot * slot_size + n_past * es);
+                }, 0);
+            }
         }
 
         // save k
         {
-            const int max_length = cache_length / batch;
             const int head_size  = k_hidden_size / num_kv_heads;
             const int64_t k_cache_row_size = ggml::row_size(ggml::type_of(k_cache), head_size);
+            const int64_t reserved = reserved_batch_size;
+            const int64_t pos_size = k_cache_row_size * num_kv_heads;
+
+            if (per_row)
+            {
+                for (int b = 0; b < batch; b++)
+                {
+                    ggml::tensor * k_cache_view = ggml::view_4d(ctx, k_cache, head_size, num_kv_heads, 1, qlen,
+                        k_cache_row_size, pos_size, pos_size * reserved,
+                        pos_size * (reserved * row_past(b) + slot + b));
+                    ggml::tensor * k_row  = ggml::view_4d(ctx, k, head_size, num_kv_heads, qlen, 1, k->nb[1], k->nb[2], k->nb[3], b * k->nb[3]);
+                    ggml::tensor * k_view = ggml::permute(ctx, k_row, 0, 1, 3, 2);
+                    ggml::build_forward_expand(ctx, ggml::cpy(ctx, k_view, k_cache_view));
+                }
+                return;
+            }
 
             ggml::tensor * k_cache_view = ggml::view_4d(ctx, k_cache, head_size, num_kv_heads, batch, qlen,
                 k_cache_row_size,
-                k_cache_row_size * num_kv_heads,
-                k_cache_row_size * num_kv_heads * batch,
-                k_cache_row_size * num_kv_heads * batch * n_past);
+                pos_size,
+                pos_size * reserved,
+                pos_size * (reserved * n_past + slot));
 
             ggml::tensor * k_view = ggml::permute(ctx, k, 0, 1, 3, 2); // exchange batch & qlen
+            ggml::tensor * k_saved = ggml::cpy(ctx, k_view, k_cache_view);
 
-            ggml::build_forward_expand(ctx, ggml::cpy(ctx, k_view, k_cache_view));
+            ggml::build_forward_expand(ctx, k_saved);
+
+            if (ctx->graph_reuse.is_enabled())
+            {
+                ctx->graph_reuse.add_patcher([=](ComputeContext *ctx, int n_past) {
+                    ggml::set_view_offset(k_cache_view, pos_size * (reserved * n_past + slot));
+                    ggml::set_view_offset(k_saved,      pos_size * (reserved * n_past + slot));
+                });
+            }
+        }
+    }
+
+    int KVCacheAttention::get_cache_klen(ComputeContext *ctx, const int n_past, const int qlen) const
+    {
+        if (!ctx->graph_reuse.is_enabled())
+            return n_past + qlen;
+
+        if (!is_kv_padding_supported())
+        {
+            ctx->graph_reuse.veto();
+            return n_past + qlen;
         }
 
+        // when the graph is to be reused, the length is padded (extra positions are masked out),
+        // so that it stays the same for a range of `n_past`.
+        ctx->graph_reuse.add_patcher(nullptr);
+        return ctx->graph_reuse.get_klen(n_past, qlen, cache_length / reserved_batch_size);
     }
 
     ggml::tensor *KVCacheAttention::get_k_from_cache(ComputeContext *ctx, const int hidden_size, const int n_past, const int qlen)
@@ -2494,11 +2978,23 @@ namespace chatllm
         const int head_size  = k_hidden_size / num_kv_heads;
         const int64_t k_cache_row_size = ggml::row_size(ggml::type_of(k_cache), head_size);
 
-        key_layer = ggml::view_4d(ctx, k_cache, head_size, num_kv_heads, batch_size, n_past + qlen,
+        if (kv_pages)
+        {
+            const int klen = n_past + qlen;
+            ggml::tensor *rows = kv_pages->fill_rows(ctx, KVPageTable::Rows::Read, ctx->kv_slot, batch_size, 0, klen);
+            key_layer = ggml::get_rows(ctx, k_cache, rows);                                     // [batch * klen, k_hidden_size]
+            key_layer = ggml::reshape_4d(ctx, key_layer, head_size, num_kv_heads, klen, batch_size);
+            key_layer = ggml::permute(ctx, key_layer, 0, 2, 1, 3);                             // [batch, heads, klen, head_size]
+            return key_layer;
+        }
+
+        const int klen = get_cache_klen(ctx, n_past, qlen);
+
+        key_layer = ggml::view_4d(ctx, k_cache, head_size, num_kv_heads, batch_size, klen,
             k_cache_row_size,
             k_cache_row_size * num_kv_heads,
             k_cache_row_size * num_kv_heads * reserved_batch_size,
-            0);
+            k_cache_row_size * num_kv_heads * ctx->kv_slot);
 
         key_layer = ggml::permute(ctx, key_layer, 0, 2, 3, 1);                                 // [batch, heads, qlen, head_size]
         if (ggml::is_quantized(key_layer))
@@ -2519,19 +3015,57 @@ namespace chatllm
             return r;
         }
 
+        if (kv_pages || !v_transposed)
+        {
+            ggml::tensor *value_layer = get_v_rows_from_cache(ctx, hidden_size, n_past, qlen);  // [batch, heads, klen, head_size]
+            if (ggml::type_of(value_layer) != ggml::type::GGML_TYPE_F32)
+                value_layer = ggml::cast(ctx, value_layer, ggml::type::GGML_TYPE_F32);          // dequantize
+            value_layer = ggml::permute(ctx, value_layer, 1, 0, 2, 3);                         // [batch, heads, head_size, klen]
+            return ggml::cont(ctx, value_layer);
+        }
+
         const int max_length = cache_length / reserved_batch_size;
         const int head_size  = v_hidden_size / num_kv_heads;
+        const int klen       = get_cache_klen(ctx, n_past, qlen);
 
         ggml::tensor * value_layer = ggml::view_4d(ctx,
                         v_cache,
-                        n_past + qlen, head_size, num_kv_heads, batch_size,
+                        klen, head_size, num_kv_heads, batch_size,
                         ggml::element_size(v_cache) * max_length,
                         ggml::element_size(v_cache) * max_length * head_size,
                         ggml::element_size(v_cache) * max_length * v_hidden_size,
-                        0); // [batch, heads, head_size, klen]
+                        ggml::element_size(v_cache) * max_length * v_hidden_size * ctx->kv_slot); // [batch, heads, head_size, klen]
         return value_layer;
     }
 
+    ggml::tensor *KVCacheAttention::get_v_rows_from_cache(ComputeContext *ctx, const int hidden_size, const int n_past, const int qlen)
+    {
+        if ((cache_length < 1) || (!kv_pages && v_transposed))
+            return CoreAttention::get_v_rows_from_cache(ctx, hidden_size, n_past, qlen);
+
+        const int max_length = cache_length / reserved_batch_size;
+        const int head_size  = v_hidden_size / num_kv_heads;
+
+        if (kv_pages)
+        {
+            const int klen = n_past + qlen;
+            ggml::tensor *rows = kv_pages->fill_rows(ctx, KVPageTable::Rows::Read, ctx->kv_slot, batch_size, 0, klen);
+            ggml::tensor *value_layer = ggml::get_rows(ctx, v_cache, rows);                   // [batch * klen, v_hidden_size]
+            value_layer = ggml::reshape_4d(ctx, value_layer, head_size, num_kv_heads, klen, batch_size);
+            return ggml::permute(ctx, value_layer, 0, 2, 1, 3);                                // [batch, heads, klen, head_size]
+        }
+
+        const int klen       = get_cache_klen(ctx, n_past, qlen);
+
+        const size_t row_size = ggml::row_size(v_cache);
+        ggml::tensor *value_layer = ggml::view_4d(ctx, v_cache, head_size, num_kv_heads, klen, batch_size,
+                        ggml::row_size(ggml::type_of(v_cache), head_size),
+                        row_size,
+                        row_size * max_length,
+                        row_size * max_length * ctx->kv_slot);
+        return ggml::permute(ctx, value_layer, 0, 2, 1, 3);                                    // [batch, heads, klen, head_size]
+    }
+
     void BaseAttention::set_prec(ggml::prec prec)
     {
         KVCacheAttention::set_prec(prec);
@@ -178,10 +178,19 @@ namespace chatllm
         ggml::tensor *soft_max_ext(ComputeContext *ctx,  ggml::tensor *a,  ggml::tensor *mask, float scale, float max_bias);
         void          soft_max_attach_sinks(ggml::tensor *soft_max_result, ggml::tensor *sinks);
 
+        // q: [batch, heads, qlen, head_size], k & v: [batch, kv_heads, klen, head_size], mask: F16 [qlen, klen]
+        // output: [batch, qlen, heads, head_size]
+        ggml::tensor *flash_attn_ext(ComputeContext *ctx, ggml::tensor *q, ggml::tensor *k, ggml::tensor *v, ggml::tensor *mask,
+                                     float scale, float max_bias, float logit_softcap);
+        void          flash_attn_attach_sinks(ggml::tensor *flash_attn_result, ggml::tensor *sinks);
+
+        ggml::tensor *fill(ComputeContext *ctx, ggml::tensor *a, float c);
+
         ggml::tensor *sigmoid(ComputeContext *ctx, ggml::tensor *a);
 
         ggml::tensor *diag_mask_inf(ComputeContext *ctx, ggml::tensor *a, int n_past);
         ggml::tensor *diag_mask_inf_inplace(ComputeContext *ctx, ggml::tensor *a, int n_past);
+        void          diag_mask_set_n_past(ggml::tensor *diag_mask_result, int n_past);
 
         ggml::tensor *inplace_act(ComputeContext *ctx, ActFunc act, ggml::tensor *input);
         ggml::tensor *act(ComputeContext *ctx, ActFunc act, ggml::tensor *input);
@@ -252,6 +261,8 @@ namespace chatllm
         void mul_mat_set_prec(ggml::tensor *a, ggml::prec prec);
         bool is_contiguous(const ggml::tensor *a);
         bool is_view(const ggml::tensor *tensor);
+        // move a view (and results of in-place ops on it, such as `cpy`) within its source
+        void set_view_offset(ggml::tensor *view, size_t offset);
 
         struct ggml_cgraph *new_graph_custom(ComputeContext *ctx, size_t size, bool grads);
         void build_forward_expand(ComputeContext *ctx, ggml::tensor * tensor);
@@ -774,7 +785,6 @@ namespace chatllm
               indices(ggml::new_tensor_1d(ctx, GGML_TYPE_I32, pos_max)),
               ln(ctx, embedding_dim)
         {
-            const int pad_index = 2;
             std::vector<int> v_indices;
             v_indices.resize(pos_max);
             for (int i = 0; i < pos_max; i++)
@@ -787,6 +797,9 @@ namespace chatllm
         using Block::forward;
         ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input) override;
 
+        // `positions`: position ids of `input` (starting from `pad_index`), e.g. of several packed sequences
+        ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input, ggml::tensor *positions);
+
         int64_t get_param_num(bool effective_only) const override
         {
             int64_t r = ln.get_param_num(effective_only);
@@ -798,6 +811,7 @@ namespace chatllm
         void load(const std::string &path, TensorLoader *loader) override;
 
     public:
+        static const int pad_index = 2;
         ggml::tensor *word_weight;
         ggml::tensor *position_weight;
         ggml::tensor *indices;
@@ -1515,6 +1529,22 @@ namespace chatllm
         virtual ggml::tensor *attn_scores_to_probs(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
                                             ggml::tensor *attn_scores);
 
+        // fused attention (`ggml_flash_attn_ext`), replacing `calc_attn_scores` when enabled by user options.
+        // k: [heads, klen, head_size]
+        // q: [heads, qlen, head_size]
+        // v: [heads, klen, head_size] (not transposed)
+        virtual ggml::tensor *calc_attn_fused(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
+                                            ggml::tensor *key_layer, ggml::tensor *query_layer, ggml::tensor *value_layer);
+
+        // derived classes customizing attention scores (`calc_attn_scores`, `attn_scores_to_probs`,
+        // `apply_pos_embedding_kq`) shall return false, so that the fused path is not used.
+        virtual bool is_fused_attn_supported(void) const { return nullptr == attn_scores_pp; }
+
+        // K/V read from cache may be padded beyond `n_past + qlen` (see `ComputeContext::GraphReuse`) only if
+        // padded keys are masked out by the causal mask alone, and scores are not customized.
+        // derived classes that can't tolerate padded keys shall return false: their graphs are built unpadded.
+        virtual bool is_kv_padding_supported(void) const { return causal && (nullptr == mask) && is_fused_attn_supported(); }
+
         // input & output: [qlen, heads, head_size]
         // CAUTION: **inplace** operation is assumed.
         virtual ggml::tensor *apply_pos_embedding_k(ComputeContext *ctx, ggml::tensor *k, int hidden_size, int qlen, ggml::tensor * past) const { return k; }
@@ -1533,6 +1563,9 @@ namespace chatllm
         // output: [heads, head_size, klen]
         virtual ggml::tensor *get_v_from_cache(ComputeContext *ctx, const int hidden_size, const int n_past, const int qlen) = 0;
 
+        // output: [heads, klen, head_size] (for fused attention)
+        virtual ggml::tensor *get_v_rows_from_cache(ComputeContext *ctx, const int hidden_size, const int n_past, const int qlen);
+
         virtual ggml::tensor *cross_attention_after_pe(ComputeContext *ctx, const int hidden_size, const int n_past, const int qlen,
                                              ggml::tensor *query_layer, ggml::tensor *key_layer, ggml::tensor *v);
 
@@ -1568,6 +1601,84 @@ namespace chatllm
         std::unique_ptr<BaseTensorPosHelper> pos_helper;
     };
 
+    // Block-paged KV storage shared by all layers of a model:
+    // the cache of each layer is a pool of `num_pages` pages of `page_size` token rows,
+    // and each KV slot (sequence) owns a list of pages that grows and shrinks with its length.
+    class KVPageTable
+    {
+    public:
+        enum Rows
+        {
+            Write,
+            Read,
+            ShiftSrc,
+            ShiftDst,
+            MAX
+        };
+
+        KVPageTable(int page_size, int num_pages);
+        ~KVPageTable();
+
+        // make slots [slot, slot + batch) hold exactly enough pages for `n_tokens`
+        bool reserve(int slot, int batch, int n_tokens);
+        void release(int slot);
+        void release_all(void);
+
+        // physical row of position `pos` of `slot` (row 0 if not mapped)
+        int row_of(int slot, int pos) const;
+
+        int get_pool_length(void) const { return page_size * num_pages; }
+        int get_free_pages(void) const { return (int)free_pages.size(); }
+        int get_slot_pages(int slot) const;
+        int get_page(int slot, int index) const;
+
+        // row indices of positions [from, from + len) of slots [slot, slot + batch), shared by all layers
+        ggml::tensor *fill_rows(ComputeContext *ctx, Rows which, int slot, int batch, int from, int len);
+        // rows of each slot start from their own position `from[b]`
+        ggml::tensor *fill_rows(ComputeContext *ctx, Rows which, int slot, const std::vector<int> &from, int len);
+
+    public:
+        const int page_size;
+        const int num_pages;
+    protected:
+        std::vector<std::vector<int>> tables;
+        std::vector<int> free_pages;
+        GGMLContext gctx;
+        ggml_backend_buffer_t buffer;
+        ggml::tensor *rows[Rows::MAX];
+        std::vector<int> v_rows;
+        // what `rows` hold: {slot, len, version, from...}
+        std::vector<int> filled[Rows::MAX];
+        int version;
+    };
+
+    // KV cache of attentions created within the scope of this is not paged, and V is kept in F16
+    // transposed (for classes that access `k_cache` & `v_cache` directly). Use it like `CacheTypeChanger`.
+    class KVPagingDisabler
+    {
+    public:
+        KVPagingDisabler(InitContext *ctx): ctx(ctx), kv_pages(ctx->kv_pages), v_type(ctx->v_cache_dtype)
+        {
+            ctx->kv_pages = nullptr;
+            ctx->v_cache_dtype = ggml::type::GGML_TYPE_F16;
+        }
+
+        ~KVPagingDisabler()
+        {
+            ctx->kv_pages = kv_pages;
+            ctx->v_cache_dtype = v_type;
+        }
+
+        operator InitContext *() const
+        {
+            return ctx;
+        }
+    private:
+        InitContext *ctx;
+        KVPageTable *kv_pages;
+        ggml::type   v_type;
+    };
+
     class KVCacheAttention : public CoreAttention
     {
     public:
@@ -1590,8 +1701,17 @@ namespace chatllm
                 }
                 else
                 {
+                    // paged only when caching the full context
+                    if (ctx->kv_pages && (cache_length == max_length) && (ctx->kv_pages->get_pool_length() <= cache_length))
+                        kv_pages = ctx->kv_pages;
+
+                    // quantized V is stored like K (one row per position), and dequantized on read
+                    const ggml::type v_type = ggml::type_fallback(ctx->v_cache_dtype, v_hidden_size / num_kv_heads);
+                    v_transposed = !kv_pages && !ggml::is_quantized(v_type);
+
                     k_cache = ggml::new_tensor_2d(ctx, ggml::type_fallback(ctx->cache_dtype, k_hidden_size), k_hidden_size, cache_length),
-                    v_cache = ggml::new_tensor_2d(ctx, ggml::type::GGML_TYPE_F16, cache_length, v_hidden_size);
+                    v_cache = v_transposed ? ggml::new_tensor_2d(ctx, v_type, cache_length, v_hidden_size)
+                                           : ggml::new_tensor_2d(ctx, v_type, v_hidden_size, cache_length);
                 }
 
                 ggml::set_name(k_cache, "k_cache");
@@ -1640,6 +1760,12 @@ namespace chatllm
         // output: [batch, heads, head_size, klen]
         ggml::tensor *get_v_from_cache(ComputeContext *ctx, const int hidden_size, const int n_past, const int qlen) override;
 
+        // output: [batch, heads, klen, head_size]
+        ggml::tensor *get_v_rows_from_cache(ComputeContext *ctx, const int hidden_size, const int n_past, const int qlen) override;
+
+        // length of K/V read from cache: padded for graph reuse if supported, otherwise `n_past + qlen` (and the graph is not reused)
+        int get_cache_klen(ComputeContext *ctx, const int n_past, const int qlen) const;
+
     public:
         const int k_hidden_size;
         const int v_hidden_size;
@@ -1650,6 +1776,11 @@ namespace chatllm
     private:
         ggml::tensor *raw_k;
         ggml::tensor *raw_v;
+
+        // paged layout: K & V are both [cache_length, hidden_size], rows mapped by `kv_pages`
+        KVPageTable *kv_pages = nullptr;
+        // V is [hidden_size, cache_length] (F16/F32, not paged), otherwise [cache_length, hidden_size]
+        bool v_transposed = true;
     };
 
     class BaseConsolidatedQKVAttention : public KVCacheAttention
@@ -1858,7 +1989,7 @@ namespace chatllm
     {
     public:
         BaseSlidingWindowAttentionRingCache(InitContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int max_length, bool qkv_bias, bool o_bias)
-            : BaseAttention(ctx, hidden_size, num_attention_heads, num_kv_heads, max_length, qkv_bias, o_bias, sliding_window_len),
+            : BaseAttention(KVPagingDisabler(ctx), hidden_size, num_attention_heads, num_kv_heads, max_length, qkv_bias, o_bias, sliding_window_len),
               cache_offset(0),
               indices(ggml::new_tensor_1d(ctx, GGML_TYPE_I32, sliding_window_len))
         {
@@ -1990,7 +2121,7 @@ namespace chatllm
         }
 
         BaseSlidingWindowAttentionFullCache(InitContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int head_dim, int max_length, bool qkv_bias, bool o_bias)
-            : BaseAttention(ctx, hidden_size, num_attention_heads, num_kv_heads, head_dim, max_length, qkv_bias, o_bias, max_length),
+            : BaseAttention(KVPagingDisabler(ctx), hidden_size, num_attention_heads, num_kv_heads, head_dim, max_length, qkv_bias, o_bias, max_length),
               indices(ggml::new_tensor_1d(ctx, GGML_TYPE_I32, 1)) // to ensure number of tensors are the same
         {
         }
@@ -2056,7 +2187,7 @@ namespace chatllm
         }
 
         BaseSlidingWindowAttentionPartialCache(InitContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int head_dim, int max_length, bool qkv_bias, bool o_bias)
-            : BaseAttention(ctx, hidden_size, num_attention_heads, num_kv_heads, head_dim, max_length, qkv_bias, o_bias, sliding_window_len + extra_len),
+            : BaseAttention(KVPagingDisabler(ctx), hidden_size, num_attention_heads, num_kv_heads, head_dim, max_length, qkv_bias, o_bias, sliding_window_len + extra_len),
               indices(ggml::new_tensor_1d(ctx, GGML_TYPE_I32, 1)), // to ensure number of tensors are the same
               cache_offset(0)
         {
@@ -2284,16 +2415,46 @@ namespace chatllm
         // input & output: [qlen, heads, head_size]
         ggml::tensor *apply_pos_embedding_k(ComputeContext *ctx, ggml::tensor *k, int hidden_size, int qlen, ggml::tensor * past) const override
         {
-            if (!use_rope) return k;
+            if (!use_rope)
+            {
+                if (ctx->row_positions.is_enabled()) ctx->row_positions.handle();
+                return k;
+            }
+            if (ctx->row_positions.is_enabled())
+                return apply_rope_rows(ctx, k, past);
             return ggml::rope_ext_inplace(ctx, k, past, freq_factors, rope_dim, rope_mode, n_original_ctx,
                             freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow, mrope_sections);    // [qlen, heads, head_size]
         }
         ggml::tensor *apply_pos_embedding_q(ComputeContext *ctx, ggml::tensor *q, int hidden_size, int qlen, ggml::tensor * past) const override
         {
-            if (!use_rope) return q;
+            if (!use_rope)
+            {
+                if (ctx->row_positions.is_enabled()) ctx->row_positions.handle();
+                return q;
+            }
+            if (ctx->row_positions.is_enabled())
+                return apply_rope_rows(ctx, q, past);
             return ggml::rope_ext_inplace(ctx, q, past, freq_factors, rope_dim, rope_mode, n_original_ctx,
                             freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow, mrope_sections);    // [qlen, heads, head_size];
         }
+
+        // rows of a batched decoding step have their own positions (`past`: [batch]):
+        // [batch, 1, heads, head_size] is rotated as [batch, heads, head_size]. Left to the caller to reject otherwise.
+        ggml::tensor *apply_rope_rows(ComputeContext *ctx, ggml::tensor *x, ggml::tensor * past) const
+        {
+            const int64_t batch = ggml::get_dim(x, 3);
+            const bool supported = (nullptr == mrope_sections)
+                                    && ((rope_mode == RoPEMode::Interleaved) || (rope_mode == RoPEMode::Original))
+                                    && (ggml::get_dim(x, 2) == 1) && (ggml::get_dim(past, 0) == batch);
+            if (!supported) return x;
+
+            ctx->row_positions.handle();
+            if (!ggml::is_contiguous(x)) x = ggml::cont(ctx, x);
+            ggml::tensor *r = ggml::reshape_3d(ctx, x, ggml::get_dim(x, 0), ggml::get_dim(x, 1), batch);
+            r = ggml::rope_ext_inplace(ctx, r, past, freq_factors, rope_dim, rope_mode, n_original_ctx,
+                            freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow, nullptr);
+            return ggml::reshape_4d(ctx, r, ggml::get_dim(x, 0), ggml::get_dim(x, 1), 1, batch);
+        }
     };
 
     class GLMSelfAttention : public RoPESelfAttention<BaseConsolidatedQKVAttention>
@@ -2774,6 +2935,9 @@ namespace chatllm
         using Block::forward;
         ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *hidden_states) override;
 
+        // `pooled`: hidden states of the first token of each sequence
+        ggml::tensor *forward_pooled(ComputeContext *ctx, ggml::tensor *pooled);
+
         int64_t get_param_num(bool effective_only) const override
         {
             int64_t r = 0;
@@ -3069,6 +3233,8 @@ namespace chatllm
         ggml::tensor *attn_scores_to_probs(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
             ggml::tensor *attn_scores) override;
 
+        bool is_fused_attn_supported(void) const override { return false; }
+
     public:
         float  bias_max;
         float  scale;
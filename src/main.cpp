@@ -50,6 +50,7 @@ struct Args
     std::string dump_dot;
     std::string emb_rank_query_sep;
     std::map<std::string, std::vector<std::string>> vector_stores;
+    std::map<std::string, std::string> vs_indices;
     std::string rpc_endpoints;
     std::string serve_rpc;
     std::string ggml_dir;
@@ -67,6 +68,7 @@ struct Args
     float top_p = 0.7f;
     float temp = 0.7f;
     float tfs_z = 0.95f;
+    float min_p = 0.05f;
     float presence_penalty = 0.0f;
     float repeat_penalty = 1.0f;
     float frequency_penalty = 0.0f;
@@ -89,6 +91,8 @@ struct Args
     bool reversed_role = false;
     int save_session_rounds = -1;
     int beam_size = -1;
+    std::string draft_model_path = "";
+    int draft_n = 4;
     int log_level = 4;
     bool moe_on_cpu = false;
     int batch_size = 4096;
@@ -189,12 +193,13 @@ void usage(const std::string &prog)
               << "  --re_quantize Q         re-quantize model weights during loading (Q ::= q8_0 | q4_0 | q4_1 | q4_k | ...) (default: no re-quantization)\n"
               << "                          note: it does not make sense to re-quantize to a larger size.\n"
               << "Sampling options:\n"
-              << "  --sampling ALG          sampling algorithm (ALG = greedy | top_p | tfs) (default: top_p) \n"
+              << "  --sampling ALG          sampling algorithm (ALG = greedy | top_p | tfs | min_p) (default: top_p) \n"
               << "                          where, tfs = Tail Free Sampling\n"
               << "  -t, --temp T            temperature (default: " << args.temp << ") (Note: `-t 0` also sets sampling algorithm to greedy)\n"
               << "  --top_k N               top-k sampling (default: " << args.top_k << ")\n"
               << "  --top_p N               top-p sampling (default: " << args.top_p << ")\n"
               << "  --tfs_z Z               Z param for TFS (default: " << args.tfs_z << ")\n"
+              << "  --min_p P               P param for min-p sampling (default: " << args.min_p << ")\n"
               << "  --repeat_penalty N      repetition penalty (default: " << args.repeat_penalty << ", 1.0=no penalty)\n"
               << "  --presence_penalty N    penalty alpha for presence (default: " << args.presence_penalty << ", 0.0=disabled)\n"
               << "  --frequency_penalty N   penalty alpha for probability (default: " << args.frequency_penalty << ", 0.0=disabled)\n"
@@ -202,11 +207,17 @@ void usage(const std::string &prog)
               << "  --seed N                seed for random generator (default: random)\n"
               << "  --beam_size N           beam size for generation (default: -1, disabled)\n"
               << "                          functionality of beam search limited.\n"
+              << "  --draft_model PATH      draft model for speculative decoding (sharing the tokenizer, default: none)\n"
+              << "  --draft_n N             max number of tokens proposed by the draft model per step (default: 4)\n"
               << "RAG options:\n"
               << "  --set_vs_name           set vector store name.\n"
               << "                          all following vector store files are merged into this vector store. (optional. default: `default`)\n"
               << "                          Note: command line RAG chat will always the first store.\n"
               << "  --vector_store FILE     append a vector store file (when RAG enabled, at lease one is required)\n"
+              << "  --vs_index TYPE         index type of current vector store (default: flat)\n"
+              << "                          TYPE = flat | hnsw. also applies to --init_vs and --merge_vs, which save the index as FILE.hnsw.\n"
+              << "                          knobs (--set): hnsw_m (16), hnsw_ef_construction (200), hnsw_ef_search (64),\n"
+              << "                          ann_min_size (10000, smaller stores are searched exhaustively)\n"
               << "  --embedding_model PATH  embedding model path (when set, RAG is enabled)\n"
               << "  --distance_strategy DS  distance strategy (model dependent, default: MaxInnerProduct)\n"
               << "                          DS = EuclideanDistance | MaxInnerProduct | InnerProduct | CosineSimilarity\n"
@@ -398,6 +409,12 @@ static size_t parse_args(Args &args, const std::vector<std::string> &argv)
                     args.vector_stores.at(args.cur_vs_name).push_back(argv[c]);
                 }
             }
+            else if (utils::is_same_command_option(arg, "--vs_index"))
+            {
+                c++;
+                if (c < argc)
+                    args.vs_indices.insert_or_assign(args.cur_vs_name, argv[c]);
+            }
             else if (utils::is_same_command_option(arg, "--thought_tags"))
             {
                 if (c + 2 < argc)
@@ -454,6 +471,7 @@ static size_t parse_args(Args &args, const std::vector<std::string> &argv)
             handle_param("--top_k",                 "-k", top_k,                std::stoi)
             handle_param("--top_p",                 "-q", top_p,                std::stof)
             handle_para0("--tfs_z",                       tfs_z,                std::stof)
+            handle_para0("--min_p",                       min_p,                std::stof)
             handle_param("--temp",                  "-t", temp,                 std::stof)
             handle_para0("--presence_penalty",            presence_penalty,     std::stof)
             handle_para0("--repeat_penalty",              repeat_penalty,       std::stof)
@@ -480,6 +498,8 @@ static size_t parse_args(Args &args, const std::vector<std::string> &argv)
             handle_para0("--load_session",                load_session,         std::string)
             handle_para0("--dump_dot",                    dump_dot,             std::string)
             handle_para0("--beam_size",                   beam_size,            std::stoi)
+            handle_para0("--draft_model",                 draft_model_path,     std::string)
+            handle_para0("--draft_n",                     draft_n,              std::stoi)
             handle_para0("--log_level",                   log_level,            std::stoi)
             handle_para0("--rpc_endpoints",               rpc_endpoints,        std::string)
             handle_para0("--serve_rpc",                   serve_rpc,            std::string)
@@ -637,7 +657,7 @@ public:
 
 static void print_timing(char *str, const char *prefix, size_t tok_number, double duration_sec)
 {
-    sprintf(str, "%s = %12.2f ms / %5zd tokens ( %8.2f ms per token, %8.2f tokens per second)", prefix, duration_sec, tok_number,
+    sprintf(str, "%s = %12.2f ms / %5zu tokens ( %8.2f ms per token, %8.2f tokens per second)", prefix, duration_sec, tok_number,
             tok_number > 0 ? duration_sec / tok_number : 0.0,
             duration_sec > 0.0 ? tok_number / duration_sec * 1000 : 0.0);
 }
@@ -654,10 +674,16 @@ static void show_stat(chatllm::Pipeline &pipeline, chatllm::BaseStreamer &stream
     print_timing(str, "timings:        eval time", perf->timings[chatllm::ModelPerfInfo::Type::Generation].tok_count, perf->timings[chatllm::ModelPerfInfo::Type::Generation].duration_ms);
     streamer.putln(str);
 
-    sprintf(str,      "timings:       total time = %12.2f ms / %5zd tokens",
+    sprintf(str,      "timings:       total time = %12.2f ms / %5zu tokens",
         (perf->timings[chatllm::ModelPerfInfo::Type::Generation].duration_ms + perf->timings[chatllm::ModelPerfInfo::Type::Prompt].duration_ms),
         perf->timings[chatllm::ModelPerfInfo::Type::Generation].tok_count    + perf->timings[chatllm::ModelPerfInfo::Type::Prompt].tok_count);
     streamer.putln(str);
+
+    if (perf->drafted_tokens > 0)
+    {
+        sprintf(str,  "timings:    draft accepted = %12.2f %% / %5zu tokens", perf->DraftAcceptanceRate() * 100, perf->drafted_tokens);
+        streamer.putln(str);
+    }
 }
 
 static void run_file(Args &args, chatllm::Pipeline &pipeline, TextStreamer &streamer, const chatllm::GenerationConfig &gen_config)
@@ -900,6 +926,7 @@ static void run_qa_ranker(Args &args, chatllm::Pipeline &pipeline, TextStreamer
                                          gen_config.repeat_penalty = args.repeat_penalty; \
                                          gen_config.frequency_penalty = args.frequency_penalty; \
                                          gen_config.penalty_window = args.penalty_window; \
+                                         gen_config.min_p = args.min_p; \
                                          gen_config.max_new_tokens = args.max_new_tokens; \
                                          gen_config._seed = args.seed;
 
@@ -964,6 +991,12 @@ void chat(Args &args, chatllm::Pipeline &pipeline, TextStreamer &streamer)
     pipeline.set_additional_args(args.additional);
     streamer.set_interceptor(&thought_interceptor);
 
+    if (args.draft_model_path.size() > 0)
+    {
+        DEF_ExtraArgs(pipe_args, args);
+        pipeline.load_draft_model(args.draft_model_path, pipe_args, args.draft_n);
+    }
+
     const std::string ai_prompt   = "A.I.";
     const std::string user_prompt = "You ";
 
@@ -1218,24 +1251,54 @@ chatllm::BaseStreamer *get_streamer_for_log(void)
     return log_streamer;
 }
 
+static VectorIndexType get_vs_index_type(const Args &args)
+{
+    auto it = args.vs_indices.find(args.cur_vs_name);
+    return it != args.vs_indices.end() ? ParseVectorIndexType(it->second.c_str()) : VectorIndexType::FlatIndex;
+}
+
 static int init_vector_store(Args &args)
 {
     DEF_ExtraArgs(pipe_args, args);
     chatllm::Pipeline pipeline(args.embedding_model_path, pipe_args);
     args.max_length = pipeline.model->get_max_length();
-    DEF_MESSAGES_FROM_ARG(messages, args);
 
     DEF_GenerationConfig(gen_config, args);
     std::vector<float> r;
 
     CVectorStore vs(args.vc, pipeline.get_embedding_dim(),
-        [&pipeline, &gen_config, &r, &messages](const std::string &s, float *emb)
+        [&pipeline, &gen_config, &r](const std::vector<std::string> &texts, float *emb)
         {
-            pipeline.embedding(chatllm::Content(&messages, s), gen_config, r);
-            CHATLLM_CHECK((int)r.size() == pipeline.get_embedding_dim()) << "embedding dim mismatch";
-            memcpy(emb, r.data(), r.size() * sizeof(float));
+            // all texts are tokenized in parallel beforehand
+            std::vector<int> ids;
+            std::vector<size_t> offsets;
+            printf("tokenizing...\n");
+            pipeline.embedding_tokenize(texts, gen_config, ids, offsets);
+
+            // texts are embedded in chunks (sequences of a chunk are packed into batches by the model)
+            const size_t CHUNK_SIZE = 256;
+            const int emb_len = pipeline.get_embedding_dim();
+            printf("ingesting...\n");
+            for (size_t i = 0; i < texts.size(); i += CHUNK_SIZE)
+            {
+                const size_t n = std::min(CHUNK_SIZE, texts.size() - i);
+                std::vector<int> input_ids(ids.begin() + offsets[i], ids.begin() + offsets[i + n]);
+                std::vector<size_t> input_offsets;
+                for (size_t j = 0; j <= n; j++)
+                    input_offsets.push_back(offsets[i + j] - offsets[i]);
+
+                pipeline.embedding(input_ids, input_offsets, gen_config, r);
+                CHATLLM_CHECK(r.size() == n * emb_len) << "embedding dim mismatch";
+                memcpy(emb + i * emb_len, r.data(), r.size() * sizeof(float));
+                printf("%8zu / %8zu\r", i + n, texts.size());
+                fflush(stdout);
+            }
+            printf("\ndone\n");
         },
         args.vector_store_in.c_str());
+    vs.SetThreads(args.num_threads);
+    vs.SetIndex(get_vs_index_type(args), ParseANNParams(args.additional));
+    vs.SetQuantization(ParseQuantParams(args.additional));
     vs.ExportDB((args.vector_store_in + ".vsdb").c_str());
     printf("Vector store saved to: %s\n", (args.vector_store_in + ".vsdb").c_str());
     return 0;
@@ -1249,6 +1312,9 @@ static int merge_vector_store(Args &args)
         files.insert(files.end(), x.second.begin(), x.second.end());
     }
     CVectorStore vs(args.vc, files);
+    vs.SetThreads(args.num_threads);
+    vs.SetIndex(get_vs_index_type(args), ParseANNParams(args.additional));
+    vs.SetQuantization(ParseQuantParams(args.additional));
     vs.ExportDB(args.merge_vs.c_str());
     printf("Vector store saved to: %s\n", args.merge_vs.c_str());
     return 0;
@@ -1370,7 +1436,7 @@ int main(int argc, const char **argv)
             CHATLLM_CHECK(args.beam_size < 1) << "beam search is not supported for RAG";
 
             chatllm::RAGPipeline pipeline(args.model_path, pipe_args,
-                args.vc, args.vector_stores,
+                args.vc, args.vector_stores, args.vs_indices,
                 args.embedding_model_path, args.reranker_model_path);
             pipeline.hide_reference = args.hide_reference;
             pipeline.retrieve_top_n = args.retrieve_top_n;
@@ -1677,6 +1743,12 @@ static int start_chat(Chat *chat, Args &args, chatllm::Pipeline &pipeline)
     pipeline.set_additional_args(args.additional);
     chat->streamer->set_interceptor(&thought_interceptor);
 
+    if (args.draft_model_path.size() > 0)
+    {
+        DEF_ExtraArgs(pipe_args, args);
+        pipeline.load_draft_model(args.draft_model_path, pipe_args, args.draft_n);
+    }
+
     DEF_GenerationConfig(gen_config, args);
 
     chat->gen_config = gen_config;
@@ -1747,7 +1819,7 @@ int chatllm_start(struct chatllm_obj *obj, f_chatllm_print f_print, f_chatllm_en
             CHATLLM_CHECK(args.beam_size < 1) << "beam search is not supported for RAG";
 
             auto pipeline = new chatllm::RAGPipeline(args.model_path, pipe_args,
-                args.vc, args.vector_stores,
+                args.vc, args.vector_stores, args.vs_indices,
                 args.embedding_model_path, args.reranker_model_path);
             pipeline->hide_reference = args.hide_reference;
             pipeline->retrieve_top_n = args.retrieve_top_n;
@@ -1992,6 +2064,37 @@ int chatllm_async_embedding(struct chatllm_obj *obj, const char *utf8_str, int p
     ASYNC_FUN_BODY(chatllm_embedding(obj, utf8_str, purpose));
 }
 
+int chatllm_embedding_batch(struct chatllm_obj *obj, const char **utf8_strs, int num, int purpose,
+                            float *embeddings, int max_floats)
+{
+    DEF_CHAT();
+
+    if (!chat->pipeline->is_loaded() || (chat->pipeline->model->get_purpose() != chatllm::ModelPurpose::Emb) || (num < 0))
+        return -1;
+
+    const int emb_len = chat->pipeline->get_embedding_dim();
+    const int total = num * emb_len;
+    if ((nullptr == embeddings) || (max_floats < total))
+        return total;
+
+    std::vector<std::string> inputs;
+    for (int i = 0; i < num; i++)
+        inputs.emplace_back(utf8_strs[i]);
+
+    std::vector<int> ids;
+    std::vector<size_t> offsets;
+    chat->pipeline->embedding_tokenize(inputs, chat->gen_config, ids, offsets,
+                                       (chatllm::BaseTokenizer::EmbeddingPurpose)purpose);
+
+    std::vector<float> result;
+    chat->pipeline->embedding(ids, offsets, chat->gen_config, result);
+    if ((int)result.size() != total)
+        return -1;
+
+    memcpy(embeddings, result.data(), result.size() * sizeof(result[0]));
+    return total;
+}
+
 int chatllm_text_tokenize(struct chatllm_obj *obj, const char *utf8_str)
 {
     DEF_CHAT_STREAMER();
@@ -2016,6 +2119,39 @@ int chatllm_text_tokenize(struct chatllm_obj *obj, const char *utf8_str)
     return (int)result.size();
 }
 
+int chatllm_text_tokenize_batch(struct chatllm_obj *obj, const char **utf8_strs, int num, int purpose,
+                                int *ids, int max_ids, int *offsets)
+{
+    DEF_CHAT();
+
+    if (!chat->pipeline->is_loaded() || (num < 0))
+        return -1;
+
+    std::vector<std::string> inputs;
+    for (int i = 0; i < num; i++)
+        inputs.emplace_back(utf8_strs[i]);
+
+    std::vector<int> result;
+    std::vector<size_t> result_offsets;
+    if (purpose < 0)
+        chat->pipeline->text_tokenize(inputs, chat->gen_config, result, result_offsets);
+    else
+        chat->pipeline->embedding_tokenize(inputs, chat->gen_config, result, result_offsets,
+                                           (chatllm::BaseTokenizer::EmbeddingPurpose)purpose);
+
+    if (ids && ((int)result.size() <= max_ids))
+    {
+        memcpy(ids, result.data(), result.size() * sizeof(result[0]));
+        if (offsets)
+        {
+            for (int i = 0; i <= num; i++)
+                offsets[i] = (int)result_offsets[i];
+        }
+    }
+
+    return (int)result.size();
+}
+
 int chatllm_rag_select_store(struct chatllm_obj *obj, const char *name)
 {
     Chat *chat = reinterpret_cast<Chat *>(obj);
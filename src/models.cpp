@@ -663,31 +663,48 @@ namespace chatllm
             token_count[token_id]++;
     }
 
-    void LogitsPenalty::process(float *logits, const int vocab_size)
+    void LogitsPenalty::process(float *logits, const int vocab_size, const float logit_scale)
     {
         if (token_history.size() < 1) return;
+        if (!is_active()) return;
 
         if (vocab_size != (int)token_count.size())
         {
             token_count.resize(vocab_size);
+            visited.resize(vocab_size);
         }
 
-        for (int i = 0; i < vocab_size; i++)
+        // only tokens in the window are touched, each once
+        visit_epoch++;
+        const float scale = 1.0f / logit_scale;
+        for (const int id : token_history)
         {
+            if ((id < 0) || (id >= vocab_size) || (visited[id] == visit_epoch)) continue;
+            visited[id] = visit_epoch;
+
+            const int count = token_count[id];
+            if (count < 1) continue;
+
             if (repeat_penalty_en)
-            {
-                if (token_count[i] > 0)
-                    logits[i] *= logits[i] > 0 ? inv_repeat_penalty : repeat_penalty;
-            }
+                logits[id] *= logits[id] > 0 ? inv_repeat_penalty : repeat_penalty;
 
             if (freq_penalty_en)
-                logits[i] -= float(token_count[i]) * freq_penalty + float(token_count[i] > 0) * presence_penalty;
+                logits[id] -= (float(count) * freq_penalty + presence_penalty) * scale;
         }
     }
 
     class GreedySampler : public Sampler
     {
     public:
+        int get_candidate_num(void) const override { return 1; }
+
+        int sampling_candidates(const int *ids, float *scores, const int num, float *confidence_level) override
+        {
+            int r = (int)(std::max_element(scores, scores + num) - scores);
+            if (confidence_level) *confidence_level = 1.0f;
+            return ids[r];
+        }
+
         int sampling(float *logits, const int vocab_size, float *confidence_level) override
         {
             int r = (int)(std::max_element(logits, logits + vocab_size) - logits);
@@ -705,64 +722,52 @@ namespace chatllm
         }
     };
 
+    // The sampling chain: penalty -> top-k -> temperature -> softmax -> `do_sampling` (top-p, tfs, min-p) -> draw.
+    //
+    // Penalties are applied to tokens within the penalty window only, top-k is selected with a bounded heap
+    // in a single pass over logits, and candidates are kept in buffers reused across tokens.
+    // Temperature is applied after top-k (which does not change the order) and frequency/presence penalties
+    // are scaled accordingly, so results are the same as scaling all logits first.
     class NonGreedySampler: public Sampler
     {
     public:
         NonGreedySampler(const GenerationConfig &gen_config, float temperature, int top_k)
             : Sampler(gen_config),
-              inv_temp(0.0f), top_k(top_k)
+              inv_temp(1.0f), top_k(top_k)
         {
             temp_en = (fabs(temperature - 1.0f) > 1e-5f) && (fabs(temperature) > 1e-5f);
             if (temp_en) inv_temp = 1.f / temperature;
         }
 
-
         int sampling(float *logits, const int vocab_size, float *confidence_level) override
         {
-            if (temp_en)
-            {
-                for (int i = 0; i < vocab_size; i++)
-                    logits[i] *= inv_temp;
-            }
-
-            penalty.process(logits, vocab_size);
+            penalty.process(logits, vocab_size, inv_temp);
 
-            token_scores.resize(vocab_size);
-
-            for (int i = 0; i < vocab_size; i++)
+            if (0 < top_k && top_k < vocab_size)
+                select_top_k(logits, vocab_size);
+            else
             {
-                token_scores[i] = {.id = i, .score = logits[i]};
-            }
-
-            // top_k sampling
-            if (0 < top_k && top_k < (int)token_scores.size())
-            {
-                std::nth_element(token_scores.begin(), token_scores.begin() + top_k, token_scores.end(),
-                                std::greater<TokenIdScore>());
-                token_scores.resize(top_k);
+                token_scores.resize(vocab_size);
+                for (int i = 0; i < vocab_size; i++)
+                    token_scores[i] = {.id = i, .score = logits[i]};
             }
 
-            do_sampling(logits, vocab_size);
-
-            if (token_scores.size() < 1)
-                return ABORT;
-
-            // sample next token
-            std::vector<float> logits_candidates;
-            logits_candidates.resize(token_scores.size());
-            for (size_t i = 0; i < token_scores.size(); i++)
-            {
-                logits_candidates[i] = token_scores[i].score;
-            }
+            return sampling_token_scores(confidence_level);
+        }
 
-            std::discrete_distribution<> dist(logits_candidates.data(), logits_candidates.data() + token_scores.size());
-            auto pos = dist(gen);
-            int next_token_id = token_scores[pos].id;
+        // penalties may lift any token into the top-k, so candidates are only enough without them
+        int get_candidate_num(void) const override
+        {
+            return (0 < top_k) && !penalty.is_active() ? top_k : -1;
+        }
 
-            penalty.accept_choice(next_token_id);
-            if (confidence_level) *confidence_level = token_scores[pos].score;
+        int sampling_candidates(const int *ids, float *scores, const int num, float *confidence_level) override
+        {
+            token_scores.resize(num);
+            for (int i = 0; i < num; i++)
+                token_scores[i] = {.id = ids[i], .score = scores[i]};
 
-            return next_token_id;
+            return sampling_token_scores(confidence_level);
         }
 
     protected:
@@ -775,13 +780,37 @@ namespace chatllm
             bool operator>(const TokenIdScore &other) const { return score > other.score; }
         };
 
-        void sampling_softmax_inplace(TokenIdScore *first, TokenIdScore *last)
+        // keeps a min-heap of the best `top_k` so far: most logits are rejected by a single comparison
+        void select_top_k(const float *logits, const int vocab_size)
         {
-            float max_score = std::max_element(first, last)->score;
+            token_scores.resize(top_k);
+            for (int i = 0; i < top_k; i++)
+                token_scores[i] = {.id = i, .score = logits[i]};
+            std::make_heap(token_scores.begin(), token_scores.end(), std::greater<TokenIdScore>());
+
+            float threshold = token_scores.front().score;
+            for (int i = top_k; i < vocab_size; i++)
+            {
+                if (logits[i] <= threshold) continue;
+
+                std::pop_heap(token_scores.begin(), token_scores.end(), std::greater<TokenIdScore>());
+                token_scores.back() = {.id = i, .score = logits[i]};
+                std::push_heap(token_scores.begin(), token_scores.end(), std::greater<TokenIdScore>());
+                threshold = token_scores.front().score;
+            }
+        }
+
+        // scores (logits) -> probabilities
+        void sampling_softmax_inplace(TokenIdScore *first, TokenIdScore *last, const float scale = 1.0f)
+        {
+            float max_score = -INFINITY;
+            for (TokenIdScore *p = first; p != last; p++)
+                max_score = std::max(max_score, p->score);
+
             float sum = 0.f;
             for (TokenIdScore *p = first; p != last; p++)
             {
-                float s = std::exp(p->score - max_score);
+                float s = expf((p->score - max_score) * scale);
                 p->score = s;
                 sum += s;
             }
@@ -792,7 +821,66 @@ namespace chatllm
             }
         }
 
-        virtual void do_sampling(float *logits, const int vocab_size) = 0;
+        // sorts (descending) only as many leading candidates as needed to accumulate `mass`,
+        // and returns the number of candidates accumulated.
+        size_t sort_until_mass(const float mass)
+        {
+            const size_t n = token_scores.size();
+            size_t sorted = 0;
+            float cumsum = 0.f;
+            while (sorted < n)
+            {
+                const size_t next = std::min(n, std::max(sorted * 2, sorted + 64));
+                if (next < n)
+                    std::nth_element(token_scores.begin() + sorted, token_scores.begin() + next, token_scores.end(),
+                                     std::greater<TokenIdScore>());
+                std::sort(token_scores.begin() + sorted, token_scores.begin() + next, std::greater<TokenIdScore>());
+
+                for (; sorted < next; sorted++)
+                {
+                    cumsum += token_scores[sorted].score;
+                    if (cumsum >= mass)
+                        return sorted + 1;
+                }
+            }
+            return n;
+        }
+
+        int sampling_token_scores(float *confidence_level)
+        {
+            if (token_scores.size() < 1)
+                return ABORT;
+
+            sampling_softmax_inplace(token_scores.data(), token_scores.data() + token_scores.size(), inv_temp);
+
+            do_sampling();
+
+            if (token_scores.size() < 1)
+                return ABORT;
+
+            // draw from (unnormalized) probabilities
+            float sum = 0.f;
+            for (const auto &t : token_scores)
+                sum += t.score;
+
+            std::uniform_real_distribution<float> dist(0.0f, sum);
+            const float r = dist(gen);
+            size_t pos = 0;
+            float cumsum = token_scores[0].score;
+            while ((cumsum < r) && (pos + 1 < token_scores.size()))
+                cumsum += token_scores[++pos].score;
+
+            int next_token_id = token_scores[pos].id;
+
+            penalty.accept_choice(next_token_id);
+            if (confidence_level) *confidence_level = token_scores[pos].score / sum;
+
+            return next_token_id;
+        }
+
+        // `token_scores` holds probabilities (normalized). Candidates can be removed or reordered.
+        virtual void do_sampling(void) = 0;
+
         bool temp_en;
         float inv_temp;
         int top_k;
@@ -807,37 +895,41 @@ namespace chatllm
         {}
 
     protected:
-        void do_sampling(float *next_token_logits, const int vocab_size) override
+        void do_sampling(void) override
         {
-            // top_p sampling
             if (0.f < top_p && top_p < 1.f)
-            {
-                std::sort(token_scores.begin(), token_scores.end(), std::greater<TokenIdScore>()); // hot code!
-                sampling_softmax_inplace(token_scores.data(), token_scores.data() + token_scores.size());
+                token_scores.resize(sort_until_mass(top_p));
+        }
 
-                float cumsum = 0.f;
-                for (size_t i = 0; i < token_scores.size(); i++)
-                {
-                    cumsum += token_scores[i].score;
-                    if (cumsum >= top_p)
-                    {
-                        token_scores.resize(i + 1);
-                        break;
-                    }
-                }
-            }
+    protected:
+        const float top_p;
+    };
 
-            sampling_softmax_inplace(token_scores.data(), token_scores.data() + token_scores.size());
+    // keeps candidates with probability >= min_p * (max probability)
+    class MinPSampler : public NonGreedySampler
+    {
+    public:
+        MinPSampler(const GenerationConfig &gen_config, float temperature, int top_k, float min_p)
+            : NonGreedySampler(gen_config, temperature, top_k), min_p(min_p)
+        {}
 
-            // write back final scores
-            for (size_t i = 0; i < token_scores.size(); i++)
-            {
-                next_token_logits[token_scores[i].id] = token_scores[i].score;
-            }
+    protected:
+        void do_sampling(void) override
+        {
+            if (min_p <= 0.f) return;
+
+            float max_p = 0.f;
+            for (const auto &t : token_scores)
+                max_p = std::max(max_p, t.score);
+
+            const float threshold = max_p * min_p;
+            auto last = std::remove_if(token_scores.begin(), token_scores.end(),
+                                       [threshold](const TokenIdScore &t) { return t.score < threshold; });
+            token_scores.erase(last, token_scores.end());
         }
 
     protected:
-        const float top_p;
+        const float min_p;
     };
 
     // Reference:
@@ -851,12 +943,12 @@ namespace chatllm
 
     protected:
 
-        void do_sampling(float *next_token_logits, const int vocab_size) override
+        void do_sampling(void) override
         {
             if (token_scores.size() < 3) return;
 
-            sampling_softmax_inplace(token_scores.data(), token_scores.data() + token_scores.size());
-            std::sort(token_scores.begin(), token_scores.end(), std::greater<TokenIdScore>()); // hot code!
+            // the whole tail contributes to the normalization of the second derivatives
+            std::sort(token_scores.begin(), token_scores.end(), std::greater<TokenIdScore>());
 
             snd_d.resize(token_scores.size() - 2);
             for (size_t i = 0; i < snd_d.size(); i++)
@@ -893,6 +985,46 @@ namespace chatllm
         std::vector<float> snd_d;
     };
 
+    // prompt lookup: drafts tokens by matching the trailing n-gram against earlier context,
+    // which works well when outputs repeat spans of inputs (RAG, code editing, etc).
+    class PromptLookupDrafter : public TokenDrafter
+    {
+    public:
+        PromptLookupDrafter(int max_ngram) : max_ngram(max_ngram > 0 ? max_ngram : 1) {}
+
+        void begin(const std::vector<int> &input_ids, const GenerationConfig &gen_config, bool continuous, int n_past) override
+        {
+            if (!continuous) history.clear();
+            history.insert(history.end(), input_ids.begin(), input_ids.end());
+        }
+
+        void draft(const std::vector<int> &accepted, int max_n, std::vector<int> &drafted) override
+        {
+            drafted.clear();
+            history.insert(history.end(), accepted.begin(), accepted.end());
+
+            const int len = (int)history.size();
+            for (int n = std::min(max_ngram, len - 1); n >= 1; n--)
+            {
+                const int *pattern = history.data() + len - n;
+
+                // the latest occurrence, which must be followed by at least one token
+                for (int i = len - n - 1; i >= 0; i--)
+                {
+                    if (memcmp(history.data() + i, pattern, n * sizeof(int)) != 0) continue;
+
+                    for (int j = i + n; (j < len) && ((int)drafted.size() < max_n); j++)
+                        drafted.push_back(history[j]);
+                    return;
+                }
+            }
+        }
+
+    protected:
+        const int max_ngram;
+        std::vector<int> history;
+    };
+
     Sampler *SamplerFactory::Create(const GenerationConfig &gen_config)
     {
         Sampler *r = nullptr;
@@ -902,6 +1034,8 @@ namespace chatllm
                 r = new TopPSampler(gen_config, gen_config.temperature, gen_config.top_k, gen_config.top_p);
             else if (gen_config.sampling == "tfs")
                 r = new FreeTailSampler(gen_config, gen_config.temperature, gen_config.top_k, gen_config.tfs_z);
+            else if (gen_config.sampling == "min_p")
+                r = new MinPSampler(gen_config, gen_config.temperature, gen_config.top_k, gen_config.min_p);
             else if (gen_config.sampling != "greedy")
                 CHATLLM_CHECK(false) << "unknown sampling algorithm: " << gen_config.sampling;
         }
@@ -913,6 +1047,53 @@ namespace chatllm
         return r;
     }
 
+    BatchSampler::BatchSampler(int n_threads)
+        : n_threads(1)
+    {
+        set_threads(n_threads);
+    }
+
+    void BatchSampler::set_threads(int n)
+    {
+        n_threads = n > 0 ? n : 1;
+    }
+
+    void BatchSampler::resize(int rows)
+    {
+        samplers.resize(rows);
+    }
+
+    void BatchSampler::set(int row, std::unique_ptr<Sampler> sampler)
+    {
+        CHATLLM_CHECK((0 <= row) && (row < get_rows())) << "invalid sampler row: " << row;
+        samplers[row] = std::move(sampler);
+    }
+
+    void BatchSampler::release(int row)
+    {
+        if ((0 <= row) && (row < get_rows()))
+            samplers[row].reset();
+    }
+
+    void BatchSampler::sampling(float *logits, const int vocab_size, const int *rows, const int num, int *next_ids)
+    {
+        // rows are independent: each sampler only touches its own logits row, penalty state & RNG
+        auto sample_row = [=, this](int64_t k) {
+            Sampler *sampler = samplers[rows[k]].get();
+            next_ids[k] = sampler ? sampler->sampling(logits + (size_t)k * vocab_size, vocab_size) : Sampler::ABORT;
+        };
+
+        const int threads = std::min(n_threads, num);
+        if (threads <= 1)
+        {
+            for (int k = 0; k < num; k++)
+                sample_row(k);
+            return;
+        }
+
+        utils::parallel_for(0, num, sample_row, threads);
+    }
+
     BaseModelForConditionalGeneration::BaseModelForConditionalGeneration(ModelType model_type, BaseConfig config, const RuntimeConfig &runtime_config, size_t GRAPH_SIZE)
         : BaseModel(model_type, get_model_purpose(model_type)),
             transformer(nullptr),
@@ -922,6 +1103,22 @@ namespace chatllm
             config_(config)
     {
         w_ctx_.cache_dtype = runtime_config.cache_type;
+        batch_sampler.reset(new BatchSampler(runtime_config.n_threads));
+        device_sampling = utils::get_opt(runtime_config.additional, "device_sampling", true);
+        prefill_budget = (size_t)utils::get_opt(runtime_config.additional, "prefill_budget_mb", 0) * 1024 * 1024;
+        embedding_batch_tokens = utils::get_opt(runtime_config.additional, "embedding_batch_tokens", embedding_batch_tokens);
+        w_ctx_.v_cache_dtype = (ggml::type)ggml::str_to_type(utils::get_opt(runtime_config.additional, "v_cache_dtype", ""), ggml::type::GGML_TYPE_F16);
+        graph_reuse_padding = utils::get_opt(runtime_config.additional, "graph_reuse", 0);
+        if (graph_reuse_padding < 0) graph_reuse_padding = 0;
+        prompt_lookup_tokens = utils::get_opt(runtime_config.additional, "prompt_lookup", 0);
+        if (prompt_lookup_tokens > 0)
+            prompt_lookup.reset(new PromptLookupDrafter(utils::get_opt(runtime_config.additional, "prompt_lookup_ngram", 3)));
+        const int kv_page_size = utils::get_opt(runtime_config.additional, "kv_page_size", 0);
+        if ((kv_page_size > 0) && (config.max_length >= kv_page_size))
+        {
+            kv_pages.reset(new KVPageTable(kv_page_size, config.max_length / kv_page_size));
+            w_ctx_.kv_pages = kv_pages.get();
+        }
         prepare(runtime_config);
         for (int i = 0; i < config.num_hidden_layers; i++)
             layer_ids.push_back(i);
@@ -930,6 +1127,7 @@ namespace chatllm
     void BaseModelForConditionalGeneration::set_layer_ids(const std::vector<int> &ids)
     {
         CHATLLM_CHECK((int)ids.size() == config_.num_hidden_layers) << "length(layer_ids) must be " << config_.num_hidden_layers;
+        drop_cached_graph();
         layer_ids.clear();
         for (auto x : ids)
             layer_ids.push_back(x);
@@ -944,7 +1142,11 @@ namespace chatllm
     {
         if (keep >= n_past) return;
 
+        // the shift is done by the next graph, so it must be built
+        drop_cached_graph();
         transformer->shift_cache(n_past - keep, n_past);
+        if (kv_pages)
+            kv_pages_shift_len = std::max(kv_pages_shift_len, n_past);
         BaseModel::shift_memory(keep);
     }
 
@@ -969,6 +1171,13 @@ namespace chatllm
 
         std::unique_ptr<Sampler> sampler = std::unique_ptr<Sampler>(SamplerFactory::Create(gen_config));
 
+        // narrow logits down to sampling candidates within the graph.
+        // a row of candidates (ids & logits) must be shorter than a row of logits, so that the two can be told apart:
+        // models that override `generate_next_token` or `run_model` may skip the epilog and return full logits.
+        const int candidate_num = device_sampling ? sampler->get_candidate_num() : -1;
+        logits_candidates = (0 < candidate_num) && (2 * candidate_num < config_.vocab_size) ? candidate_num : 0;
+        std::vector<int> candidate_ids(logits_candidates);
+
         aborted = false;
 
         std::vector<int> curr_input_ids(input_ids);
@@ -1001,6 +1210,18 @@ namespace chatllm
 
         before_generate(gen_config);
 
+        // speculative decoding needs logits of all drafted tokens.
+        // a draft model (if attached) takes precedence over prompt lookup.
+        TokenDrafter *active_drafter = drafter ? drafter : prompt_lookup.get();
+        const int max_drafted = drafter ? max_draft_tokens : prompt_lookup_tokens;
+        LMFinalSteps *final_steps = dynamic_cast<LMFinalSteps *>(transformer->get_final_steps());
+        // rejected drafts are discarded by rewinding `n_past`
+        const bool speculative = active_drafter && (max_drafted > 0) && final_steps && (final_steps->get_read_last_n() == 1) && is_rewindable();
+        std::vector<int> drafted;
+        size_t drafter_output_idx = 0;
+        if (speculative)
+            active_drafter->begin(input_ids, gen_config, continuous, n_past);
+
         #if (0)
         for (auto i : curr_input_ids)
             printf("%d, ", i);
@@ -1011,7 +1232,34 @@ namespace chatllm
         {
             std::vector<float> lm_logits;
             const int last_n_past = n_past;
-            if (!generate_next_token(curr_input_ids, gen_config, lm_logits))
+
+            drafted.clear();
+            if (speculative && !first_call && (curr_input_ids.size() == 1))
+            {
+                int max_n = max_drafted;
+                if (batch_input > 1)
+                    max_n = std::min(max_n, batch_input - 1);
+                max_n = std::min(max_n, gen_config.max_length - 1 - (n_past + 1));
+                if (gen_max_tokens > 0)
+                    max_n = std::min(max_n, gen_max_tokens - (n_past + 1));
+
+                if (max_n > 0)
+                {
+                    active_drafter->draft(std::vector<int>(output_ids.begin() + drafter_output_idx, output_ids.end()), max_n, drafted);
+                    drafter_output_idx = output_ids.size();
+                    if ((int)drafted.size() > max_n)
+                        drafted.resize(max_n);
+                }
+
+                curr_input_ids.insert(curr_input_ids.end(), drafted.begin(), drafted.end());
+                final_steps->set_read_last_n((int)curr_input_ids.size());
+            }
+
+            const bool r = generate_next_token(curr_input_ids, gen_config, lm_logits);
+            if (speculative)
+                final_steps->set_read_last_n(1);
+
+            if (!r)
             {
                 ggml::log(GGML_LOG_LEVEL_ERROR, "Out of memory");
                 aborted = true;
@@ -1035,15 +1283,28 @@ namespace chatllm
 
 //#define DISABLE_CACHE
 #ifndef DISABLE_CACHE
-            n_past += (int)curr_input_ids.size();
+            // drafted tokens are counted once accepted
+            n_past += (int)(curr_input_ids.size() - drafted.size());
             curr_input_ids.clear();
 #endif
+            // candidates are read back only if the epilog has been applied to all rows
+            const bool as_candidates = (logits_candidates > 0) && (lm_logits.size() == (drafted.size() + 1) * 2 * logits_candidates);
+            const int logits_row_size = as_candidates ? 2 * logits_candidates : config_.vocab_size;
             float *logits = lm_logits.data();
-            const size_t tok_num = lm_logits.size() / config_.vocab_size;
+            const size_t tok_num = lm_logits.size() / logits_row_size;
+            size_t accepted = 0;
 
-            for (size_t tok_idx = 0; (tok_idx < tok_num) && !aborted; tok_idx++, logits +=  config_.vocab_size)
+            for (size_t tok_idx = 0; (tok_idx < tok_num) && !aborted; tok_idx++, logits += logits_row_size)
             {
-                int next_token_id = sampler->sampling(logits,  config_.vocab_size);
+                int next_token_id = Sampler::ABORT;
+                if (as_candidates)
+                {
+                    for (int i = 0; i < logits_candidates; i++)
+                        candidate_ids[i] = (int)logits[i];
+                    next_token_id = sampler->sampling_candidates(candidate_ids.data(), logits + logits_candidates, logits_candidates);
+                }
+                else
+                    next_token_id = sampler->sampling(logits,  config_.vocab_size);
 
 //printf("\n>>next = %d<<\n", next_token_id);
 //fflush(stdout);
@@ -1082,7 +1343,22 @@ namespace chatllm
                     aborted = true;
                     break;
                 }
+
+                if (tok_idx < drafted.size())
+                {
+                    // logits of following rows are conditioned on this draft: only valid if accepted
+                    if ((next_token_id != drafted[tok_idx]) || completed)
+                        break;
+
+                    // accepted, and it has been evaluated already
+                    curr_input_ids.pop_back();
+                    n_past++;
+                    accepted++;
+                }
             }
+
+            if (performance && (drafted.size() > 0))
+                performance->AccumulateDrafts(drafted.size(), accepted);
         }
 
         if (aborted && !completed)
@@ -1094,6 +1370,8 @@ namespace chatllm
             performance->Accumulate(ModelPerfInfo::Type::Generation, num);
         }
 
+        logits_candidates = 0;
+
         after_generate();
 
 //printf("\nn_past = %d\n", n_past);
@@ -1108,6 +1386,26 @@ namespace chatllm
         if (!r) ggml::log(GGML_LOG_LEVEL_ERROR, "Out of memory");
     }
 
+    void BaseModelForConditionalGeneration::embedding_batch(const GenerationConfig &gen_config, const std::vector<int> &input_ids, const std::vector<size_t> &offsets,
+                                std::vector<float> &embeddings)
+    {
+        std::vector<float> output;
+
+        embeddings.clear();
+        before_generate(gen_config);
+        for (size_t i = 0; i + 1 < offsets.size(); i++)
+        {
+            auto r = run_model(input_ids.data() + offsets[i], (int)(offsets[i + 1] - offsets[i]), gen_config, 0, output);
+            if (!r)
+            {
+                ggml::log(GGML_LOG_LEVEL_ERROR, "Out of memory");
+                embeddings.clear();
+                return;
+            }
+            embeddings.insert(embeddings.end(), output.begin(), output.end());
+        }
+    }
+
     float BaseModelForConditionalGeneration::qa_rank(const GenerationConfig &gen_config, const std::vector<int> &input_ids)
     {
         std::vector<float> output;
@@ -1120,6 +1418,17 @@ namespace chatllm
         return output[0];
     }
 
+    void BaseModelForConditionalGeneration::qa_rank_batch(const GenerationConfig &gen_config, const std::vector<int> &input_ids, const std::vector<size_t> &offsets,
+                                std::vector<float> &scores)
+    {
+        scores.clear();
+        for (size_t i = 0; i + 1 < offsets.size(); i++)
+        {
+            std::vector<int> ids(input_ids.begin() + offsets[i], input_ids.begin() + offsets[i + 1]);
+            scores.push_back(qa_rank(gen_config, ids));
+        }
+    }
+
     bool BaseModelForConditionalGeneration::generate_next_token(const std::vector<int> &input_ids, const GenerationConfig &gen_config, std::vector<float> &lm_logits)
     {
         int batch = batch_input > 1 ? batch_input : 1;
@@ -1128,13 +1437,20 @@ namespace chatllm
         int remain = (int)input_ids.size();
         int past = n_past + n_past_offset;
 
+        std::function<ggml::tensor *(ComputeContext *, ggml::tensor *)> epilog = nullptr;
+        if (logits_candidates > 0)
+            epilog = [this](ComputeContext *ctx, ggml::tensor *logits) { return logits_to_candidates(ctx, logits); };
+
         for (; (remain > batch) && !aborted; p += batch, remain -= batch, past += batch)
         {
-            if (!run_model(p, batch, gen_config, past, lm_logits, 1))
+            if (!run_model(p, batch, gen_config, past, lm_logits, 1, epilog))
                 return false;
         }
 
-        return run_model(p, remain, gen_config,past, lm_logits, 1);
+        decode_step = remain == 1;
+        bool r = run_model(p, remain, gen_config,past, lm_logits, 1, epilog);
+        decode_step = false;
+        return r;
     }
 
     int BaseModelForConditionalGeneration::save_session(FILE *f) const
@@ -1149,6 +1465,8 @@ namespace chatllm
     {
         int r = BaseModel::load_session(f);
         if (r != 0) return r;
+        r = reserve_session_pages();
+        if (r != 0) return r;
         return transformer->load_session(f);
     }
 
@@ -1164,12 +1482,26 @@ namespace chatllm
     {
         int r = BaseModel::load_session(session);
         if (r != 0) return r;
+        r = reserve_session_pages();
+        if (r != 0) return r;
         return transformer->load_session(session);
     }
 
+    int BaseModelForConditionalGeneration::reserve_session_pages(void)
+    {
+        if (!kv_pages) return 0;
+
+        // sessions hold the cache of slot 0 in logical order
+        drop_cached_graph();
+        kv_pages_shift_len = 0;
+        kv_pages->release_all();
+        return kv_pages->reserve(0, 1, n_past) ? 0 : -1;
+    }
+
     void BaseModelForConditionalGeneration::prepare(const RuntimeConfig &rt_config)
     {
         w_ctx_.user_options.moe_on_cpu = rt_config.moe_on_cpu;
+        w_ctx_.user_options.flash_attn = utils::get_opt(rt_config.additional, "flash_attn", false);
         backend_context.init(rt_config.model_gpu_layers, "main", config_.num_hidden_layers, GRAPH_SIZE, rt_config.n_threads);
     }
 
@@ -1183,6 +1515,301 @@ namespace chatllm
         transformer->load("model.", &loader, layer_ids);
     }
 
+    void BaseModelForConditionalGeneration::set_drafter(TokenDrafter *drafter, int max_draft_tokens)
+    {
+        this->drafter = drafter;
+        this->max_draft_tokens = drafter ? max_draft_tokens : 0;
+    }
+
+    int BaseModelForConditionalGeneration::reserve_kv_slots(int num)
+    {
+        CHATLLM_CHECK(!initial_run) << "KV slots must be reserved before the first run";
+
+        if (num < 1) num = 1;
+        if (num > config_.max_length) num = config_.max_length;
+
+        transformer->reserve_batch_size(num);
+
+        // rows of a decoding batch at different positions read K/V beyond their own lengths (masked out):
+        // make sure these are finite numbers. all pages are handed to slot 0 for a moment, so that all get cleared.
+        if (num > 1)
+        {
+            if (kv_pages) kv_pages->reserve(0, 1, kv_pages->get_pool_length());
+            transformer->clear_cache();
+            if (kv_pages) kv_pages->release_all();
+        }
+
+        sequence_slots.resize(num);
+        batch_sampler->resize(num);
+        return num;
+    }
+
+    int BaseModelForConditionalGeneration::add_sequence(const std::vector<int> &input_ids, const GenerationConfig &gen_config, BaseStreamer *streamer)
+    {
+        CHATLLM_CHECK(input_ids.size() > 0) << "empty input";
+
+        auto seq = std::make_unique<BatchedSequence>();
+        seq->id                 = next_sequence_id++;
+        seq->slot               = -1;
+        seq->n_past             = 0;
+        seq->next_output_idx    = 0;
+        seq->prefilled          = false;
+        seq->completed          = false;
+        seq->pending_ids        = input_ids;
+        seq->gen_config         = gen_config;
+        seq->sampler.reset(SamplerFactory::Create(gen_config));
+        seq->streamer           = streamer;
+
+        if ((auto_output_prefix.size() > 0) && streamer)
+            streamer->put(auto_output_prefix);
+
+        waiting_sequences.push_back(std::move(seq));
+        return waiting_sequences.back()->id;
+    }
+
+    void BaseModelForConditionalGeneration::abort_sequence(int id)
+    {
+        for (auto &seq : waiting_sequences)
+            if (seq->id == id) seq->completed = true;
+        for (auto &seq : sequence_slots)
+            if (seq && (seq->id == id)) seq->completed = true;
+    }
+
+    int BaseModelForConditionalGeneration::step_sequences(ModelPerfInfo *performance)
+    {
+        if (sequence_slots.size() < 1)
+        {
+            sequence_slots.resize(transformer->get_reserved_batch_size());
+            batch_sampler->resize((int)sequence_slots.size());
+        }
+
+        const int slot_num = (int)sequence_slots.size();
+        std::vector<float> lm_logits;
+        std::vector<int> ids;
+
+        // logits of all decoding slots are gathered into one block, and sampled in one pass
+        std::vector<float> batch_logits;
+        std::vector<int> batch_rows;
+        std::vector<int> next_ids;
+
+        // decode: runs of adjacent slots are packed into one batched call. rows at different positions are packed
+        // together if the model handles per-row positions (RoPE, causal mask), otherwise only the ones sharing the same `n_past`.
+        for (int i = 0; i < slot_num; )
+        {
+            auto is_decoding = [this](int slot) {
+                auto &seq = sequence_slots[slot];
+                return seq && seq->prefilled && !seq->completed;
+            };
+
+            if (!is_decoding(i))
+            {
+                i++;
+                continue;
+            }
+
+            const int past = sequence_slots[i]->n_past;
+            int j = i + 1;
+            while ((j < slot_num) && is_decoding(j) && (row_positions_supported || (sequence_slots[j]->n_past == past)))
+                j++;
+
+            ids.clear();
+            row_past.clear();
+            int max_past = past;
+            bool mixed = false;
+            for (int k = i; k < j; k++)
+            {
+                ids.push_back(sequence_slots[k]->pending_ids[0]);
+                row_past.push_back(sequence_slots[k]->n_past);
+                max_past = std::max(max_past, sequence_slots[k]->n_past);
+                mixed = mixed || (sequence_slots[k]->n_past != past);
+            }
+            if (!mixed) row_past.clear();
+
+            kv_slot = i;
+            kv_slot_rows = true;
+            decode_step = true;
+            const bool r = run_model(ids.data(), 1, sequence_slots[i]->gen_config, max_past, lm_logits, j - i);
+            decode_step = false;
+            kv_slot_rows = false;
+            kv_slot = 0;
+            row_past.clear();
+
+            // the model turned out to be unaware of per-row positions: decode these again, grouped by `n_past`
+            if (!r && mixed && !row_positions_supported)
+                continue;
+
+            if (!r) ggml::log(GGML_LOG_LEVEL_ERROR, "Out of memory");
+
+            for (int k = i; k < j; k++)
+            {
+                auto &seq = sequence_slots[k];
+                if (!r)
+                {
+                    seq->completed = true;
+                    continue;
+                }
+                seq->n_past++;
+                seq->pending_ids.clear();
+                batch_rows.push_back(k);
+            }
+
+            if (r)
+                batch_logits.insert(batch_logits.end(), lm_logits.begin(), lm_logits.begin() + (size_t)(j - i) * config_.vocab_size);
+
+            i = j;
+        }
+
+        next_ids.resize(batch_rows.size());
+        batch_sampler->sampling(batch_logits.data(), config_.vocab_size, batch_rows.data(), (int)batch_rows.size(), next_ids.data());
+        for (size_t k = 0; k < batch_rows.size(); k++)
+        {
+            auto &seq = sequence_slots[batch_rows[k]];
+            if (accept_sequence_token(*seq, next_ids[k], performance))
+                seq->completed = true;
+        }
+
+        for (int i = 0; i < slot_num; i++)
+        {
+            if (sequence_slots[i] && sequence_slots[i]->completed)
+                retire_sequence(i);
+        }
+
+        for (size_t i = 0; i < waiting_sequences.size(); )
+        {
+            if (!waiting_sequences[i]->completed)
+            {
+                i++;
+                continue;
+            }
+            if (waiting_sequences[i]->streamer)
+                waiting_sequences[i]->streamer->end();
+            waiting_sequences.erase(waiting_sequences.begin() + i);
+        }
+
+        // admit queued sequences into free slots & prefill them
+        for (int i = 0; (i < slot_num) && (waiting_sequences.size() > 0); i++)
+        {
+            if (sequence_slots[i]) continue;
+
+            sequence_slots[i] = std::move(waiting_sequences.front());
+            waiting_sequences.erase(waiting_sequences.begin());
+
+            auto &seq = sequence_slots[i];
+            seq->slot = i;
+            batch_sampler->set(i, std::move(seq->sampler));
+
+            const size_t prompt_len = seq->pending_ids.size();
+            if (performance)
+                performance->Reset();
+
+            if (!prefill_sequence(*seq, lm_logits))
+            {
+                ggml::log(GGML_LOG_LEVEL_ERROR, "Out of memory");
+                retire_sequence(i);
+                continue;
+            }
+
+            if (performance)
+                performance->Accumulate(ModelPerfInfo::Type::Prompt, prompt_len);
+
+            int next_token_id = Sampler::ABORT;
+            batch_sampler->sampling(lm_logits.data(), config_.vocab_size, &i, 1, &next_token_id);
+            if (accept_sequence_token(*seq, next_token_id, performance))
+                retire_sequence(i);
+        }
+
+        int alive = (int)waiting_sequences.size();
+        for (auto &seq : sequence_slots)
+            if (seq) alive++;
+        return alive;
+    }
+
+    bool BaseModelForConditionalGeneration::prefill_sequence(BatchedSequence &seq, std::vector<float> &lm_logits)
+    {
+        const int batch = batch_input > 1 ? batch_input : 1;
+
+        transformer->set_ctx((int)seq.pending_ids.size());
+        before_generate(seq.gen_config);
+
+        const int *p = seq.pending_ids.data();
+        int remain = (int)seq.pending_ids.size();
+        bool r = true;
+
+        kv_slot = seq.slot;
+        kv_slot_rows = true;
+
+        for (; r && (remain > batch); p += batch, remain -= batch, seq.n_past += batch)
+            r = run_model(p, batch, seq.gen_config, seq.n_past, lm_logits, 1);
+
+        if (r)
+        {
+            r = run_model(p, remain, seq.gen_config, seq.n_past, lm_logits, 1);
+            seq.n_past += remain;
+        }
+
+        kv_slot = 0;
+        kv_slot_rows = false;
+
+        seq.pending_ids.clear();
+        seq.prefilled = true;
+        return r;
+    }
+
+    bool BaseModelForConditionalGeneration::accept_sequence_token(BatchedSequence &seq, int next_token_id, ModelPerfInfo *performance)
+    {
+        // pages are shared by all slots, so a sequence may grow until the pool runs out (then `run_model` fails);
+        // without paging, each slot owns an equal share of the cache.
+        const int slot_length = kv_pages ? config_.max_length : config_.max_length / (int)sequence_slots.size();
+
+        if (performance)
+            performance->Accumulate(ModelPerfInfo::Type::Generation, 1);
+
+        if (next_token_id == Sampler::ABORT)
+            return true;
+
+        bool finished = false;
+        int pop_output = 0;
+        int keep_idx = 0;
+
+        seq.pending_ids.push_back(next_token_id);
+        seq.output_ids.push_back(next_token_id);
+
+        if (is_output_terminated(seq.output_ids, keep_idx, pop_output))
+        {
+            while (pop_output-- > 0)
+                seq.output_ids.pop_back();
+            keep_idx = (int)seq.output_ids.size();
+            finished = true;
+        }
+
+        if (seq.streamer)
+        {
+            if (keep_idx > (int)seq.output_ids.size())
+                keep_idx = (int)seq.output_ids.size();
+            for (; seq.next_output_idx < keep_idx; seq.next_output_idx++)
+                seq.streamer->put({seq.output_ids[seq.next_output_idx]});
+        }
+
+        if ((seq.gen_config.max_new_tokens > 0) && ((int)seq.output_ids.size() >= seq.gen_config.max_new_tokens))
+            finished = true;
+
+        if ((seq.n_past + 1 >= slot_length) || (seq.n_past + 1 >= seq.gen_config.max_length))
+            finished = true;
+
+        return finished;
+    }
+
+    void BaseModelForConditionalGeneration::retire_sequence(int slot)
+    {
+        auto &seq = sequence_slots[slot];
+        if (seq->streamer)
+            seq->streamer->end();
+        seq.reset();
+        batch_sampler->release(slot);
+        if (kv_pages)
+            kv_pages->release(slot);
+    }
+
     void BaseModelForConditionalGeneration::before_generate(const GenerationConfig &gen_config)
     {}
 
@@ -1205,11 +1832,26 @@ namespace chatllm
         //printf("before_initial_run 1\n");
         //backend_context.show_buffer_sizes();
 
+        ForwardContext ctx(&backend_context);
+        build_initial_graph(ctx, ids_count, gen_config, past);
+
+        bool s = ctx.reserve_memory();
+
+        //printf("before_initial_run 2\n");
+        //backend_context.show_buffer_sizes();
+
+        return s;
+    }
+
+    void BaseModelForConditionalGeneration::build_initial_graph(ForwardContext &ctx, const int ids_count,
+                                    const GenerationConfig &gen_config,
+                                    int past)
+    {
         before_run_model(nullptr, ids_count, gen_config, past);
 
-        ForwardContext ctx(&backend_context);
         ctx.gctx = GGMLContext({.mem_size = backend_context.buf_compute_meta.size(), .mem_buffer = backend_context.buf_compute_meta.data(), .no_alloc = true});
         ctx.gf = ggml::new_graph_custom(&ctx, GRAPH_SIZE, false);
+        ctx.user_options = w_ctx_.user_options;
 
         ggml::tensor *input_ids_tensor = ggml::new_tensor_1d(&ctx, GGML_TYPE_I32, ids_count);
 
@@ -1219,13 +1861,36 @@ namespace chatllm
             r = ggml::scale(&ctx, r, logit_scale);
 
         ggml::build_forward_expand(&ctx, r);
+    }
 
-        bool s = ctx.reserve_memory();
+    int BaseModelForConditionalGeneration::fit_prefill_chunk(const GenerationConfig &gen_config)
+    {
+        const int max_length = gen_config.max_length / transformer->get_reserved_batch_size();
+        int chunk = std::min(batch_input > 1 ? batch_input : 1, max_length);
 
-        //printf("before_initial_run 2\n");
-        //backend_context.show_buffer_sizes();
+        // the compute buffer grows with the chunk: [chunk, klen] attention scores, [chunk, hidden] activations, etc.
+        for (; ; chunk /= 2)
+        {
+            ForwardContext ctx(&backend_context);
+            build_initial_graph(ctx, chunk, gen_config, std::max(0, max_length - chunk));
+            const size_t size = ctx.measure_memory();
+            if (size <= prefill_budget)
+                break;
+            if (chunk <= 1)
+            {
+                ggml::log(GGML_LOG_LEVEL_WARN, "prefill compute budget %.1f MiB can't be met, a single token needs %.1f MiB\n",
+                    prefill_budget / 1024.0 / 1024.0, size / 1024.0 / 1024.0);
+                break;
+            }
+        }
 
-        return s;
+        if (chunk < batch_input)
+        {
+            ggml::log(GGML_LOG_LEVEL_INFO, "prefill chunk reduced from %d to %d tokens (compute budget %.1f MiB)\n",
+                batch_input, chunk, prefill_budget / 1024.0 / 1024.0);
+            batch_input = chunk;
+        }
+        return chunk;
     }
 
     bool BaseModelForConditionalGeneration::run_model(const std::vector<int> &input_ids,
@@ -1250,17 +1915,67 @@ namespace chatllm
         if (!initial_run)
         {
             initial_run = true;
-            n_past = gen_config.max_length / transformer->get_reserved_batch_size() - ids_count;
+
+            // with a budget, buffers are reserved for the largest prefill chunk, rather than the first input
+            const int reserve_count = prefill_budget > 0 ? fit_prefill_chunk(gen_config) : ids_count;
+
+            n_past = gen_config.max_length / transformer->get_reserved_batch_size() - reserve_count;
             if (n_past < 0) n_past = 0;
-            if (!before_initial_run(ids_count, gen_config, n_past))
+            if (!before_initial_run(reserve_count, gen_config, n_past))
                 return false;
             n_past = 0;
+
+            // padded K/V of reused graphs read beyond `n_past`: make sure these are finite numbers
+            if (graph_reuse_padding > 0)
+                transformer->clear_cache();
+        }
+
+        if (kv_pages && (row_past.size() > 0))
+        {
+            for (int b = 0; b < (int)row_past.size(); b++)
+            {
+                if (!kv_pages->reserve(kv_slot + b, 1, std::max(row_past[b] + ids_count, kv_slot + b == 0 ? kv_pages_shift_len : 0)))
+                    return false;
+            }
+            if (kv_slot == 0)
+                kv_pages_shift_len = 0;
+        }
+        else if (kv_pages)
+        {
+            // a broadcast batch fills all slots
+            const int rows = kv_slot_rows ? batch_size : std::max(batch_size, transformer->get_reserved_batch_size());
+            if (!kv_pages->reserve(kv_slot, rows, std::max(past + ids_count, kv_slot == 0 ? kv_pages_shift_len : 0)))
+                return false;
+            if (kv_slot == 0)
+                kv_pages_shift_len = 0;
         }
 
         before_run_model(input_ids, ids_count, gen_config, past);
 
-        ForwardContext ctx(&backend_context);
+        // the only epilog passed while `logits_candidates` is set is `logits_to_candidates`
+        const bool reusable = decode_step && (graph_reuse_padding > 0) && (ids_count == 1) && (row_past.size() == 0)
+                                && ((nullptr == func_epilog) || (logits_candidates > 0)) && (gen_config.dump_dot.size() == 0);
+        const int klen_bucket = (past + ids_count + graph_reuse_padding - 1) / (graph_reuse_padding > 0 ? graph_reuse_padding : 1);
+
+        if (reusable && cached_graph.ctx
+            && (cached_graph.alloc_count == backend_context.get_alloc_count())
+            && (cached_graph.batch_size == batch_size) && (cached_graph.kv_slot == kv_slot) && (cached_graph.kv_slot_rows == kv_slot_rows)
+            && (cached_graph.klen_bucket == klen_bucket) && (cached_graph.candidates == logits_candidates))
+        {
+            return run_cached_graph(input_ids, past, output);
+        }
+
+        // the cached graph lives in the same compute buffers
+        drop_cached_graph();
+
+        auto pctx = std::make_unique<ForwardContext>(&backend_context);
+        ForwardContext &ctx = *pctx;
         ctx.user_options = w_ctx_.user_options;
+        ctx.kv_slot = kv_slot;
+        ctx.kv_slot_rows = kv_slot_rows;
+        ctx.row_positions.n_past = row_past;
+        if (reusable)
+            ctx.graph_reuse.kv_padding = graph_reuse_padding;
 
         ctx.gctx = GGMLContext({.mem_size = backend_context.buf_compute_meta.size(), .mem_buffer = backend_context.buf_compute_meta.data(), .no_alloc = true});
         ctx.gf = ggml::new_graph_custom(&ctx, GRAPH_SIZE, false);
@@ -1289,11 +2004,19 @@ namespace chatllm
 
         CHATLLM_CHECK((r->type == GGML_TYPE_F32) || (r->type == GGML_TYPE_I32)) << "output type must be float/int32: " << r->type;
 
+        if (ctx.row_positions.is_enabled() && !ctx.row_positions.is_supported(config_.num_hidden_layers))
+        {
+            ggml::log(GGML_LOG_LEVEL_INFO, "rows at different positions can't be decoded in one batch by this model\n");
+            row_positions_supported = false;
+            return false;
+        }
+
         output.resize(ggml::nbytes(r) / sizeof(output[0]));
 
         if (!ctx.allocate()) return false;
 
         Backend::write_tensor_data(input_ids_tensor, input_ids);
+        ctx.row_positions.write_mask();
 
         if (gen_config.dump_dot.size() > 0)
         {
@@ -1305,11 +2028,107 @@ namespace chatllm
 
         Backend::read_tensor_data(r, output.data());
 
+        if (reusable && ctx.graph_reuse.is_reusable(config_.num_hidden_layers))
+        {
+            cached_graph.ctx            = std::move(pctx);
+            cached_graph.input_ids      = input_ids_tensor;
+            cached_graph.output         = r;
+            cached_graph.alloc_count    = backend_context.get_alloc_count();
+            cached_graph.batch_size     = batch_size;
+            cached_graph.kv_slot        = kv_slot;
+            cached_graph.kv_slot_rows   = kv_slot_rows;
+            cached_graph.klen_bucket    = klen_bucket;
+            cached_graph.candidates     = logits_candidates;
+            return true;
+        }
+
+        ctx.reset();
+
+        return true;
+    }
+
+    bool BaseModelForConditionalGeneration::run_graph(const GenerationConfig &gen_config,
+                            std::function<ggml::tensor *(ComputeContext *ctx)> make_graph,
+                            std::function<void(void)> write_input_data,
+                            std::vector<float> &output)
+    {
+        // the cached graph lives in the same compute buffers
+        drop_cached_graph();
+
+        ForwardContext ctx(&backend_context);
+        ctx.user_options = w_ctx_.user_options;
+        ctx.gctx = GGMLContext({.mem_size = backend_context.buf_compute_meta.size(), .mem_buffer = backend_context.buf_compute_meta.data(), .no_alloc = true});
+        ctx.gf = ggml::new_graph_custom(&ctx, GRAPH_SIZE, false);
+
+        dbg_ctx = &ctx;
+
+        ggml::tensor *r = make_graph(&ctx);
+
+        ggml::set_output(r);
+        ggml::build_forward_expand(&ctx, r);
+
+        CHATLLM_CHECK(r->type == GGML_TYPE_F32) << "output type must be float: " << r->type;
+
+        output.resize(ggml::nbytes(r) / sizeof(output[0]));
+
+        if (!ctx.allocate()) return false;
+
+        write_input_data();
+
+        ctx.compute();
+
+        Backend::read_tensor_data(r, output.data());
+
         ctx.reset();
 
         return true;
     }
 
+    bool BaseModelForConditionalGeneration::run_cached_graph(const int *input_ids, int past, std::vector<float> &output)
+    {
+        ForwardContext &ctx = *cached_graph.ctx;
+
+        ctx.graph_reuse.patch(&ctx, past);
+
+        Backend::write_tensor_data(cached_graph.input_ids, input_ids);
+
+        ctx.compute();
+
+        output.resize(ggml::nbytes(cached_graph.output) / sizeof(output[0]));
+        Backend::read_tensor_data(cached_graph.output, output.data());
+
+        return true;
+    }
+
+    ggml::tensor *BaseModelForConditionalGeneration::logits_to_candidates(ComputeContext *ctx, ggml::tensor *logits)
+    {
+        if (logit_scale > 0)
+            logits = ggml::scale(ctx, logits, logit_scale);
+        if (!ggml::is_contiguous(logits))
+            logits = ggml::cont(ctx, logits);
+
+        const int64_t vocab_size = ggml::get_dim(logits, 0);
+        const int64_t rows       = ggml::nelements(logits) / vocab_size;
+        const int     k          = logits_candidates;
+
+        logits = ggml::reshape_2d(ctx, logits, vocab_size, rows);
+        ggml::tensor *ids    = ggml::top_k(ctx, logits, k);                                               // [rows, k]
+        ggml::tensor *scores = ggml::get_rows(ctx, ggml::reshape_3d(ctx, logits, 1, vocab_size, rows), ids); // [rows, k, 1]
+        scores = ggml::reshape_2d(ctx, scores, k, rows);
+
+        return ggml::concat(ctx, ggml::cast(ctx, ids, ggml::type::GGML_TYPE_F32), scores, 0);
+    }
+
+    void BaseModelForConditionalGeneration::drop_cached_graph(void)
+    {
+        if (!cached_graph.ctx) return;
+
+        // once another graph is allocated, the backend (and compute buffers) are no longer ours to reset
+        if (cached_graph.alloc_count == backend_context.get_alloc_count())
+            cached_graph.ctx->reset();
+        cached_graph.ctx.reset();
+    }
+
     bool BaseModelForConditionalGeneration::is_output_terminated(const std::vector<int> &output_ids, int &keep_idx, int &pop_output)
     {
         if (output_ids.size() < 1)
@@ -1384,6 +2203,10 @@ namespace chatllm
     {
         before_forward(ctx, input_ids, n_past);
 
+        // these may depend on the input (media, positions) in ways unknown to graph reuse
+        if (custom_embedding || layer_preprocess.get())
+            ctx->graph_reuse.veto();
+
         ctx->move_to_layer(LayerAllocatorManager::Prolog);
         ggml::tensor *hidden_states = custom_embedding ? custom_embedding(ctx, input_ids) :  word_embeddings->forward(ctx, input_ids);
         for (auto &layer : layers)
@@ -1505,6 +2328,18 @@ namespace chatllm
         return 0;
     }
 
+    void HeterogeneousModel::clear_cache(void)
+    {
+        std::vector<uint8_t> buffer;
+
+        for (int layer_id = 0; layer_id < num_hidden_layers; layer_id++)
+        {
+            auto layer = layers[layer_id];
+            buffer.resize(layer->get_cache_size(), 0);
+            layer->write_cache_data(buffer.data(), buffer.size());
+        }
+    }
+
     int HeterogeneousModel::save_session(ModelSessionMemory &session) const
     {
         for (int layer_id = 0; layer_id < num_hidden_layers; layer_id++)
@@ -1895,7 +2730,9 @@ namespace chatllm
     bool ModelFactory::load(ModelLoader &loader, Result &result, const ModelObject::extra_args &args)
     {
         load_file_header(loader);
-        return ModelFactory::load(loader.model_type, loader.version, loader, result, args);
+        bool r = ModelFactory::load(loader.model_type, loader.version, loader, result, args);
+        loader.finish_loading();
+        return r;
     }
 
     #define ALL_MODELS  \
@@ -84,6 +84,9 @@ namespace chatllm
         void load(const std::string &path, TensorLoader *loader, const std::vector<int> &layer_ids) override;
 
         void reserve_batch_size(int size) override;
+
+        // fill caches of all layers with zeros
+        void clear_cache(void);
     private:
         struct state
         {
@@ -119,6 +122,7 @@ namespace chatllm
         friend LMFinalStepsDisabler;
         ggml::tensor *forward(HeterogeneousModel *model, ComputeContext *ctx, ggml::tensor *input_ids, ggml::tensor *hidden_states) override;
         void set_read_last_n(int n);
+        int  get_read_last_n(void) const { return last_n; }
         void set_do_orderring(bool flag);   // descending
         ggml::tensor *get_orderring_result(void);
     protected:
@@ -393,6 +393,9 @@ namespace chatllm
     void set_dbg_ctx(ForwardContext *c);
     void unset_dbg_ctx(ForwardContext *c);
 
+    class Sampler;
+    class BatchSampler;
+
     class BaseModelForConditionalGeneration : public BaseModel
     {
     public:
@@ -411,7 +414,13 @@ namespace chatllm
 
         void embedding(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
                                     std::vector<float> &embedding) override;
+        // one forward pass per sequence, unless overridden
+        void embedding_batch(const GenerationConfig &gen_config, const std::vector<int> &input_ids, const std::vector<size_t> &offsets,
+                                    std::vector<float> &embeddings) override;
         float qa_rank(const GenerationConfig &gen_config, const std::vector<int> &input_ids) override;
+        // one forward pass per sequence, unless overridden
+        void qa_rank_batch(const GenerationConfig &gen_config, const std::vector<int> &input_ids, const std::vector<size_t> &offsets,
+                                    std::vector<float> &scores) override;
         bool generate_next_token(const std::vector<int> &input_ids, const GenerationConfig &gen_config, std::vector<float> &lm_logits) override;
         int save_session(FILE *f) const override;
         int load_session(FILE *f) override;
@@ -422,6 +431,55 @@ namespace chatllm
 
         void load(ModelLoader &loader) override;
 
+        void set_drafter(TokenDrafter *drafter, int max_draft_tokens) override;
+
+        int  reserve_kv_slots(int num) override;
+        int  add_sequence(const std::vector<int> &input_ids, const GenerationConfig &gen_config, BaseStreamer *streamer = nullptr) override;
+        void abort_sequence(int id) override;
+        int  step_sequences(ModelPerfInfo *performance = nullptr) override;
+
+    protected:
+        struct BatchedSequence
+        {
+            int id;
+            int slot;
+            int n_past;
+            int next_output_idx;
+            bool prefilled;
+            bool completed;
+            std::vector<int> pending_ids;
+            std::vector<int> output_ids;
+            GenerationConfig gen_config;
+            std::unique_ptr<Sampler> sampler; // handed over to `batch_sampler` once admitted
+            BaseStreamer *streamer;
+        };
+
+        // a decoding graph kept alive for reuse (see `graph_reuse`)
+        struct CachedGraph
+        {
+            std::unique_ptr<ForwardContext> ctx;
+            ggml::tensor *input_ids = nullptr;
+            ggml::tensor *output = nullptr;
+            uint64_t alloc_count = 0;
+            int batch_size = 0;
+            int kv_slot = 0;
+            bool kv_slot_rows = false;
+            int klen_bucket = 0;
+            int candidates = 0;
+        };
+
+        bool run_cached_graph(const int *input_ids, int past, std::vector<float> &output);
+
+        // epilog: top `logits_candidates` ids (as float) & logits of each row: [rows, 2 * candidates]
+        ggml::tensor *logits_to_candidates(ComputeContext *ctx, ggml::tensor *logits);
+        void drop_cached_graph(void);
+
+        bool prefill_sequence(BatchedSequence &seq, std::vector<float> &lm_logits);
+        // returns true if the sequence is finished
+        bool accept_sequence_token(BatchedSequence &seq, int next_token_id, ModelPerfInfo *performance);
+        void retire_sequence(int slot);
+        int reserve_session_pages(void);
+
     protected:
         virtual void before_generate(const GenerationConfig &gen_config);
         virtual void after_generate(void);
@@ -431,6 +489,11 @@ namespace chatllm
         virtual bool before_initial_run(const int ids_count,
                                        const GenerationConfig &gen_config,
                                        int past);
+        void build_initial_graph(ForwardContext &ctx, const int ids_count,
+                                       const GenerationConfig &gen_config,
+                                       int past);
+        // shrinks `batch_input` until the compute buffer fits `prefill_budget`. returns the chunk size.
+        int fit_prefill_chunk(const GenerationConfig &gen_config);
 
         bool run_model(const std::vector<int> &input_ids,
             const GenerationConfig &gen_config,
@@ -447,6 +510,12 @@ namespace chatllm
                                const int batch_size = 1,
                                std::function<ggml::tensor *(ComputeContext *, ggml::tensor *)> func_epilog = nullptr);
 
+        // evaluates a graph that is not built by `transformer->forward`: inputs are written by `write_input_data` once allocated
+        bool run_graph(const GenerationConfig &gen_config,
+                       std::function<ggml::tensor *(ComputeContext *ctx)> make_graph,
+                       std::function<void(void)> write_input_data,
+                       std::vector<float> &output);
+
         virtual bool is_output_terminated(const std::vector<int> &output_ids, int &keep_idx, int &pop_output);
 
         bool match_output_sequence(const std::vector<int> &output_ids, const std::vector<int> &pattern);
@@ -467,6 +536,39 @@ namespace chatllm
         BaseConfig config_;
         bool initial_run = false;
         std::vector<int> auto_output_prefix;
+        int kv_slot = 0;
+        // see `ComputeContext::kv_slot_rows`
+        bool kv_slot_rows = false;
+        // `n_past` of each row of a batched decoding step, when these differ (see `ComputeContext::RowPositions`)
+        std::vector<int> row_past;
+        // cleared once a graph turns out to have layers unaware of per-row positions
+        bool row_positions_supported = true;
+        int next_sequence_id = 0;
+        std::vector<std::unique_ptr<BatchedSequence>> waiting_sequences;
+        std::vector<std::unique_ptr<BatchedSequence>> sequence_slots;
+        std::unique_ptr<BatchSampler> batch_sampler; // row i: sequence in slot i
+        // padding of K/V length in reusable decoding graphs. 0: graph reuse is disabled.
+        int graph_reuse_padding = 0;
+        // set while running a single-token decoding step, the only kind of graph that is reused
+        bool decode_step = false;
+        CachedGraph cached_graph;
+        TokenDrafter *drafter = nullptr;
+        int max_draft_tokens = 0;
+        // draft-free speculation (`prompt_lookup` option)
+        std::unique_ptr<TokenDrafter> prompt_lookup;
+        int prompt_lookup_tokens = 0;
+        // when > 0, only this number of top candidates (rather than all logits) are read back for sampling
+        int logits_candidates = 0;
+        bool device_sampling = true;
+        // compute buffer budget (bytes) of prefilling (`prefill_budget_mb` option). 0: no limit.
+        size_t prefill_budget = 0;
+        // max number of tokens of sequences packed into a single forward pass (`embedding_batch_tokens` option).
+        // attention of a pack costs (tokens of the pack)^2, rather than the sum of squares of sequence lengths.
+        int embedding_batch_tokens = 512;
+        // paged KV cache shared by all sequences (`kv_page_size` option)
+        std::unique_ptr<KVPageTable> kv_pages;
+        // tokens of slot 0 that must stay mapped until a pending cache shift is done
+        int kv_pages_shift_len = 0;
     };
 
     template <class Config, class Embedding, class FinalNorm, class LayerBlock, typename... _Types> class Model :
@@ -627,7 +729,11 @@ namespace chatllm
 
         virtual void accept_choice(int token_id);
 
-        virtual void process(float *logits, const int vocab_size);
+        // `logit_scale`: the scale that is applied to logits later (i.e. 1/temperature)
+        virtual void process(float *logits, const int vocab_size, const float logit_scale = 1.0f);
+
+        // whether `process` changes any logits
+        bool is_active(void) const { return repeat_penalty_en || freq_penalty_en; }
 
     protected:
         const bool repeat_penalty_en;
@@ -638,6 +744,8 @@ namespace chatllm
         const float presence_penalty;
         std::vector<int> token_history;
         std::vector<int> token_count;
+        std::vector<int> visited;
+        int visit_epoch = 0;
         size_t hist_write;
         std::set<int> skip_tokens;
     };
@@ -664,6 +772,17 @@ namespace chatllm
         }
 
         virtual int sampling(float *logits, const int vocab_size, float *confidence_level = nullptr) = 0;
+
+        // number of top candidates that sampling depends on, so that logits can be narrowed down
+        // before being read back (see `sampling_candidates`). -1: all logits are needed.
+        virtual int get_candidate_num(void) const { return -1; }
+
+        // `ids` & `scores`: the top `num` logits, in no particular order.
+        virtual int sampling_candidates(const int *ids, float *scores, const int num, float *confidence_level = nullptr)
+        {
+            CHATLLM_THROW << "sampling_candidates: not implemented";
+            return ABORT;
+        }
     public:
         LogitsPenalty penalty;
     protected:
@@ -675,4 +794,29 @@ namespace chatllm
     public:
         static Sampler *Create(const GenerationConfig &gen_config);
     };
+
+    // Samples a block of logits, one row per request.
+    // Each row owns a `Sampler` built from its own `GenerationConfig` (seed, temperature, penalties, ...),
+    // so that one forward pass can serve heterogeneous requests. Rows are sampled in parallel.
+    class BatchSampler
+    {
+    public:
+        BatchSampler(int n_threads = 1);
+
+        void set_threads(int n);
+        void resize(int rows);
+        int  get_rows(void) const { return (int)samplers.size(); }
+
+        void set(int row, std::unique_ptr<Sampler> sampler);
+        void release(int row);
+        Sampler *get(int row) const { return samplers[row].get(); }
+
+        // `logits`: [num, vocab_size]. row k of `logits` is sampled by the sampler of `rows[k]`,
+        // and the result is written to `next_ids[k]`.
+        void sampling(float *logits, const int vocab_size, const int *rows, const int num, int *next_ids);
+
+    protected:
+        int n_threads;
+        std::vector<std::unique_ptr<Sampler>> samplers;
+    };
 }
\ No newline at end of file
@@ -4,7 +4,6 @@
 #include <memory>
 #include <cstring>
 #include <limits>
-#include <regex>
 #include <iostream>
 
 #include "unicode.h"
@@ -302,6 +301,26 @@ int Processor::Decode(const std::vector<int> &ids, std::string *detokenized) con
     return 0;
 }
 
+int Processor::EncodeBatch(const std::vector<std::string> &inputs, std::vector<int> *ids, std::vector<size_t> *offsets, int num_threads) const
+{
+    encode_in_parallel(inputs.size(), [this, &inputs](size_t i, std::vector<int> &r) { Encode(inputs[i], &r); },
+                       *ids, *offsets, num_threads);
+    return 0;
+}
+
+int Processor::DecodeIncremental(const std::vector<int> &ids, std::string &carry, std::string *detokenized) const
+{
+    for (auto id : ids)
+        carry.append(IdToPiece(id));
+    if (carry.empty()) return 0;
+
+    // a trailing newline flushes everything
+    const size_t end = (carry.back() == '\n') || (carry.back() == '\r') ? carry.size() : get_end_of_valid_utf8(carry, 0);
+    detokenized->append(carry, 0, end);
+    carry.erase(0, end);
+    return 0;
+}
+
 void Processor::RegisterPreprocessor(TextPreprocessor *prep)
 {
     pp.push_back(std::unique_ptr<TextPreprocessor>(prep));
@@ -409,6 +428,26 @@ static int load_vocab_merges(_vocab &vocab, Reader &reader)
         count++;
     }
 
+    // the same merges by token ids. if any merge can't be expressed so, ranks by strings are used.
+    vocab.bpe_merges_by_id.clear();
+    vocab.bpe_merges_by_id_ready = true;
+    for (const auto &m : vocab.bpe_ranks)
+    {
+        auto l = vocab.token_to_id.find(m.first.first);
+        auto r = vocab.token_to_id.find(m.first.second);
+        auto t = vocab.token_to_id.find(m.first.first + m.first.second);
+        if ((l == vocab.token_to_id.end()) || (r == vocab.token_to_id.end()) || (t == vocab.token_to_id.end()))
+        {
+            vocab.bpe_merges_by_id_ready = false;
+            vocab.bpe_merges_by_id.clear();
+            break;
+        }
+        const uint64_t key = ((uint64_t)(uint32_t)l->second << 32) | (uint32_t)r->second;
+        auto it = vocab.bpe_merges_by_id.find(key);
+        if ((it == vocab.bpe_merges_by_id.end()) || (m.second < it->second.first))
+            vocab.bpe_merges_by_id[key] = std::make_pair(m.second, t->second);
+    }
+
     return count;
 }
 
@@ -461,6 +500,49 @@ BPEProcessor2::BPEProcessor2():
 {
 }
 
+bool WordCache::get(const std::string &word, std::vector<int> &ids)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(word);
+    if (it == index.end()) return false;
+    items.splice(items.begin(), items, it->second);
+    ids = it->second->second;
+    return true;
+}
+
+void WordCache::put(const std::string &word, const std::vector<int> &ids)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (capacity < 1) return;
+
+    auto it = index.find(word);
+    if (it != index.end())
+    {
+        it->second->second = ids;
+        items.splice(items.begin(), items, it->second);
+        return;
+    }
+
+    items.emplace_front(word, ids);
+    index.emplace(word, items.begin());
+    while (items.size() > capacity)
+    {
+        index.erase(items.back().first);
+        items.pop_back();
+    }
+}
+
+void WordCache::set_capacity(size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->capacity = capacity;
+    while (items.size() > capacity)
+    {
+        index.erase(items.back().first);
+        items.pop_back();
+    }
+}
+
 BPEProcessor2::BPEProcessor2(std::vector<std::string> regex_exprs):
     Processor::Processor()
 {
@@ -507,9 +589,89 @@ struct llm_bigram_bpe {
     size_t size;
 };
 
+// bigram of token ids: no strings are built while merging
+struct llm_bigram_id {
+    struct comparator {
+        bool operator()(const llm_bigram_id & l, const llm_bigram_id & r) const {
+            return l.rank > r.rank || (l.rank == r.rank && l.left > r.left);
+        }
+    };
+
+    using queue = std::priority_queue<llm_bigram_id, std::vector<llm_bigram_id>, comparator>;
+    int left;
+    int right;
+    _vocab::id left_id;
+    _vocab::id right_id;
+    _vocab::id merged;
+    int rank;
+};
+
 struct llm_bpe_tokenizer {
     llm_bpe_tokenizer(const _vocab & vocab): vocab(vocab) {}
 
+    // merges by token ids. `vocab.bpe_merges_by_id_ready` must be true.
+    void tokenize_word_by_id(std::vector<_vocab::id> & output, const std::string & word) {
+        id_symbols.clear();
+        id_queue = llm_bigram_id::queue();
+
+        size_t offset = 0;
+        while (offset < word.size()) {
+            const size_t char_len = std::min(word.size() - offset, (size_t) ::utf8_len(word[offset]));
+            const int index = (int)id_symbols.size();
+            auto it = vocab.token_to_id.find(word.substr(offset, char_len));
+            id_symbols.push_back({ index - 1, offset + char_len == word.size() ? -1 : index + 1,
+                                   it == vocab.token_to_id.end() ? -1 : it->second, offset, char_len });
+            offset += char_len;
+        }
+        for (int i = 1; i < (int)id_symbols.size(); ++i) {
+            add_new_bigram_by_id(i - 1, i);
+        }
+
+        while (!id_queue.empty()) {
+            const auto bigram = id_queue.top();
+            id_queue.pop();
+
+            auto & left_symbol  = id_symbols[bigram.left];
+            auto & right_symbol = id_symbols[bigram.right];
+
+            // skip outdated bigrams
+            if (left_symbol.n == 0 || right_symbol.n == 0 || left_symbol.next != bigram.right ||
+                left_symbol.id != bigram.left_id || right_symbol.id != bigram.right_id) {
+                continue;
+            }
+
+            // merge the right sym into the left one
+            left_symbol.id  = bigram.merged;
+            left_symbol.n  += right_symbol.n;
+            right_symbol.n  = 0;
+
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                id_symbols[right_symbol.next].prev = bigram.left;
+            }
+
+            add_new_bigram_by_id(left_symbol.prev, bigram.left);
+            add_new_bigram_by_id(bigram.left, left_symbol.next);
+        }
+
+        for (const auto & sym : id_symbols) {
+            if (sym.n == 0) {
+                continue;
+            }
+            if (sym.id >= 0) {
+                output.push_back(sym.id);
+                continue;
+            }
+            for (size_t j = 0; j < sym.n; j++) {
+                auto token_multibyte = vocab.token_to_id.find(std::string(1, word[sym.offset + j]));
+                if (token_multibyte == vocab.token_to_id.end()) {
+                    throw std::runtime_error("ERROR: byte not found in vocab");
+                }
+                output.push_back((*token_multibyte).second);
+            }
+        }
+    }
+
     void tokenize(std::vector<_vocab::id> & output, const std::vector<std::string> &word_collection) {
         int final_prev_index = -1;
 
@@ -611,6 +773,28 @@ struct llm_bpe_tokenizer {
     }
 
 private:
+    void add_new_bigram_by_id(int left, int right) {
+        if (left == -1 || right == -1) {
+            return;
+        }
+
+        const auto & l = id_symbols[left];
+        const auto & r = id_symbols[right];
+        if (l.id < 0 || r.id < 0) {
+            return;
+        }
+
+        llm_bigram_id bigram;
+        if (!vocab.find_bpe_merge(l.id, r.id, bigram.rank, bigram.merged)) {
+            return;
+        }
+        bigram.left     = left;
+        bigram.right    = right;
+        bigram.left_id  = l.id;
+        bigram.right_id = r.id;
+        id_queue.push(bigram);
+    }
+
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
@@ -644,6 +828,17 @@ private:
     std::vector<llm_symbol> symbols_final;
 
     llm_bigram_bpe::queue work_queue;
+
+    struct id_symbol {
+        int prev;
+        int next;
+        _vocab::id id;  // -1: not a token
+        size_t offset;
+        size_t n;
+    };
+
+    std::vector<id_symbol> id_symbols;
+    llm_bigram_id::queue id_queue;
 };
 
 int BPEProcessor2::DoEncode2(const std::string &input,
@@ -654,7 +849,24 @@ int BPEProcessor2::DoEncode2(const std::string &input,
     std::vector<std::string> bpe_encoded_words = unicode_regex_split(input, regex_exprs);
 
     llm_bpe_tokenizer tokenizer(vocab_);
-    tokenizer.tokenize(*ids, bpe_encoded_words);
+    if (!vocab_.bpe_merges_by_id_ready)
+    {
+        tokenizer.tokenize(*ids, bpe_encoded_words);
+        return 0;
+    }
+
+    // repeated words are very common
+    std::vector<int> word_ids;
+    for (const auto &word : bpe_encoded_words)
+    {
+        if (!word_cache.get(word, word_ids))
+        {
+            word_ids.clear();
+            tokenizer.tokenize_word_by_id(word_ids, word);
+            word_cache.put(word, word_ids);
+        }
+        ids->insert(ids->end(), word_ids.begin(), word_ids.end());
+    }
 
     return 0;
 }
@@ -1029,8 +1241,16 @@ std::string TextTrim::transform(const std::string &s0)
 
 std::string TextPrepDeleteMultiSpaces::transform(const std::string &s)
 {
-    const static std::regex r(R""( {2,})"");
-    return std::regex_replace(s, r, " ");
+    // ` {2,}` -> ` `
+    std::string r;
+    r.reserve(s.size());
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        if ((s[i] == ' ') && (i > 0) && (s[i - 1] == ' '))
+            continue;
+        r.push_back(s[i]);
+    }
+    return r;
 }
 
 std::string TextPrepAddLeadingSpace::transform(const std::string &s)
@@ -1041,8 +1261,34 @@ std::string TextPrepAddLeadingSpace::transform(const std::string &s)
 
 std::string TextPrepNewlineToSpaces::transform(const std::string &s)
 {
-    const static std::regex r(R""([\r\n]+)"");
-    return std::regex_replace(s, r, " ");
+    // `[\r\n]+` -> ` `
+    std::string r;
+    r.reserve(s.size());
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        const bool newline = (s[i] == '\r') || (s[i] == '\n');
+        if (newline && (i > 0) && ((s[i - 1] == '\r') || (s[i - 1] == '\n')))
+            continue;
+        r.push_back(newline ? ' ' : s[i]);
+    }
+    return r;
+}
+
+void tokenizer::encode_in_parallel(size_t num, std::function<void (size_t, std::vector<int> &)> encode,
+        std::vector<int> &ids, std::vector<size_t> &offsets, int num_threads)
+{
+    std::vector<std::vector<int>> results(num);
+    utils::parallel_for(0, (int64_t)num, [&results, &encode](int64_t i) { encode((size_t)i, results[i]); }, num_threads);
+
+    offsets.resize(num + 1);
+    offsets[0] = 0;
+    for (size_t i = 0; i < num; i++)
+        offsets[i + 1] = offsets[i] + results[i].size();
+
+    ids.clear();
+    ids.reserve(offsets[num]);
+    for (auto &r : results)
+        ids.insert(ids.end(), r.begin(), r.end());
 }
 
 size_t tokenizer::get_end_of_valid_utf8(const std::string &utf8, const size_t offset)
@@ -2,9 +2,13 @@
 
 #include <string>
 #include <vector>
+#include <functional>
 #include <unordered_map>
 #include <map>
 #include <memory>
+#include <list>
+#include <mutex>
+#include <cstdint>
 
 namespace tokenizer
 {
@@ -36,9 +40,23 @@ struct _vocab
 
     std::unordered_map<id, token> special_tokens_cache;
     std::map<std::pair<std::string, std::string>, int> bpe_ranks;
+    // merges by token ids: (left id << 32 | right id) -> (rank, merged id)
+    std::unordered_map<uint64_t, std::pair<int, id>> bpe_merges_by_id;
+    // false if some merges can't be expressed by token ids
+    bool bpe_merges_by_id_ready = false;
     int byte_fallback_tok_ids[256];
     bool byte_fallback_ready;
 
+    // returns false if not found
+    bool find_bpe_merge(id left, id right, int &rank, id &merged) const
+    {
+        auto it = bpe_merges_by_id.find(((uint64_t)(uint32_t)left << 32) | (uint32_t)right);
+        if (it == bpe_merges_by_id.end()) return false;
+        rank   = it->second.first;
+        merged = it->second.second;
+        return true;
+    }
+
     int find_bpe_rank(std::string token_left, std::string token_right) const
     {
         auto it = bpe_ranks.find(std::make_pair(token_left, token_right));
@@ -149,10 +167,20 @@ public:
     virtual int Encode(const std::string &input,
             std::vector<int> *ids) const;
 
+    // Given UTF8 inputs, encodes them in parallel (`num_threads`: 0 for all cores).
+    // ids of inputs[i] are ids[offsets[i] .. offsets[i + 1]).
+    virtual int EncodeBatch(const std::vector<std::string> &inputs,
+            std::vector<int> *ids, std::vector<size_t> *offsets, int num_threads = 0) const;
+
     // Given a sequence of ids, decodes it into a detokenized output.
     virtual int Decode(const std::vector<int> &ids,
             std::string *detokenized) const;
 
+    // Incremental decoding: pieces of `ids` are appended to `carry`, then the leading valid UTF-8 text
+    // is moved into `detokenized`. Incomplete sequences (e.g. split over byte-fallback tokens) stay in `carry`.
+    virtual int DecodeIncremental(const std::vector<int> &ids,
+            std::string &carry, std::string *detokenized) const;
+
     int GetPieceSize(void) const { return piece_size; }
 
     void SetIdUnkownToken(int id) { id_unk_token = id; }
@@ -223,6 +251,25 @@ protected:
     std::unique_ptr<Node> root;
 };
 
+// a bounded LRU cache: word -> ids. thread safe.
+class WordCache
+{
+public:
+    WordCache(size_t capacity = 65536) : capacity(capacity) {}
+
+    bool get(const std::string &word, std::vector<int> &ids);
+    void put(const std::string &word, const std::vector<int> &ids);
+    void set_capacity(size_t capacity);
+
+protected:
+    typedef std::list<std::pair<std::string, std::vector<int>>> item_list;
+
+    size_t capacity;
+    std::mutex mutex;
+    item_list items; // most recently used first
+    std::unordered_map<std::string, item_list::iterator> index;
+};
+
 class BPEProcessor2: public Processor
 {
 public:
@@ -243,6 +290,7 @@ protected:
 
     std::vector<std::string> regex_exprs;
     NearestKeywordSearcher searcher;
+    mutable WordCache word_cache;
 };
 
 class BPEProcessor3: public BPEProcessor2
@@ -274,4 +322,9 @@ private:
 };
 
 size_t get_end_of_valid_utf8(const std::string &utf8, const size_t offset);
+
+// runs `encode(i, ids of item i)` for i in [0, num) in parallel, then flattens the results:
+// ids of item i are ids[offsets[i] .. offsets[i + 1]).
+void encode_in_parallel(size_t num, std::function<void (size_t, std::vector<int> &)> encode,
+        std::vector<int> &ids, std::vector<size_t> &offsets, int num_threads = 0);
 }
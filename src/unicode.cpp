@@ -1,10 +1,13 @@
 #include "unicode.h"
 #include "unicode-data.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <cstddef>
 #include <cstdint>
 #include <map>
+#include <memory>
 #include <regex>
 #include <stdexcept>
 #include <string>
@@ -492,6 +495,758 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
+//
+// compiled pre-tokenizer matchers
+//
+// regex patterns are compiled into a program of codepoint-set tests (Thompson construction),
+// which is executed as a lazily built DFA over equivalence classes of codepoints:
+// codepoints that pass exactly the same set tests share a class, and thus share transitions.
+// priorities of alternatives and greedy quantifiers are preserved (leftmost-first, like std::regex),
+// so the splits are identical to those of std::regex.
+//
+// supported: literals, `.`, `[...]`, `[^...]`, `\p{..}`, `\P{..}`, `\s`, `\S`, `\d`, `\D`, `\w`, `\W`,
+//            `(?:...)`, `(?i:...)`, `|`, `?`, `*`, `+`, `{n}`, `{n,}`, `{n,m}`,
+//            and lookaheads of a single codepoint: `(?!...)`, `(?=...)`.
+// other patterns fall back to std::regex.
+//
+
+struct unicode_regex_set_item {
+    enum kind_t { RANGE, FLAGS, HAN } kind = RANGE;
+    uint32_t first    = 0;
+    uint32_t last     = 0;
+    uint16_t has      = 0; // FLAGS: all of these flags are set
+    uint16_t has_not  = 0; // FLAGS: none of these flags is set
+    bool     invert   = false;
+
+    bool match(uint32_t cpt, uint16_t flags) const {
+        bool r = false;
+        switch (kind) {
+            case RANGE: r = (first <= cpt) && (cpt <= last);                                break;
+            case FLAGS: r = ((flags & has) == has) && ((flags & has_not) == 0);             break;
+            case HAN:   r = is_cpt_cjk(cpt);                                                break;
+        }
+        return r != invert;
+    }
+};
+
+struct unicode_regex_set {
+    std::vector<unicode_regex_set_item> items;
+    bool negated = false;
+
+    bool match(uint32_t cpt, uint16_t flags) const {
+        for (const auto & item : items) {
+            if (item.match(cpt, flags)) {
+                return !negated;
+            }
+        }
+        return negated;
+    }
+};
+
+struct unicode_regex_inst {
+    enum op_t { SET, SPLIT, JMP, ASSERT, MATCH } op;
+    int  x      = 0;     // SET/ASSERT: index of set; SPLIT/JMP: target (preferred)
+    int  y      = 0;     // SPLIT: the other target
+    bool negate = false; // ASSERT: negative lookahead
+};
+
+static uint16_t unicode_flags_whitespace() { codepoint_flags f; f.is_whitespace = 1; return f.as_uint(); }
+static uint16_t unicode_flags_lowercase()  { codepoint_flags f; f.is_lowercase  = 1; return f.as_uint(); }
+static uint16_t unicode_flags_uppercase()  { codepoint_flags f; f.is_uppercase  = 1; return f.as_uint(); }
+
+class unicode_regex_compiler {
+public:
+    unicode_regex_compiler(const std::string & regex_expr) : cpts(unicode_cpts_from_utf8(regex_expr)) {}
+
+    // returns false if the pattern is not supported
+    bool compile(std::vector<unicode_regex_inst> & prog, std::vector<unicode_regex_set> & sets) {
+        node root;
+        if (!parse_alt(root, false) || (pos != cpts.size())) {
+            return false;
+        }
+        this->prog = &prog;
+        this->sets = &sets;
+        emit_node(root);
+        emit(unicode_regex_inst::MATCH);
+        return sets.size() <= 64;
+    }
+
+private:
+    struct node {
+        enum kind_t { EMPTY, SET, CAT, ALT, REPEAT, LOOK } kind = EMPTY;
+        unicode_regex_set set;
+        std::vector<node> children;
+        int  min = 1;
+        int  max = 1;      // -1: unbounded
+        bool negate = false;
+    };
+
+    bool eof() const { return pos >= cpts.size(); }
+    uint32_t peek(size_t i = 0) const { return pos + i < cpts.size() ? cpts[pos + i] : 0; }
+
+    bool parse_alt(node & n, bool icase) {
+        n.kind = node::ALT;
+        while (true) {
+            n.children.emplace_back();
+            if (!parse_cat(n.children.back(), icase)) {
+                return false;
+            }
+            if (eof() || peek() != '|') {
+                break;
+            }
+            pos++;
+        }
+        return true;
+    }
+
+    bool parse_cat(node & n, bool icase) {
+        n.kind = node::CAT;
+        while (!eof() && (peek() != '|') && (peek() != ')')) {
+            node atom;
+            if (!parse_atom(atom, icase) || !parse_quantifier(atom)) {
+                return false;
+            }
+            n.children.push_back(std::move(atom));
+        }
+        return true;
+    }
+
+    bool parse_number(int & v) {
+        if (eof() || (peek() < '0') || (peek() > '9')) {
+            return false;
+        }
+        v = 0;
+        while (!eof() && (peek() >= '0') && (peek() <= '9')) {
+            v = v * 10 + (int)(cpts[pos++] - '0');
+        }
+        return true;
+    }
+
+    bool parse_quantifier(node & atom) {
+        if (eof()) {
+            return true;
+        }
+
+        int min = 1;
+        int max = 1;
+        switch (peek()) {
+            case '?': min = 0; max =  1; pos++; break;
+            case '*': min = 0; max = -1; pos++; break;
+            case '+': min = 1; max = -1; pos++; break;
+            case '{':
+                pos++;
+                if (!parse_number(min)) {
+                    return false;
+                }
+                max = min;
+                if (peek() == ',') {
+                    pos++;
+                    max = -1;
+                    if (peek() != '}' && !parse_number(max)) {
+                        return false;
+                    }
+                }
+                if (peek() != '}' || ((max >= 0) && (max < min))) {
+                    return false;
+                }
+                pos++;
+                break;
+            default:
+                return true;
+        }
+
+        // lazy & possessive quantifiers are not supported; neither are quantified lookaheads
+        if (!eof() && ((peek() == '?') || (peek() == '+'))) {
+            return false;
+        }
+        if (atom.kind == node::LOOK) {
+            return false;
+        }
+
+        node r;
+        r.kind = node::REPEAT;
+        r.min  = min;
+        r.max  = max;
+        r.children.push_back(std::move(atom));
+        atom = std::move(r);
+        return true;
+    }
+
+    static void add_case_variants(unicode_regex_set & set, uint32_t cpt) {
+        set.items.push_back({ unicode_regex_set_item::RANGE, cpt, cpt });
+        const uint32_t lower = unicode_tolower(cpt);
+        if (lower != cpt) {
+            set.items.push_back({ unicode_regex_set_item::RANGE, lower, lower });
+        }
+        auto it = unicode_map_uppercase.find(cpt);
+        if ((it != unicode_map_uppercase.end()) && (it->second != cpt)) {
+            set.items.push_back({ unicode_regex_set_item::RANGE, it->second, it->second });
+        }
+    }
+
+    static bool property_item(const std::string & name, unicode_regex_set_item & item) {
+        const uint16_t lower = unicode_flags_lowercase();
+        const uint16_t upper = unicode_flags_uppercase();
+
+        item.kind = unicode_regex_set_item::FLAGS;
+        if (name == "Han") {
+            item.kind = unicode_regex_set_item::HAN;
+        } else if (name == "L") {
+            item.has = codepoint_flags::LETTER;
+        } else if (name == "Lu") {
+            item.has = codepoint_flags::LETTER | upper;
+        } else if (name == "Ll") {
+            item.has = codepoint_flags::LETTER | lower;
+        } else if ((name == "Lt") || (name == "Lm") || (name == "Lo")) {
+            // titlecase & modifier letters are not distinguished from other letters
+            item.has     = codepoint_flags::LETTER;
+            item.has_not = lower | upper;
+        } else {
+            static const std::map<char, uint16_t> k_ucat = {
+                { 'N', codepoint_flags::NUMBER },
+                { 'Z', codepoint_flags::SEPARATOR },
+                { 'M', codepoint_flags::ACCENT_MARK },
+                { 'P', codepoint_flags::PUNCTUATION },
+                { 'S', codepoint_flags::SYMBOL },
+                { 'C', codepoint_flags::CONTROL },
+            };
+            // sub-categories (such as `Nd`, `Mn`) are approximated by their major category
+            auto it = name.size() > 0 && name.size() <= 2 ? k_ucat.find(name[0]) : k_ucat.end();
+            if (it == k_ucat.end()) {
+                return false;
+            }
+            item.has = it->second;
+        }
+        return true;
+    }
+
+    // parses an escape sequence (after `\`) that stands for a class of codepoints.
+    // returns 0 if it is not such a class, -1 on error.
+    int parse_class_escape(unicode_regex_set & set) {
+        const uint32_t c = peek();
+        unicode_regex_set_item item;
+        switch (c) {
+            case 's': case 'S':
+                item.kind   = unicode_regex_set_item::FLAGS;
+                item.has    = unicode_flags_whitespace();
+                item.invert = c == 'S';
+                pos++;
+                break;
+            case 'd': case 'D':
+                item.first  = '0';
+                item.last   = '9';
+                item.invert = c == 'D';
+                pos++;
+                break;
+            case 'w': case 'W':
+                if (c == 'w') {
+                    set.items.push_back({ unicode_regex_set_item::RANGE, 'a', 'z' });
+                    set.items.push_back({ unicode_regex_set_item::RANGE, 'A', 'Z' });
+                    set.items.push_back({ unicode_regex_set_item::RANGE, '0', '9' });
+                    set.items.push_back({ unicode_regex_set_item::RANGE, '_', '_' });
+                    pos++;
+                    return 1;
+                }
+                return -1;
+            case 'p': case 'P':
+                {
+                    pos++;
+                    if (peek() != '{') {
+                        return -1;
+                    }
+                    pos++;
+                    std::string name;
+                    while (!eof() && (peek() != '}')) {
+                        name += (char)cpts[pos++];
+                    }
+                    if (eof() || !property_item(name, item)) {
+                        return -1;
+                    }
+                    pos++;
+                    item.invert = c == 'P';
+                }
+                break;
+            default:
+                return 0;
+        }
+        set.items.push_back(item);
+        return 1;
+    }
+
+    // parses an escaped codepoint (after `\`)
+    bool parse_escaped_cpt(uint32_t & cpt) {
+        const uint32_t c = cpts[pos++];
+        switch (c) {
+            case 'r': cpt = '\r'; return true;
+            case 'n': cpt = '\n'; return true;
+            case 't': cpt = '\t'; return true;
+            case 'f': cpt = '\f'; return true;
+            case 'v': cpt = '\v'; return true;
+            default:
+                // escaped metacharacters
+                if ((c < 128) && !isalnum((int)c)) {
+                    cpt = c;
+                    return true;
+                }
+                return false;
+        }
+    }
+
+    bool parse_class(unicode_regex_set & set, bool icase) {
+        // after `[`
+        if (peek() == '^') {
+            set.negated = true;
+            pos++;
+        }
+
+        bool first = true;
+        while (!eof() && ((peek() != ']') || first)) {
+            first = false;
+
+            uint32_t lo = cpts[pos];
+            if (lo == '\\') {
+                pos++;
+                if (eof()) {
+                    return false;
+                }
+                const int r = parse_class_escape(set);
+                if (r < 0) {
+                    return false;
+                }
+                if (r > 0) {
+                    continue;
+                }
+                if (!parse_escaped_cpt(lo)) {
+                    return false;
+                }
+            } else {
+                pos++;
+            }
+
+            uint32_t hi = lo;
+            if ((peek() == '-') && (pos + 1 < cpts.size()) && (peek(1) != ']')) {
+                pos++;
+                hi = cpts[pos++];
+                if (hi == '\\') {
+                    if (eof() || !parse_escaped_cpt(hi)) {
+                        return false;
+                    }
+                }
+                if (hi < lo) {
+                    return false;
+                }
+            }
+
+            set.items.push_back({ unicode_regex_set_item::RANGE, lo, hi });
+            if (icase) {
+                for (uint32_t c = std::max(lo, (uint32_t)'A'); c <= std::min(hi, (uint32_t)'Z'); c++) {
+                    add_case_variants(set, c);
+                }
+                for (uint32_t c = std::max(lo, (uint32_t)'a'); c <= std::min(hi, (uint32_t)'z'); c++) {
+                    add_case_variants(set, c);
+                }
+            }
+        }
+
+        if (eof()) {
+            return false;
+        }
+        pos++;
+        return true;
+    }
+
+    bool parse_atom(node & n, bool icase) {
+        const uint32_t c = cpts[pos++];
+        n.kind = node::SET;
+        switch (c) {
+            case '(':
+                {
+                    bool look = false;
+                    if (peek() == '?') {
+                        pos++;
+                        if (peek() == ':') {
+                            pos++;
+                        } else if ((peek() == 'i') && (peek(1) == ':')) {
+                            icase = true;
+                            pos += 2;
+                        } else if ((peek() == '!') || (peek() == '=')) {
+                            n.negate = peek() == '!';
+                            look = true;
+                            pos++;
+                        } else {
+                            return false;
+                        }
+                    }
+
+                    node sub;
+                    if (!parse_alt(sub, icase) || eof() || (peek() != ')')) {
+                        return false;
+                    }
+                    pos++;
+
+                    if (look) {
+                        // only a single codepoint can be looked ahead
+                        if ((sub.children.size() != 1) || (sub.children[0].children.size() != 1) ||
+                            (sub.children[0].children[0].kind != node::SET)) {
+                            return false;
+                        }
+                        n.kind = node::LOOK;
+                        n.set  = std::move(sub.children[0].children[0].set);
+                    } else {
+                        n = std::move(sub);
+                    }
+                }
+                return true;
+            case '[':
+                return parse_class(n.set, icase);
+            case '.':
+                n.set.negated = true;
+                for (uint32_t t : { 0x0Au, 0x0Du, 0x2028u, 0x2029u }) {
+                    n.set.items.push_back({ unicode_regex_set_item::RANGE, t, t });
+                }
+                return true;
+            case '\\':
+                {
+                    if (eof()) {
+                        return false;
+                    }
+                    const int r = parse_class_escape(n.set);
+                    if (r != 0) {
+                        return r > 0;
+                    }
+                    uint32_t cpt = 0;
+                    if (!parse_escaped_cpt(cpt)) {
+                        return false;
+                    }
+                    n.set.items.push_back({ unicode_regex_set_item::RANGE, cpt, cpt });
+                    if (icase) {
+                        add_case_variants(n.set, cpt);
+                    }
+                }
+                return true;
+            case ')': case '*': case '+': case '?': case '{': case '^': case '$':
+                return false;
+            default:
+                if (icase) {
+                    add_case_variants(n.set, c);
+                } else {
+                    n.set.items.push_back({ unicode_regex_set_item::RANGE, c, c });
+                }
+                return true;
+        }
+    }
+
+    int emit(unicode_regex_inst::op_t op, int x = 0, int y = 0, bool negate = false) {
+        unicode_regex_inst inst;
+        inst.op     = op;
+        inst.x      = x;
+        inst.y      = y;
+        inst.negate = negate;
+        prog->push_back(inst);
+        return (int)prog->size() - 1;
+    }
+
+    int pc() const { return (int)prog->size(); }
+
+    void emit_node(const node & n) {
+        switch (n.kind) {
+            case node::EMPTY:
+                break;
+            case node::SET:
+                sets->push_back(n.set);
+                emit(unicode_regex_inst::SET, (int)sets->size() - 1);
+                break;
+            case node::LOOK:
+                sets->push_back(n.set);
+                emit(unicode_regex_inst::ASSERT, (int)sets->size() - 1, 0, n.negate);
+                break;
+            case node::CAT:
+                for (const auto & c : n.children) {
+                    emit_node(c);
+                }
+                break;
+            case node::ALT:
+                {
+                    std::vector<int> jumps;
+                    for (size_t i = 0; i + 1 < n.children.size(); i++) {
+                        const int split = emit(unicode_regex_inst::SPLIT, pc() + 1);
+                        emit_node(n.children[i]);
+                        jumps.push_back(emit(unicode_regex_inst::JMP));
+                        (*prog)[split].y = pc();
+                    }
+                    emit_node(n.children.back());
+                    for (int j : jumps) {
+                        (*prog)[j].x = pc();
+                    }
+                }
+                break;
+            case node::REPEAT:
+                {
+                    const node & body = n.children[0];
+                    for (int i = 0; i < n.min; i++) {
+                        emit_node(body);
+                    }
+                    if (n.max < 0) {
+                        const int split = emit(unicode_regex_inst::SPLIT, pc() + 1);
+                        emit_node(body);
+                        emit(unicode_regex_inst::JMP, split);
+                        (*prog)[split].y = pc();
+                    } else {
+                        std::vector<int> splits;
+                        for (int i = n.min; i < n.max; i++) {
+                            splits.push_back(emit(unicode_regex_inst::SPLIT, pc() + 1));
+                            emit_node(body);
+                        }
+                        for (int s : splits) {
+                            (*prog)[s].y = pc();
+                        }
+                    }
+                }
+                break;
+        }
+    }
+
+    const std::vector<uint32_t> cpts;
+    size_t pos = 0;
+    std::vector<unicode_regex_inst> * prog = nullptr;
+    std::vector<unicode_regex_set>   * sets = nullptr;
+};
+
+class unicode_regex_matcher {
+public:
+    // returns nullptr if the pattern is not supported
+    static unicode_regex_matcher * compile(const std::string & regex_expr) {
+        auto r = new unicode_regex_matcher();
+        unicode_regex_compiler compiler(regex_expr);
+        if (!compiler.compile(r->prog, r->sets)) {
+            delete r;
+            return nullptr;
+        }
+        return r;
+    }
+
+    // maps each codepoint to its equivalence class
+    void classify(const std::vector<uint32_t> & cpts, std::vector<int> & classes) {
+        classes.resize(cpts.size());
+        for (size_t i = 0; i < cpts.size(); i++) {
+            const uint32_t cpt = cpts[i];
+            if (cpt < 128) {
+                if (ascii_classes[cpt] < 0) {
+                    ascii_classes[cpt] = class_of(cpt);
+                }
+                classes[i] = ascii_classes[cpt];
+            } else {
+                classes[i] = class_of(cpt);
+            }
+        }
+    }
+
+    // length of the match at `start` (0: no match)
+    size_t match(const std::vector<int> & classes, size_t start, size_t end) {
+        // the cache is only dropped between matches
+        if (states.size() > MAX_STATES) {
+            reset_states();
+        }
+        if (states.empty()) {
+            add_state({ 0 });
+        }
+
+        size_t matched = 0;
+        int state = 0;
+        for (size_t i = start; ; i++) {
+            const int c = i < end ? classes[i] : EOF_CLASS;
+            const int t = transition(state, c);
+            if (t & 1) {
+                matched = i - start;
+            }
+            state = t >> 1;
+            if ((i >= end) || (state == DEAD)) {
+                break;
+            }
+        }
+        return matched;
+    }
+
+private:
+    static constexpr int    DEAD       = 0x3fffffff;
+    static constexpr int    EOF_CLASS  = 0;          // class 0 is reserved for end of input
+    static constexpr size_t MAX_STATES = 10000;
+
+    unicode_regex_matcher() {
+        for (auto & c : ascii_classes) {
+            c = -1;
+        }
+        class_sigs.push_back(0);
+    }
+
+    int class_of(uint32_t cpt) {
+        const uint16_t flags = unicode_cpt_flags(cpt).as_uint();
+        uint64_t sig = 0;
+        for (size_t i = 0; i < sets.size(); i++) {
+            if (sets[i].match(cpt, flags)) {
+                sig |= (uint64_t)1 << i;
+            }
+        }
+
+        auto it = sig_to_class.find(sig);
+        if (it != sig_to_class.end()) {
+            return it->second;
+        }
+
+        const int c = (int)class_sigs.size();
+        class_sigs.push_back(sig);
+        sig_to_class.emplace(sig, c);
+        for (auto & s : states) {
+            s.trans.push_back(-1);
+        }
+        return c;
+    }
+
+    struct state_t {
+        std::vector<int> pcs;   // threads in priority order, before epsilon closure
+        std::vector<int> trans; // (next state << 1) | (matched before consuming); -1: not built yet
+    };
+
+    int add_state(const std::vector<int> & pcs) {
+        std::string key(reinterpret_cast<const char *>(pcs.data()), pcs.size() * sizeof(int));
+        auto it = state_ids.find(key);
+        if (it != state_ids.end()) {
+            return it->second;
+        }
+
+        const int id = (int)states.size();
+        states.push_back({ pcs, std::vector<int>(class_sigs.size(), -1) });
+        state_ids.emplace(std::move(key), id);
+        return id;
+    }
+
+    void reset_states() {
+        states.clear();
+        state_ids.clear();
+    }
+
+    // follows the threads of `state` in priority order with the next codepoint in class `c`
+    int transition(int state, int c) {
+        int t = states[state].trans[c];
+        if (t >= 0) {
+            return t;
+        }
+
+        const uint64_t sig = class_sigs[c];
+        const bool at_end = c == EOF_CLASS;
+
+        std::vector<int> next;
+        std::vector<char> visited(prog.size(), 0);
+        std::vector<char> added(prog.size(), 0);
+        std::vector<int> stack;
+        bool matched = false;
+
+        const std::vector<int> pcs = states[state].pcs;
+        for (size_t k = 0; (k < pcs.size()) && !matched; k++) {
+            stack.push_back(pcs[k]);
+            while (!stack.empty() && !matched) {
+                const int pc = stack.back();
+                stack.pop_back();
+                if (visited[pc]) {
+                    continue;
+                }
+                visited[pc] = 1;
+
+                const auto & inst = prog[pc];
+                switch (inst.op) {
+                    case unicode_regex_inst::SET:
+                        if (!at_end && ((sig >> inst.x) & 1) && !added[pc + 1]) {
+                            added[pc + 1] = 1;
+                            next.push_back(pc + 1);
+                        }
+                        break;
+                    case unicode_regex_inst::SPLIT:
+                        stack.push_back(inst.y);
+                        stack.push_back(inst.x);
+                        break;
+                    case unicode_regex_inst::JMP:
+                        stack.push_back(inst.x);
+                        break;
+                    case unicode_regex_inst::ASSERT:
+                        {
+                            const bool hit = !at_end && ((sig >> inst.x) & 1);
+                            if (hit != inst.negate) {
+                                stack.push_back(pc + 1);
+                            }
+                        }
+                        break;
+                    case unicode_regex_inst::MATCH:
+                        // threads of lower priority are dropped
+                        matched = true;
+                        break;
+                }
+            }
+            stack.clear();
+        }
+
+        const int next_state = next.empty() ? DEAD : add_state(next);
+        t = (next_state << 1) | (matched ? 1 : 0);
+        states[state].trans[c] = t;
+        return t;
+    }
+
+    std::vector<unicode_regex_inst> prog;
+    std::vector<unicode_regex_set>  sets;
+
+    int ascii_classes[128];
+    std::vector<uint64_t> class_sigs;
+    std::unordered_map<uint64_t, int> sig_to_class;
+
+    std::vector<state_t> states;
+    std::unordered_map<std::string, int> state_ids;
+};
+
+// returns nullptr if `regex_expr` can't be compiled
+static unicode_regex_matcher * unicode_regex_get_matcher(const std::string & regex_expr) {
+    // matchers build their DFA lazily, so each thread has its own
+    static thread_local std::unordered_map<std::string, std::unique_ptr<unicode_regex_matcher>> matchers;
+
+    auto it = matchers.find(regex_expr);
+    if (it == matchers.end()) {
+        it = matchers.emplace(regex_expr, unicode_regex_matcher::compile(regex_expr)).first;
+    }
+    return it->second.get();
+}
+
+static std::vector<size_t> unicode_regex_split_compiled(unicode_regex_matcher & matcher, const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
+    std::vector<int> classes;
+    matcher.classify(cpts, classes);
+
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t end = start + offset;
+
+        size_t unmatched = start;
+        for (size_t pos = start; pos < end; ) {
+            const size_t len = matcher.match(classes, pos, end);
+            if (len == 0) {
+                pos++;
+                continue;
+            }
+            if (pos > unmatched) {
+                bpe_offsets.emplace_back(pos - unmatched);
+            }
+            bpe_offsets.emplace_back(len);
+            pos += len;
+            unmatched = pos;
+        }
+
+        if (unmatched < end) {
+            bpe_offsets.emplace_back(end - unmatched);
+        }
+        start = end;
+    }
+
+    return bpe_offsets;
+}
+
 static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets;
 
@@ -613,26 +1368,16 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         { codepoint_flags::PUNCTUATION,   "\x21-\x23\x25-\x2A\x2C-\x2F\x3A-\x3B\x3F-\x40\\\x5B-\\\x5D\x5F\\\x7B\\\x7D" }, // !-#%-*,-/:-;?-@\[-\]_\{\}
     };
 
-    // compute collapsed codepoints only if needed by at least one regex
-    bool need_collapse = false;
-    for (auto & regex_expr : regex_exprs) {
-        // search for unicode categories
-        for (const auto & ucat : k_ucat_enum) {
-            if (std::string::npos != regex_expr.find(ucat.first)) {
-                need_collapse = true;
-                break;
-            }
-        }
-        if (need_collapse)
-            break;
-    }
-
     const auto cpts = unicode_cpts_from_utf8(text);
 
     // generate a "collapsed" representation of the text, where all codepoints are replaced by a single byte
     // ref: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2081479935
+    // it is only needed by std::regex, so it is generated on first use.
     std::string text_collapsed;
-    if (need_collapse) {
+    auto collapse = [&]() {
+        if (text_collapsed.size() == cpts.size()) {
+            return;
+        }
         // collapse all unicode categories
         text_collapsed.resize(cpts.size());
 
@@ -655,7 +1400,7 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
                 text_collapsed[i] = (char) 0xD0; // fallback
             }
         }
-    }
+    };
 
     std::vector<size_t> bpe_offsets = { cpts.size() };
 
@@ -668,6 +1413,13 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
             continue;
         }
 
+        // then, a compiled matcher
+        auto matcher = unicode_regex_get_matcher(regex_expr);
+        if (matcher) {
+            bpe_offsets = unicode_regex_split_compiled(*matcher, cpts, bpe_offsets);
+            continue;
+        }
+
         // fallback to general-purpose std::regex / std::wregex
         try {
             // if a unicode category is used in the regex, we use the collapsed text and replace the unicode category
@@ -729,6 +1481,8 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
                     regex_expr_collapsed += regex_expr[i];
                 }
 
+                collapse();
+
                 //printf("text_collapsed: %s\n", text_collapsed.c_str());
                 //printf("regex_expr_collapsed: %s\n", regex_expr_collapsed.c_str());
                 bpe_offsets = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);
@@ -10,12 +10,53 @@
 #include <math.h>
 #include <string.h>
 #include <thread>
+#include <mutex>
+#include <atomic>
+#include <queue>
+#include <bit>
 #include <regex>
 #include <random>
 #include <chrono>
 
 #include "basics.h"
 
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#ifdef __has_include
+#if __has_include(<unistd.h>)
+#include <unistd.h>
+#if defined(_POSIX_MAPPED_FILES)
+#include <sys/mman.h>
+#endif
+#endif
+#endif
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <io.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define VS_USE_AVX2
+#define VS_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#elif defined(__AVX2__)
+#define VS_USE_AVX2
+#define VS_TARGET_AVX2
+#endif
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define VS_USE_NEON
+#endif
+
 static const char VS_FILE_HEADER[] = "CHATLLMVS";
 
 struct file_header
@@ -25,58 +66,368 @@ struct file_header
     size_t size;
 };
 
-static float vector_euclidean_distance(const float *a, const float *b, int len)
+static const char VS_FILE_HEADER_V2[] = "CHATLLMVDB";
+static const uint64_t VS_EMB_ALIGNMENT = 64;
+
+// version 2: columnar
+struct file_header_v2
+{
+    char magic[12];
+    uint32_t version;
+    uint64_t emb_len;
+    uint64_t size;                  // number of records
+    uint64_t embeddings_offset;     // float[size][emb_len], aligned to VS_EMB_ALIGNMENT
+    uint64_t strings_offset;        // contents & metadata
+    uint64_t strings_size;
+    uint64_t offsets_offset;        // uint64_t[2 * size + 1] into strings: content of record i is [offsets[2i], offsets[2i + 1]),
+                                    // and metadata is [offsets[2i + 1], offsets[2i + 2])
+    // since version 3
+    uint32_t quantization;          // VectorQuantization
+    uint32_t code_size;             // bytes per record
+    uint64_t codes_offset;          // uint8_t[size][code_size], aligned to VS_EMB_ALIGNMENT
+    uint64_t code_params_offset;    // float[size][2]: scale & norm
+};
+
+static const size_t VS_FILE_HEADER_V2_SIZE = offsetof(file_header_v2, quantization);
+
+// read-only mapping of a whole file, so pages are shared with other processes
+class CMappedFile
+{
+public:
+    CMappedFile(const char *fn);
+    ~CMappedFile();
+
+    const char *data;
+    size_t size;
+
+protected:
+    std::vector<char> buffer;       // when mapping is not available
+};
+
+#ifdef _POSIX_MAPPED_FILES
+CMappedFile::CMappedFile(const char *fn) : data(nullptr), size(0)
+{
+    int fd = open(fn, O_RDONLY);
+    CHATLLM_CHECK(fd >= 0) << "can not open db file: " << fn;
+
+    struct stat sb;
+    CHATLLM_CHECK(fstat(fd, &sb) == 0) << strerror(errno);
+    size = sb.st_size;
+
+    if (size > 0)
+    {
+        void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        CHATLLM_CHECK(p != MAP_FAILED) << strerror(errno);
+        data = (const char *)p;
+    }
+
+    CHATLLM_CHECK(close(fd) == 0) << strerror(errno);
+}
+
+CMappedFile::~CMappedFile()
+{
+    if (data) munmap((void *)data, size);
+}
+#elif defined(_WIN32)
+CMappedFile::CMappedFile(const char *fn) : data(nullptr), size(0)
+{
+    int fd = open(fn, O_RDONLY | O_BINARY);
+    CHATLLM_CHECK(fd >= 0) << "can not open db file: " << fn;
+
+    struct _stat64 sb;
+    CHATLLM_CHECK(_fstat64(fd, &sb) == 0) << strerror(errno);
+    size = sb.st_size;
+
+    if (size > 0)
+    {
+        HANDLE hMapping = CreateFileMappingA((HANDLE)_get_osfhandle(fd), NULL, PAGE_READONLY, 0, 0, NULL);
+        CHATLLM_CHECK(hMapping != NULL) << "can not map db file: " << fn;
+
+        data = (const char *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(hMapping);
+        CHATLLM_CHECK(data != NULL) << "can not map db file: " << fn;
+    }
+
+    CHATLLM_CHECK(close(fd) == 0) << strerror(errno);
+}
+
+CMappedFile::~CMappedFile()
+{
+    if (data) UnmapViewOfFile(data);
+}
+#else
+CMappedFile::CMappedFile(const char *fn) : data(nullptr), size(0)
+{
+    std::ifstream f(fn, std::ios::binary | std::ios::ate);
+    CHATLLM_CHECK(f.is_open()) << "can not open db file: " << fn;
+    size = (size_t)f.tellg();
+    buffer.resize(size);
+    f.seekg(0);
+    f.read(buffer.data(), size);
+    data = buffer.data();
+}
+
+CMappedFile::~CMappedFile()
+{
+}
+#endif
+
+static float vector_inner_product(const float *a, const float *b, int len)
 {
     float sum = 0.0;
     for (int i = 0; i < len; i++)
     {
-        float t = a[i] - b[i];
-        sum += t * t;
+        sum += a[i] * b[i];
     }
-    return sqrtf(sum);
+    return sum;
 }
 
-static float vector_inner_product(const float *a, const float *b, int len)
+static float vector_squared_distance(const float *a, const float *b, int len)
 {
     float sum = 0.0;
     for (int i = 0; i < len; i++)
     {
+        float t = a[i] - b[i];
+        sum += t * t;
+    }
+    return sum;
+}
+
+#if defined(VS_USE_AVX2)
+VS_TARGET_AVX2 static float hsum_avx2(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+VS_TARGET_AVX2 static float vector_inner_product_avx2(const float *a, const float *b, int len)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i),     _mm256_loadu_ps(b + i),     acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= len; i += 8)
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+
+    float sum = hsum_avx2(_mm256_add_ps(acc0, acc1));
+    for (; i < len; i++)
         sum += a[i] * b[i];
+    return sum;
+}
+
+VS_TARGET_AVX2 static float vector_squared_distance_avx2(const float *a, const float *b, int len)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i),     _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 8 <= len; i += 8)
+    {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_fmadd_ps(d, d, acc0);
+    }
+
+    float sum = hsum_avx2(_mm256_add_ps(acc0, acc1));
+    for (; i < len; i++)
+    {
+        float t = a[i] - b[i];
+        sum += t * t;
+    }
+    return sum;
+}
+
+static bool cpu_has_avx2(void)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+    return true;
+#endif
+}
+#endif
+
+#if defined(VS_USE_NEON)
+static float vector_inner_product_neon(const float *a, const float *b, int len)
+{
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i),     vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    float sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; i < len; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+static float vector_squared_distance_neon(const float *a, const float *b, int len)
+{
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        float32x4_t d0 = vsubq_f32(vld1q_f32(a + i),     vld1q_f32(b + i));
+        float32x4_t d1 = vsubq_f32(vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        acc0 = vfmaq_f32(acc0, d0, d0);
+        acc1 = vfmaq_f32(acc1, d1, d1);
+    }
+    float sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; i < len; i++)
+    {
+        float t = a[i] - b[i];
+        sum += t * t;
     }
     return sum;
 }
+#endif
 
-static float vector_cos_similarity(const float *a, const float *b, int len)
+static int32_t vector_int8_inner_product(const int8_t *a, const int8_t *b, int len)
 {
-    float inner_sum = 0.0;
-    float norm_a = 0.0;
-    float norm_b = 0.0;
+    int32_t sum = 0;
     for (int i = 0; i < len; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+#if defined(VS_USE_AVX2)
+VS_TARGET_AVX2 static int32_t vector_int8_inner_product_avx2(const int8_t *a, const int8_t *b, int len)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= len; i += 32)
     {
-        inner_sum += a[i] * b[i];
-        norm_a    += a[i] * a[i];
-        norm_b    += b[i] * b[i];
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        // |a| * (b with the sign of a). values are within [-127, 127], so this never saturates.
+        __m256i p = _mm256_maddubs_epi16(_mm256_sign_epi8(va, va), _mm256_sign_epi8(vb, va));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(p, ones));
     }
-    norm_a = sqrtf(norm_a);
-    norm_b = sqrtf(norm_b);
 
-    return inner_sum / (norm_a * norm_b + 1e-6f);
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    int32_t sum = _mm_cvtsi128_si32(s);
+    for (; i < len; i++)
+        sum += a[i] * b[i];
+    return sum;
 }
+#endif
 
-static float vector_measure(DistanceStrategy ds, const float *a, const float *b, int len)
+#if defined(VS_USE_NEON)
+static int32_t vector_int8_inner_product_neon(const int8_t *a, const int8_t *b, int len)
 {
-    switch (ds)
+    int32x4_t acc = vdupq_n_s32(0);
+    int i = 0;
+    for (; i + 16 <= len; i += 16)
     {
-    case EuclideanDistance:
-        return vector_euclidean_distance(a, b, len);
-    case MaxInnerProduct:
-    case InnerProduct:
-        return vector_inner_product(a, b, len);
-    case CosineSimilarity:
-        return vector_cos_similarity(a, b, len);
+        int8x16_t va = vld1q_s8(a + i);
+        int8x16_t vb = vld1q_s8(b + i);
+        int16x8_t p = vmull_s8(vget_low_s8(va), vget_low_s8(vb));
+        p = vmlal_s8(p, vget_high_s8(va), vget_high_s8(vb));
+        acc = vpadalq_s16(acc, p);
+    }
+    int32_t sum = vaddvq_s32(acc);
+    for (; i < len; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+#endif
+
+static int vector_hamming_distance(const uint64_t *a, const uint64_t *b, int words)
+{
+    int d = 0;
+    for (int i = 0; i < words; i++)
+        d += std::popcount(a[i] ^ b[i]);
+    return d;
+}
+
+typedef float (*vector_kernel)(const float *a, const float *b, int len);
+typedef int32_t (*vector_int8_kernel)(const int8_t *a, const int8_t *b, int len);
+
+struct vector_kernels
+{
+    vector_kernel inner_product;
+    vector_kernel squared_distance;
+    vector_int8_kernel int8_inner_product;
+};
+
+static const vector_kernels &get_vector_kernels(void)
+{
+    static const vector_kernels kernels = []() -> vector_kernels {
+#if defined(VS_USE_AVX2)
+        if (cpu_has_avx2())
+            return {vector_inner_product_avx2, vector_squared_distance_avx2, vector_int8_inner_product_avx2};
+#endif
+#if defined(VS_USE_NEON)
+        return {vector_inner_product_neon, vector_squared_distance_neon, vector_int8_inner_product_neon};
+#endif
+        return {vector_inner_product, vector_squared_distance, vector_int8_inner_product};
+    }();
+    return kernels;
+}
+
+static size_t get_code_size(VectorQuantization type, int emb_len)
+{
+    switch (type)
+    {
+    case Int8Quantization:
+        return emb_len;
+    case BinaryQuantization:
+        // whole uint64_t words
+        return (emb_len + 63) / 64 * sizeof(uint64_t);
+    default:
+        return 0;
+    }
+}
+
+// per vector: scale (int8) & norm
+static void quantize_vector(VectorQuantization type, const float *vec, int emb_len, uint8_t *code, float *params)
+{
+    float norm2 = 0.0f;
+    float max_abs = 0.0f;
+    for (int j = 0; j < emb_len; j++)
+    {
+        norm2  += vec[j] * vec[j];
+        max_abs = std::max(max_abs, fabsf(vec[j]));
+    }
+    params[0] = 0.0f;
+    params[1] = sqrtf(norm2);
+
+    switch (type)
+    {
+    case Int8Quantization:
+        {
+            const float scale = max_abs > 0.0f ? max_abs / 127.0f : 1.0f;
+            int8_t *q = (int8_t *)code;
+            for (int j = 0; j < emb_len; j++)
+                q[j] = (int8_t)std::clamp((int)lrintf(vec[j] / scale), -127, 127);
+            params[0] = scale;
+        }
+        break;
+    case BinaryQuantization:
+        memset(code, 0, get_code_size(type, emb_len));
+        for (int j = 0; j < emb_len; j++)
+            if (vec[j] > 0.0f) code[j / 8] |= (uint8_t)(1 << (j % 8));
+        break;
     default:
-        CHATLLM_CHECK(false) << "not implemented: " << ds << std::endl;
-        return 0.0;
+        break;
     }
 }
 
@@ -91,33 +442,531 @@ bool is_dist_strategy_max_best(DistanceStrategy ds)
     }
 }
 
+static const char HNSW_FILE_HEADER[] = "CHATLLMHNSW";
+
+struct hnsw_file_header
+{
+    char magic[12];
+    int32_t version;
+    int32_t vec_cmp;
+    int64_t size;
+    int32_t emb_len;
+    int32_t M;
+    int32_t max_level;
+    int32_t entry;
+    // since version 2
+    uint64_t checksum;      // of embeddings, so that an index of another db is rejected
+};
+
+// Hierarchical Navigable Small World graph (Malkov & Yashunin)
+// Distances are "the lower the better".
+class CHNSWIndex
+{
+public:
+    typedef std::pair<float, int32_t> candidate;
+
+    CHNSWIndex(const CVectorStore &store, int M = 16, int ef_construction = 200)
+        : store(store), max_best(is_dist_strategy_max_best(store.vec_cmp)), M(std::max(M, 2)), M0(2 * this->M), ef_construction(std::max(ef_construction, this->M)),
+          size(0), max_level(-1), entry(-1), locks(LOCK_NUM)
+    {
+    }
+
+    void Build(int64_t size, int num_threads)
+    {
+        const double level_mult = 1.0 / log((double)M);
+        std::mt19937 gen(100);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+        this->size = size;
+        max_level = -1;
+        entry = -1;
+        levels.resize(size);
+        links0.assign(size * (M0 + 1), 0);
+        upper.clear();
+        upper.resize(size);
+        for (int64_t i = 0; i < size; i++)
+        {
+            const double r = std::max(uniform(gen), 1e-12);
+            levels[i] = std::min((int)(-log(r) * level_mult), MAX_LEVEL);
+            if (levels[i] > 0)
+                upper[i].assign(levels[i] * (M + 1), 0);
+        }
+
+        printf("building index...\n");
+        std::atomic<int64_t> next(0);
+        std::atomic<int64_t> done(0);
+        auto worker = [&, this](int64_t)
+        {
+            for (int64_t i = next++; i < size; i = next++)
+            {
+                Insert((int32_t)i);
+                const int64_t n = ++done;
+                if ((n % 1000) == 0)
+                {
+                    printf("%8zu / %8zu\r", (size_t)n, (size_t)size);
+                    fflush(stdout);
+                }
+            }
+        };
+
+        if (size > 0) Insert(0);
+        next = 1;
+        if (num_threads > 1)
+            utils::parallel_for(0, num_threads, worker, num_threads);
+        else
+            worker(0);
+        printf("\ndone\n");
+    }
+
+    // returns up to `ef` nearest records, nearest first
+    std::vector<candidate> Search(const float *vec, float vec_norm, int ef) const
+    {
+        std::vector<candidate> r;
+        if (entry < 0) return r;
+
+        int32_t ep = entry;
+        float ep_dist = distance(vec, vec_norm, ep);
+        for (int level = max_level; level > 0; level--)
+            greedy_search(vec, vec_norm, ep, ep_dist, level, false);
+
+        auto found = search_layer(vec, vec_norm, ep, ep_dist, std::max(ef, 1), 0, false);
+        r.reserve(found.size());
+        while (!found.empty())
+        {
+            r.push_back(found.top());
+            found.pop();
+        }
+        std::reverse(r.begin(), r.end());
+        return r;
+    }
+
+    void Save(FILE *f, DistanceStrategy vec_cmp, int emb_len) const
+    {
+        hnsw_file_header header = {};
+        header.version      = 2;
+        header.vec_cmp      = (int32_t)vec_cmp;
+        header.size         = size;
+        header.emb_len      = emb_len;
+        header.M            = M;
+        header.max_level    = max_level;
+        header.entry        = entry;
+        header.checksum     = embeddings_checksum(size);
+        memcpy(header.magic, HNSW_FILE_HEADER, sizeof(header.magic));
+        fwrite(&header, sizeof(header), 1, f);
+        fwrite(levels.data(), sizeof(levels[0]), levels.size(), f);
+        fwrite(links0.data(), sizeof(links0[0]), links0.size(), f);
+        for (int64_t i = 0; i < size; i++)
+            fwrite(upper[i].data(), sizeof(int32_t), upper[i].size(), f);
+    }
+
+    bool Load(FILE *f, DistanceStrategy vec_cmp, int emb_len, int64_t expected_size)
+    {
+        hnsw_file_header header = {};
+        if (fread(&header, sizeof(header), 1, f) < 1) return false;
+        if (memcmp(header.magic, HNSW_FILE_HEADER, sizeof(header.magic))) return false;
+        if ((header.version != 2) || (header.vec_cmp != (int32_t)vec_cmp) || (header.emb_len != emb_len)
+            || (header.size != expected_size) || (header.M < 2) || (header.M > MAX_M)
+            || (header.max_level < 0) || (header.max_level > MAX_LEVEL))
+            return false;
+        if (header.checksum != embeddings_checksum(header.size)) return false;
+
+        M = header.M;
+        M0 = 2 * M;
+        size = header.size;
+        max_level = header.max_level;
+        entry = header.entry;
+
+        levels.resize(size);
+        links0.resize(size * (M0 + 1));
+        upper.clear();
+        upper.resize(size);
+        if (fread(levels.data(), sizeof(levels[0]), size, f) != (size_t)size) return false;
+        if (fread(links0.data(), sizeof(links0[0]), links0.size(), f) != links0.size()) return false;
+        for (int64_t i = 0; i < size; i++)
+        {
+            if ((levels[i] < 0) || (levels[i] > MAX_LEVEL)) return false;
+            if (levels[i] < 1) continue;
+            upper[i].resize(levels[i] * (M + 1));
+            if (fread(upper[i].data(), sizeof(int32_t), upper[i].size(), f) != upper[i].size()) return false;
+        }
+        if ((entry < 0) || (entry >= size) || (levels[entry] != max_level)) return false;
+
+        // a neighbor on a level must exist on that level
+        for (int64_t i = 0; i < size; i++)
+        {
+            for (int level = 0; level <= levels[i]; level++)
+            {
+                const int32_t *links = get_links((int32_t)i, level);
+                if ((links[0] < 0) || (links[0] > max_links(level))) return false;
+                for (int j = 1; j <= links[0]; j++)
+                    if ((links[j] < 0) || (links[j] >= size) || (levels[links[j]] < level)) return false;
+            }
+        }
+        return true;
+    }
+
+protected:
+    typedef std::priority_queue<candidate> max_queue;
+
+    // FNV-1a over 64-bit words
+    uint64_t embeddings_checksum(int64_t count) const
+    {
+        const size_t bytes = (size_t)count * store.emb_len * sizeof(float);
+        const uint8_t *data = (const uint8_t *)store.emb_data;
+        uint64_t h = 0xcbf29ce484222325ull;
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= bytes; i += sizeof(uint64_t))
+        {
+            uint64_t w;
+            memcpy(&w, data + i, sizeof(w));
+            h = (h ^ w) * 0x100000001b3ull;
+        }
+        for (; i < bytes; i++)
+            h = (h ^ data[i]) * 0x100000001b3ull;
+        return h;
+    }
+
+    float distance(const float *vec, float vec_norm, int64_t i) const
+    {
+        const float score = store.Score(vec, vec_norm, i);
+        return max_best ? -score : score;
+    }
+
+    const float *record_vector(int64_t i) const
+    {
+        return store.emb_data + i * store.emb_len;
+    }
+
+    float record_norm(int64_t i) const
+    {
+        return store.vec_cmp == CosineSimilarity ? store.norms[i] : 0.0f;
+    }
+
+    typedef std::priority_queue<candidate, std::vector<candidate>, std::greater<candidate>> min_queue;
+
+    static const int MAX_LEVEL = 16;
+    static const int MAX_M = 1024;
+    static const int LOCK_NUM = 4096;
+
+    // count, then ids
+    int32_t *get_links(int32_t i, int level)
+    {
+        return level == 0 ? links0.data() + (int64_t)i * (M0 + 1) : upper[i].data() + (level - 1) * (M + 1);
+    }
+
+    const int32_t *get_links(int32_t i, int level) const
+    {
+        return level == 0 ? links0.data() + (int64_t)i * (M0 + 1) : upper[i].data() + (level - 1) * (M + 1);
+    }
+
+    int max_links(int level) const
+    {
+        return level == 0 ? M0 : M;
+    }
+
+    // neighbors may be changed by other threads while building
+    void copy_links(int32_t i, int level, std::vector<int32_t> &ids, bool locking) const
+    {
+        std::unique_lock<std::mutex> lock(locks[i % LOCK_NUM], std::defer_lock);
+        if (locking) lock.lock();
+        const int32_t *links = get_links(i, level);
+        ids.assign(links + 1, links + 1 + links[0]);
+    }
+
+    void greedy_search(const float *vec, float vec_norm, int32_t &ep, float &ep_dist, int level, bool locking) const
+    {
+        std::vector<int32_t> ids;
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            copy_links(ep, level, ids, locking);
+            for (auto id : ids)
+            {
+                const float d = distance(vec, vec_norm, id);
+                if (d < ep_dist)
+                {
+                    ep_dist = d;
+                    ep = id;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    struct visited_list
+    {
+        std::vector<uint32_t> tags;
+        uint32_t epoch = 0;
+
+        void reset(int64_t size)
+        {
+            if ((int64_t)tags.size() < size) tags.resize(size, 0);
+            if (++epoch == 0)
+            {
+                std::fill(tags.begin(), tags.end(), 0);
+                epoch = 1;
+            }
+        }
+
+        bool visit(int32_t i)
+        {
+            if (tags[i] == epoch) return false;
+            tags[i] = epoch;
+            return true;
+        }
+    };
+
+    // returns a max queue: the farthest on top
+    max_queue search_layer(const float *vec, float vec_norm, int32_t ep, float ep_dist, int ef, int level, bool locking) const
+    {
+        thread_local visited_list visited;
+        visited.reset(size);
+
+        max_queue results;
+        min_queue candidates;
+        std::vector<int32_t> ids;
+
+        visited.visit(ep);
+        results.emplace(ep_dist, ep);
+        candidates.emplace(ep_dist, ep);
+
+        while (!candidates.empty())
+        {
+            const auto c = candidates.top();
+            if (c.first > results.top().first) break;
+            candidates.pop();
+
+            copy_links(c.second, level, ids, locking);
+            for (auto id : ids)
+            {
+                if (!visited.visit(id)) continue;
+
+                const float d = distance(vec, vec_norm, id);
+                if (((int)results.size() < ef) || (d < results.top().first))
+                {
+                    candidates.emplace(d, id);
+                    results.emplace(d, id);
+                    if ((int)results.size() > ef) results.pop();
+                }
+            }
+        }
+        return results;
+    }
+
+    // keep a candidate only if it's closer to the base than to any selected one
+    std::vector<int32_t> select_neighbors(std::vector<candidate> &sorted, int m) const
+    {
+        std::vector<int32_t> selected;
+        if ((int)sorted.size() <= m)
+        {
+            for (auto &c : sorted) selected.push_back(c.second);
+            return selected;
+        }
+
+        for (auto &c : sorted)
+        {
+            if ((int)selected.size() >= m) break;
+            bool good = true;
+            const float *v = record_vector(c.second);
+            const float n = record_norm(c.second);
+            for (auto id : selected)
+            {
+                if (distance(v, n, id) < c.first)
+                {
+                    good = false;
+                    break;
+                }
+            }
+            if (good) selected.push_back(c.second);
+        }
+        return selected;
+    }
+
+    void set_links(int32_t i, int level, const std::vector<int32_t> &ids)
+    {
+        int32_t *links = get_links(i, level);
+        links[0] = (int32_t)ids.size();
+        std::copy(ids.begin(), ids.end(), links + 1);
+    }
+
+    void add_link(int32_t i, int32_t new_id, int level)
+    {
+        std::lock_guard<std::mutex> lock(locks[i % LOCK_NUM]);
+
+        int32_t *links = get_links(i, level);
+        const int m = max_links(level);
+        if (links[0] < m)
+        {
+            links[1 + links[0]] = new_id;
+            links[0]++;
+            return;
+        }
+
+        const float *v = record_vector(i);
+        const float n = record_norm(i);
+        std::vector<candidate> sorted;
+        sorted.emplace_back(distance(v, n, new_id), new_id);
+        for (int j = 1; j <= links[0]; j++)
+            sorted.emplace_back(distance(v, n, links[j]), links[j]);
+        std::sort(sorted.begin(), sorted.end());
+
+        set_links(i, level, select_neighbors(sorted, m));
+    }
+
+    void Insert(int32_t i)
+    {
+        const int level = levels[i];
+        const float *vec = record_vector(i);
+        const float vec_norm = record_norm(i);
+
+        // the entry point is kept locked when this node becomes the new entry
+        std::unique_lock<std::mutex> entry_guard(entry_lock);
+        if (entry < 0)
+        {
+            entry = i;
+            max_level = level;
+            return;
+        }
+        const int top_level = max_level;
+        int32_t ep = entry;
+        if (level <= top_level) entry_guard.unlock();
+
+        float ep_dist = distance(vec, vec_norm, ep);
+        for (int l = top_level; l > level; l--)
+            greedy_search(vec, vec_norm, ep, ep_dist, l, true);
+
+        for (int l = std::min(level, top_level); l >= 0; l--)
+        {
+            auto found = search_layer(vec, vec_norm, ep, ep_dist, ef_construction, l, true);
+            std::vector<candidate> sorted;
+            while (!found.empty())
+            {
+                sorted.push_back(found.top());
+                found.pop();
+            }
+            std::reverse(sorted.begin(), sorted.end());
+
+            auto neighbors = select_neighbors(sorted, M);
+            {
+                std::lock_guard<std::mutex> lock(locks[i % LOCK_NUM]);
+                set_links(i, l, neighbors);
+            }
+            for (auto n : neighbors)
+                add_link(n, i, l);
+
+            ep      = sorted[0].second;
+            ep_dist = sorted[0].first;
+        }
+
+        if (level > top_level)
+        {
+            entry = i;
+            max_level = level;
+        }
+    }
+
+    const CVectorStore &store;
+    const bool max_best;
+    int M;
+    int M0;
+    int ef_construction;
+    int64_t size;
+    int max_level;
+    int32_t entry;
+    std::vector<int32_t> levels;
+    std::vector<int32_t> links0;
+    std::vector<std::vector<int32_t>> upper;
+    mutable std::vector<std::mutex> locks;
+    std::mutex entry_lock;
+};
+
+// the graph finds nearest neighbors, which are not the top ranked ones when
+// smaller inner products (similarities) rank higher.
+static bool is_index_supported(DistanceStrategy ds)
+{
+    return (ds == EuclideanDistance) || is_dist_strategy_max_best(ds);
+}
+
+static std::string get_index_file_name(const std::string &db_fn, VectorIndexType type)
+{
+    switch (type)
+    {
+    case HNSWIndex:
+        return db_fn + ".hnsw";
+    default:
+        return "";
+    }
+}
+
 CVectorStore::CVectorStore(DistanceStrategy vec_cmp, int emb_len,
     std::function<void (const std::string &, float *)> text_emb, const char *fn)
-    : vec_cmp(vec_cmp), emb_len(emb_len)
+    : vec_cmp(vec_cmp), emb_len(emb_len), num_threads(0), num_records(0), emb_data(nullptr),
+      quant_type(NoQuantization), rescore_factor(0), code_size(0), num_codes(0), codes(nullptr), code_params(nullptr),
+      index_type(FlatIndex)
 {
-    FromPlainData(text_emb, fn);
-    embeddings.resize(GetSize() * emb_len);
+    FromPlainData(fn);
+    float *emb = AppendEmbeddings(contents.size());
+    AddRecords(
+        {
+            .first          = 0,
+            .size           = (int64_t)contents.size(),
+            .offset         = 0,
+            .file           = nullptr,
+            .string_offsets = nullptr,
+            .strings        = nullptr,
+            .strings_size   = 0,
+        });
     printf("ingesting...\n");
     for (size_t i = 0; i < GetSize(); i++)
     {
-        text_emb(contents[i], embeddings.data() + i * emb_len);
+        text_emb(contents[i], emb + i * emb_len);
         printf("%8zu / %8zu\r", i, GetSize());
         fflush(stdout);
     }
     printf("\ndone\n");
+    PrepareNorms();
+}
+
+CVectorStore::CVectorStore(DistanceStrategy vec_cmp, int emb_len,
+    std::function<void (const std::vector<std::string> &, float *)> texts_emb, const char *fn)
+    : vec_cmp(vec_cmp), emb_len(emb_len), num_threads(0), num_records(0), emb_data(nullptr),
+      quant_type(NoQuantization), rescore_factor(0), code_size(0), num_codes(0), codes(nullptr), code_params(nullptr),
+      index_type(FlatIndex)
+{
+    FromPlainData(fn);
+    float *emb = AppendEmbeddings(contents.size());
+    AddRecords(
+        {
+            .first          = 0,
+            .size           = (int64_t)contents.size(),
+            .offset         = 0,
+            .file           = nullptr,
+            .string_offsets = nullptr,
+            .strings        = nullptr,
+            .strings_size   = 0,
+        });
+    texts_emb(contents, emb);
+    PrepareNorms();
 }
 
 CVectorStore::CVectorStore(DistanceStrategy vec_cmp, const char *fn)
-    : vec_cmp(vec_cmp), emb_len(0)
+    : vec_cmp(vec_cmp), emb_len(0), num_threads(0), num_records(0), emb_data(nullptr),
+      quant_type(NoQuantization), rescore_factor(0), code_size(0), num_codes(0), codes(nullptr), code_params(nullptr),
+      index_type(FlatIndex)
 {
     LoadDB(fn);
+    PrepareNorms();
 }
 
 CVectorStore::CVectorStore(DistanceStrategy vec_cmp, const std::vector<std::string> &files)
-    : vec_cmp(vec_cmp), emb_len(0)
+    : vec_cmp(vec_cmp), emb_len(0), num_threads(0), num_records(0), emb_data(nullptr),
+      quant_type(NoQuantization), rescore_factor(0), code_size(0), num_codes(0), codes(nullptr), code_params(nullptr),
+      index_type(FlatIndex)
 {
     for (auto fn : files)
         LoadDB(fn.c_str());
+    PrepareNorms();
 }
 
 namespace base64
@@ -215,7 +1064,7 @@ namespace base64
     }
 }
 
-void CVectorStore::FromPlainData(std::function<void (const std::string &, float *)> text_emb, const char *fn)
+void CVectorStore::FromPlainData(const char *fn)
 {
     std::ifstream f(fn);
     std::string lines[2];
@@ -243,13 +1092,6 @@ void CVectorStore::FromPlainData(std::function<void (const std::string &, float
     f.close();
 }
 
-static void write_string(FILE *f, const std::string s)
-{
-    uint32_t len = (uint32_t)s.size();
-    fwrite(&len, sizeof(len), 1, f);
-    fwrite(s.data(), 1, len, f);
-}
-
 static bool read_string(FILE *f, std::string &s)
 {
     uint32_t len = 0;
@@ -258,7 +1100,102 @@ static bool read_string(FILE *f, std::string &s)
     return fread(s.data(), 1, len, f) == len;
 }
 
+float *CVectorStore::AppendEmbeddings(size_t n)
+{
+    // embeddings in a mapped db file can't be extended
+    if (emb_data != embeddings.data())
+        embeddings.assign(emb_data, emb_data + num_records * emb_len);
+
+    embeddings.resize((num_records + n) * emb_len);
+    emb_data = embeddings.data();
+    return embeddings.data() + num_records * emb_len;
+}
+
+void CVectorStore::AddRecords(const RecordSource &source)
+{
+    sources.push_back(source);
+    sources.back().first = (int64_t)num_records;
+    num_records += source.size;
+}
+
 void CVectorStore::LoadDB(const char *fn)
+{
+    auto file = std::make_shared<CMappedFile>(fn);
+
+    if ((file->size >= VS_FILE_HEADER_V2_SIZE) && (memcmp(file->data, VS_FILE_HEADER_V2, sizeof(VS_FILE_HEADER_V2)) == 0))
+        LoadMappedDB(fn, file);
+    else
+        LoadLegacyDB(fn);
+
+    db_files.push_back(fn);
+}
+
+void CVectorStore::LoadMappedDB(const char *fn, std::shared_ptr<CMappedFile> file)
+{
+    file_header_v2 header = {};
+    memcpy(&header, file->data, VS_FILE_HEADER_V2_SIZE);
+
+    CHATLLM_CHECK((header.version == 2) || (header.version == 3)) << "unsupported db version: " << header.version;
+    if (header.version >= 3)
+    {
+        CHATLLM_CHECK(file->size >= sizeof(header)) << "LoadDB failed: " << fn;
+        memcpy(&header, file->data, sizeof(header));
+    }
+
+    if (emb_len == 0)
+        emb_len = (int)header.emb_len;
+
+    CHATLLM_CHECK(emb_len == (int)header.emb_len) << "embedding length must match: " << header.emb_len << " vs " << emb_len;
+
+    const uint64_t emb_bytes = header.size * header.emb_len * sizeof(float);
+    const uint64_t offsets_bytes = (2 * header.size + 1) * sizeof(uint64_t);
+    CHATLLM_CHECK((header.embeddings_offset % VS_EMB_ALIGNMENT == 0)
+                  && (header.embeddings_offset + emb_bytes <= file->size)
+                  && (header.strings_offset + header.strings_size <= file->size)
+                  && (header.offsets_offset % sizeof(uint64_t) == 0)
+                  && (header.offsets_offset + offsets_bytes <= file->size)) << "LoadDB failed: " << fn;
+
+    // string offsets are validated once here, and trusted by `GetRecord`
+    const uint64_t *string_offsets = (const uint64_t *)(file->data + header.offsets_offset);
+    for (uint64_t i = 0; i < 2 * header.size; i++)
+        CHATLLM_CHECK(string_offsets[i] <= string_offsets[i + 1]) << "LoadDB failed: " << fn;
+    CHATLLM_CHECK(string_offsets[2 * header.size] <= header.strings_size) << "LoadDB failed: " << fn;
+
+    const float *emb = (const float *)(file->data + header.embeddings_offset);
+    if (num_records == 0)
+        emb_data = emb;
+    else
+        memcpy(AppendEmbeddings(header.size), emb, emb_bytes);
+
+    // quantized embeddings of the first file are used in place. those of others are rebuilt.
+    if ((num_records == 0) && (header.quantization != NoQuantization))
+    {
+        const VectorQuantization type = (VectorQuantization)header.quantization;
+        CHATLLM_CHECK((header.code_size == get_code_size(type, emb_len))
+                      && (header.codes_offset % VS_EMB_ALIGNMENT == 0)
+                      && (header.codes_offset + header.size * header.code_size <= file->size)
+                      && (header.code_params_offset % sizeof(float) == 0)
+                      && (header.code_params_offset + header.size * 2 * sizeof(float) <= file->size)) << "LoadDB failed: " << fn;
+        quant_type  = type;
+        code_size   = header.code_size;
+        num_codes   = header.size;
+        codes       = (const uint8_t *)(file->data + header.codes_offset);
+        code_params = (const float *)(file->data + header.code_params_offset);
+    }
+
+    AddRecords(
+        {
+            .first          = 0,
+            .size           = (int64_t)header.size,
+            .offset         = 0,
+            .file           = file,
+            .string_offsets = string_offsets,
+            .strings        = file->data + header.strings_offset,
+            .strings_size   = header.strings_size,
+        });
+}
+
+void CVectorStore::LoadLegacyDB(const char *fn)
 {
     bool flag = false;
     size_t old_size = contents.size();
@@ -291,72 +1228,501 @@ void CVectorStore::LoadDB(const char *fn)
         metadata.push_back(m);
     }
 
-    embeddings.resize((old_size + header.size) * emb_len);
-    if (fread(embeddings.data() + old_size * emb_len, emb_len * sizeof(float), header.size, f) != header.size)
+    if (fread(AppendEmbeddings(header.size), emb_len * sizeof(float), header.size, f) != header.size)
         goto cleanup;
 
+    AddRecords(
+        {
+            .first          = 0,
+            .size           = (int64_t)header.size,
+            .offset         = (int64_t)old_size,
+            .file           = nullptr,
+            .string_offsets = nullptr,
+            .strings        = nullptr,
+            .strings_size   = 0,
+        });
+
     flag = true;
 
 cleanup:
     fclose(f);
 
-    CHATLLM_CHECK(flag) << "LoadDB failed";
+    CHATLLM_CHECK(flag) << "LoadDB failed: " << fn;
+}
+
+static uint64_t write_padding(FILE *f, uint64_t pos, uint64_t alignment)
+{
+    static const char zeros[VS_EMB_ALIGNMENT] = {0};
+    const uint64_t padding = (alignment - pos % alignment) % alignment;
+    fwrite(zeros, 1, padding, f);
+    return pos + padding;
 }
 
 void CVectorStore::ExportDB(const char *fn)
 {
+    for (auto &db : db_files)
+        CHATLLM_CHECK(db != fn) << "can not export to a loaded db file: " << fn;
+
     FILE *f = fopen(fn, "wb");
+    CHATLLM_CHECK(f != nullptr) << "can not write db file: " << fn;
 
-    file_header header =
-    {
-        .magic = 0,
-        .emb_len = (size_t)emb_len,
-        .size = GetSize(),
-    };
-    memcpy(header.magic, VS_FILE_HEADER, sizeof(header.magic));
+    if ((quant_type != NoQuantization) && (num_codes != GetSize()))
+        BuildQuantization();
+
+    file_header_v2 header = {};
+    header.version      = 3;
+    header.emb_len      = (uint64_t)emb_len;
+    header.size         = GetSize();
+    header.quantization = (uint32_t)quant_type;
+    header.code_size    = (uint32_t)code_size;
+    memcpy(header.magic, VS_FILE_HEADER_V2, sizeof(VS_FILE_HEADER_V2));
+
+    // header is rewritten when all offsets are known
     fwrite(&header, sizeof(header), 1, f);
+    uint64_t pos = write_padding(f, sizeof(header), VS_EMB_ALIGNMENT);
+
+    header.embeddings_offset = pos;
+    fwrite(emb_data, sizeof(float), GetSize() * emb_len, f);
+    pos += GetSize() * emb_len * sizeof(float);
+
+    if (quant_type != NoQuantization)
+    {
+        pos = write_padding(f, pos, VS_EMB_ALIGNMENT);
+        header.codes_offset = pos;
+        fwrite(codes, code_size, GetSize(), f);
+        pos += GetSize() * code_size;
+
+        pos = write_padding(f, pos, sizeof(float));
+        header.code_params_offset = pos;
+        fwrite(code_params, 2 * sizeof(float), GetSize(), f);
+        pos += GetSize() * 2 * sizeof(float);
+    }
+
+    std::vector<uint64_t> offsets;
+    offsets.reserve(2 * GetSize() + 1);
+    offsets.push_back(0);
+    header.strings_offset = pos;
     for (size_t i = 0; i < GetSize(); i++)
     {
-        write_string(f, contents[i]);
-        write_string(f, metadata[i]);
+        std::string c, m;
+        GetRecord(i, c, m);
+        fwrite(c.data(), 1, c.size(), f);
+        offsets.push_back(offsets.back() + c.size());
+        fwrite(m.data(), 1, m.size(), f);
+        offsets.push_back(offsets.back() + m.size());
     }
+    header.strings_size = offsets.back();
+    pos = write_padding(f, pos + header.strings_size, sizeof(uint64_t));
 
-    fwrite(embeddings.data(), sizeof(float), GetSize() * emb_len, f);
+    header.offsets_offset = pos;
+    fwrite(offsets.data(), sizeof(offsets[0]), offsets.size(), f);
+
+    fseek(f, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, f);
 
     fclose(f);
+
+    if (index)
+    {
+        const std::string index_fn = get_index_file_name(fn, index_type);
+        f = fopen(index_fn.c_str(), "wb");
+        CHATLLM_CHECK(f != nullptr) << "can not write index file: " << index_fn;
+        index->Save(f, vec_cmp, emb_len);
+        fclose(f);
+    }
 }
 
-// TODO: use GGML to accelerate.
-void CVectorStore::Query(const text_vector &vec, std::vector<int64_t> &indices, int top_n)
+void CVectorStore::SetThreads(int n)
+{
+    num_threads = n;
+}
+
+int CVectorStore::GetThreads(void) const
+{
+    int n = num_threads > 0 ? num_threads : (int)std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+// norms are computed when records are loaded, so that `Query` only reads them and can be called concurrently
+void CVectorStore::PrepareNorms(void)
 {
-    std::vector<float> scores;
-    const float *emb = embeddings.data();
+    if ((vec_cmp != CosineSimilarity) || (norms.size() == GetSize())) return;
+
+    const auto &kernels = get_vector_kernels();
+    const size_t old_size = norms.size();
+    norms.resize(GetSize());
+    for (size_t i = old_size; i < norms.size(); i++)
+    {
+        // saved norms spare reading all embeddings
+        if (i < num_codes)
+        {
+            norms[i] = code_params[2 * i + 1];
+            continue;
+        }
+        const float *emb = emb_data + i * emb_len;
+        norms[i] = sqrtf(kernels.inner_product(emb, emb, emb_len));
+    }
+}
 
+float CVectorStore::VectorNorm(const float *vec) const
+{
+    if (vec_cmp != CosineSimilarity) return 0.0f;
+    return sqrtf(get_vector_kernels().inner_product(vec, vec, emb_len));
+}
+
+float CVectorStore::Score(const float *vec, float vec_norm, int64_t i) const
+{
+    const auto &kernels = get_vector_kernels();
+    const float *emb = emb_data + i * emb_len;
+    switch (vec_cmp)
+    {
+    case EuclideanDistance:
+        // ordering by squared distance is the same
+        return kernels.squared_distance(vec, emb, emb_len);
+    case MaxInnerProduct:
+    case InnerProduct:
+        return kernels.inner_product(vec, emb, emb_len);
+    case CosineSimilarity:
+        return kernels.inner_product(vec, emb, emb_len) / (vec_norm * norms[i] + 1e-6f);
+    default:
+        CHATLLM_CHECK(false) << "not implemented: " << vec_cmp << std::endl;
+        return 0.0f;
+    }
+}
+
+void CVectorStore::Query(const text_vector &vec, std::vector<int64_t> &indices, int top_n)
+{
     CHATLLM_CHECK(vec.size() == (size_t)emb_len) << "embedding length must match: " << vec.size() << " vs " << emb_len;
 
-    for (size_t i = 0; i < GetSize(); i++, emb += emb_len)
-        scores.push_back(vector_measure(vec_cmp, vec.data(), emb, emb_len));
+    std::vector<std::vector<int64_t>> results;
+    Query(vec.data(), 1, results, top_n);
+    indices.insert(indices.end(), results[0].begin(), results[0].end());
+}
 
-    std::vector<size_t> order;
-    utils::ordering(scores, order, is_dist_strategy_max_best(vec_cmp));
+namespace
+{
+    struct scored_record
+    {
+        float score;
+        int64_t index;
+    };
+
+    // records are compared by score, then by index (as a stable sort would do)
+    struct record_order
+    {
+        bool max_best;
+
+        bool better(const scored_record &a, const scored_record &b) const
+        {
+            if (a.score != b.score)
+                return max_best ? a.score > b.score : a.score < b.score;
+            return a.index < b.index;
+        }
+
+        // for heaps: the worst record is on top
+        bool operator()(const scored_record &a, const scored_record &b) const
+        {
+            return better(a, b);
+        }
+    };
+
+    // bounded heap keeping the best `capacity` records
+    class top_k_heap
+    {
+    public:
+        top_k_heap(const record_order &order, int capacity) : order(order), capacity(capacity) {}
+
+        void push(const scored_record &r)
+        {
+            if ((int)items.size() < capacity)
+            {
+                items.push_back(r);
+                std::push_heap(items.begin(), items.end(), order);
+            }
+            else if (order.better(r, items.front()))
+            {
+                std::pop_heap(items.begin(), items.end(), order);
+                items.back() = r;
+                std::push_heap(items.begin(), items.end(), order);
+            }
+        }
+
+        std::vector<scored_record> items;
+
+    protected:
+        record_order order;
+        int capacity;
+    };
+}
+
+CVectorStore::~CVectorStore()
+{
+}
+
+void CVectorStore::SetIndex(VectorIndexType type, const ANNParams &params)
+{
+    index_type = type;
+    ann_params = params;
+    index.reset();
+
+    if ((type == FlatIndex) || ((int64_t)GetSize() < params.min_size)) return;
+    if (!is_index_supported(vec_cmp))
+    {
+        printf("index is not supported for distance strategy %d, fallback to exhaustive search\n", vec_cmp);
+        return;
+    }
+
+    index.reset(new CHNSWIndex(*this, params.M, params.ef_construction));
+
+    if (db_files.size() == 1)
+    {
+        const std::string fn = get_index_file_name(db_files[0], type);
+        FILE *f = fopen(fn.c_str(), "rb");
+        if (f)
+        {
+            const bool loaded = index->Load(f, vec_cmp, emb_len, (int64_t)GetSize());
+            fclose(f);
+            if (loaded) return;
+            printf("index file %s is invalid, rebuilding...\n", fn.c_str());
+        }
+    }
+
+    index->Build((int64_t)GetSize(), GetThreads());
+}
+
+// top-k of each query, best first
+template <class F> static void scan_top_k(int64_t size, int num, int top_n, int n_threads, const record_order &order,
+    F score, std::vector<std::vector<scored_record>> &results)
+{
+    // records are scanned in blocks, so that a block is reused by all queries while it's in cache
+    const int64_t BLOCK_SIZE = 16;
+    // below this many distance evaluations, threads cost more than they save
+    const int64_t MIN_WORK_PER_THREAD = 16384;
+
+    const int64_t max_threads = std::max((int64_t)1, size * num / MIN_WORK_PER_THREAD);
+    if (n_threads > max_threads) n_threads = (int)max_threads;
+
+    const int64_t num_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    const int64_t blocks_per_thread = (num_blocks + n_threads - 1) / n_threads;
+
+    // per thread & per query partial top-k
+    std::vector<std::vector<top_k_heap>> partial(n_threads);
+
+    auto scan = [&](int64_t t)
+    {
+        auto &heaps = partial[t];
+        for (int q = 0; q < num; q++)
+            heaps.emplace_back(order, top_n);
+
+        const int64_t start = std::min(t * blocks_per_thread * BLOCK_SIZE, size);
+        const int64_t end   = std::min(start + blocks_per_thread * BLOCK_SIZE, size);
+
+        for (int64_t block = start; block < end; block += BLOCK_SIZE)
+        {
+            const int64_t block_end = std::min(block + BLOCK_SIZE, end);
+            for (int q = 0; q < num; q++)
+            {
+                for (int64_t i = block; i < block_end; i++)
+                    heaps[q].push({score(q, i), i});
+            }
+        }
+    };
+
+    if (n_threads > 1)
+        utils::parallel_for(0, n_threads, scan, n_threads);
+    else
+        scan(0);
+
+    results.resize(num);
+    for (int q = 0; q < num; q++)
+    {
+        top_k_heap merged(order, top_n);
+        for (auto &heaps : partial)
+            for (auto &r : heaps[q].items)
+                merged.push(r);
+
+        results[q] = std::move(merged.items);
+        std::sort(results[q].begin(), results[q].end(), [&order](const scored_record &a, const scored_record &b) { return order.better(a, b); });
+    }
+}
+
+void CVectorStore::SetQuantization(const QuantParams &params)
+{
+    rescore_factor = params.rescore_factor;
+    if (!params.override) return;
 
-    if (top_n > (int)order.size()) top_n = (int)order.size();
+    if (params.type != quant_type)
+    {
+        quant_type = params.type;
+        num_codes = 0;
+    }
+
+    if ((quant_type != NoQuantization) && (num_codes != GetSize()))
+        BuildQuantization();
+}
+
+void CVectorStore::BuildQuantization(void)
+{
+    code_size = get_code_size(quant_type, emb_len);
+    owned_codes.resize(GetSize() * code_size);
+    owned_code_params.resize(GetSize() * 2);
+
+    utils::parallel_for(0, (int64_t)GetSize(), [this](int64_t i)
+        {
+            quantize_vector(quant_type, emb_data + i * emb_len, emb_len, owned_codes.data() + i * code_size, owned_code_params.data() + i * 2);
+        }, GetThreads());
+
+    codes       = owned_codes.data();
+    code_params = owned_code_params.data();
+    num_codes   = GetSize();
+}
+
+void CVectorStore::QueryQuantized(const float *vecs, int num, std::vector<std::vector<int64_t>> &indices, int top_n)
+{
+    const int64_t size = (int64_t)GetSize();
+    const record_order order{is_dist_strategy_max_best(vec_cmp)};
+    const auto &kernels = get_vector_kernels();
+
+    int factor = rescore_factor > 0 ? rescore_factor : (quant_type == BinaryQuantization ? 16 : 4);
+    const int num_candidates = (int)std::min(size, (int64_t)top_n * factor);
+
+    std::vector<uint8_t> query_codes(num * code_size);
+    std::vector<float>   query_params(num * 2);
+    for (int q = 0; q < num; q++)
+        quantize_vector(quant_type, vecs + (size_t)q * emb_len, emb_len, query_codes.data() + q * code_size, query_params.data() + q * 2);
+
+    // candidates: the lower, the better
+    std::vector<std::vector<scored_record>> candidates;
+    if (quant_type == Int8Quantization)
+    {
+        scan_top_k(size, num, num_candidates, GetThreads(), record_order{false}, [&, this](int q, int64_t i)
+            {
+                const float *qp = query_params.data() + q * 2;
+                const float *xp = code_params + i * 2;
+                const float dot = kernels.int8_inner_product((const int8_t *)query_codes.data() + q * code_size,
+                                                             (const int8_t *)codes + i * code_size, emb_len) * qp[0] * xp[0];
+                switch (vec_cmp)
+                {
+                case EuclideanDistance:
+                    return qp[1] * qp[1] + xp[1] * xp[1] - 2 * dot;
+                case CosineSimilarity:
+                    return dot / (qp[1] * xp[1] + 1e-6f);
+                default:
+                    return order.max_best ? -dot : dot;
+                }
+            }, candidates);
+    }
+    else
+    {
+        // fewer different bits, closer; unless smaller similarities rank higher
+        const bool fewer_better = order.max_best || (vec_cmp == EuclideanDistance);
+        const int words = (int)(code_size / sizeof(uint64_t));
+        scan_top_k(size, num, num_candidates, GetThreads(), record_order{false}, [&, this](int q, int64_t i)
+            {
+                const int d = vector_hamming_distance((const uint64_t *)(query_codes.data() + q * code_size),
+                                                      (const uint64_t *)(codes + i * code_size), words);
+                return (float)(fewer_better ? d : -d);
+            }, candidates);
+    }
 
-    for (int i = 0; i < top_n; i++)
-        indices.push_back(order[i]);
+    // rescore in full precision
+    for (int q = 0; q < num; q++)
+    {
+        const float *vec = vecs + (size_t)q * emb_len;
+        const float vec_norm = query_params[q * 2 + 1];
+        top_k_heap heap(order, top_n);
+        for (auto &c : candidates[q])
+            heap.push({Score(vec, vec_norm, c.index), c.index});
+
+        auto &items = heap.items;
+        std::sort(items.begin(), items.end(), [&order](const scored_record &a, const scored_record &b) { return order.better(a, b); });
+        for (auto &r : items)
+            indices[q].push_back(r.index);
+    }
+}
+
+void CVectorStore::Query(const float *vecs, int num, std::vector<std::vector<int64_t>> &indices, int top_n)
+{
+    indices.clear();
+    indices.resize(num > 0 ? num : 0);
+
+    const int64_t size = (int64_t)GetSize();
+    if ((num < 1) || (top_n < 1) || (size < 1)) return;
+    if (top_n > size) top_n = (int)size;
+
+    const record_order order{is_dist_strategy_max_best(vec_cmp)};
+
+    std::vector<float> query_norms;
+    for (int q = 0; q < num; q++)
+        query_norms.push_back(VectorNorm(vecs + (size_t)q * emb_len));
+
+    const int n_threads = GetThreads();
+
+    if (index && (size >= ann_params.min_size))
+    {
+        auto search = [&, this](int64_t q)
+        {
+            auto found = index->Search(vecs + (size_t)q * emb_len, query_norms[q], std::max(ann_params.ef_search, top_n));
+            top_k_heap heap(order, top_n);
+            for (auto &c : found)
+                heap.push({order.max_best ? -c.first : c.first, c.second});
+
+            auto &items = heap.items;
+            std::sort(items.begin(), items.end(), [&order](const scored_record &a, const scored_record &b) { return order.better(a, b); });
+            for (auto &r : items)
+                indices[q].push_back(r.index);
+        };
+
+        if ((num > 1) && (n_threads > 1))
+            utils::parallel_for(0, num, search, std::min(n_threads, num));
+        else
+            for (int q = 0; q < num; q++) search(q);
+        return;
+    }
+
+    if (quant_type != NoQuantization)
+    {
+        if (num_codes != GetSize())
+            BuildQuantization();
+        QueryQuantized(vecs, num, indices, top_n);
+        return;
+    }
+
+    std::vector<std::vector<scored_record>> results;
+    scan_top_k(size, num, top_n, n_threads, order, [&, this](int q, int64_t i)
+        {
+            return Score(vecs + (size_t)q * emb_len, query_norms[q], i);
+        }, results);
+
+    for (int q = 0; q < num; q++)
+        for (auto &r : results[q])
+            indices[q].push_back(r.index);
 }
 
 size_t CVectorStore::GetSize(void)
 {
-    return contents.size();
+    return num_records;
 }
 
 bool CVectorStore::GetRecord(int64_t index, std::string &content, std::string &meta)
 {
     if (index < 0) return false;
     if ((size_t)index >= GetSize()) return false;
-    content = contents[index];
-    meta = metadata[index];
+
+    auto source = std::upper_bound(sources.begin(), sources.end(), index,
+        [](int64_t i, const RecordSource &s) { return i < s.first; }) - 1;
+    const int64_t i = index - source->first;
+
+    if (source->file == nullptr)
+    {
+        content = contents[source->offset + i];
+        meta = metadata[source->offset + i];
+        return true;
+    }
+
+    const uint64_t *offsets = source->string_offsets + 2 * i;
+    content.assign(source->strings + offsets[0], offsets[1] - offsets[0]);
+    meta.assign(source->strings + offsets[1], offsets[2] - offsets[1]);
     return true;
 }
 
@@ -372,6 +1738,39 @@ DistanceStrategy ParseDistanceStrategy(const char *s)
     else return DistanceStrategy::EuclideanDistance;
 }
 
+VectorIndexType ParseVectorIndexType(const char *s)
+{
+    if (strcasecmp(s, "hnsw") == 0) return VectorIndexType::HNSWIndex;
+    return VectorIndexType::FlatIndex;
+}
+
+VectorQuantization ParseVectorQuantization(const char *s)
+{
+    if (strcasecmp(s, "int8") == 0) return VectorQuantization::Int8Quantization;
+    if (strcasecmp(s, "binary") == 0) return VectorQuantization::BinaryQuantization;
+    return VectorQuantization::NoQuantization;
+}
+
+QuantParams ParseQuantParams(const std::map<std::string, std::string> &options)
+{
+    QuantParams params;
+    const std::string type = utils::get_opt(options, "vs_quant", "");
+    params.override         = type.size() > 0;
+    params.type             = ParseVectorQuantization(type.c_str());
+    params.rescore_factor   = utils::get_opt(options, "vs_rescore_factor", params.rescore_factor);
+    return params;
+}
+
+ANNParams ParseANNParams(const std::map<std::string, std::string> &options)
+{
+    ANNParams params;
+    params.M                = utils::get_opt(options, "hnsw_m",                 params.M);
+    params.ef_construction  = utils::get_opt(options, "hnsw_ef_construction",   params.ef_construction);
+    params.ef_search        = utils::get_opt(options, "hnsw_ef_search",         params.ef_search);
+    params.min_size         = utils::get_opt(options, "ann_min_size",           params.min_size);
+    return params;
+}
+
 namespace utils
 {
     std::string trim(const std::string& str)
@@ -5,6 +5,8 @@
 #include <functional>
 #include <algorithm>
 #include <cstdint>
+#include <map>
+#include <memory>
 
 typedef std::vector<float> text_vector;
 
@@ -18,32 +20,141 @@ enum DistanceStrategy
 
 DistanceStrategy ParseDistanceStrategy(const char *s);
 
+enum VectorIndexType
+{
+    FlatIndex,          // exhaustive search
+    HNSWIndex,
+};
+
+VectorIndexType ParseVectorIndexType(const char *s);
+
+struct ANNParams
+{
+    int M               = 16;       // max links per node (doubled on the bottom layer)
+    int ef_construction = 200;      // candidate list size when building: higher recall, slower build
+    int ef_search       = 128;      // candidate list size when querying: higher recall, slower query
+    int min_size        = 10000;    // smaller stores are always searched exhaustively
+};
+
+// options: hnsw_m, hnsw_ef_construction, hnsw_ef_search, ann_min_size
+ANNParams ParseANNParams(const std::map<std::string, std::string> &options);
+
+enum VectorQuantization
+{
+    NoQuantization,
+    Int8Quantization,       // int8 with a scale per vector
+    BinaryQuantization,     // sign bits
+};
+
+VectorQuantization ParseVectorQuantization(const char *s);
+
+struct QuantParams
+{
+    bool override               = false;    // false: keep the quantization saved in the db file
+    VectorQuantization type     = NoQuantization;
+    int rescore_factor          = 0;        // top_n * rescore_factor candidates are rescored in full precision, 0: default
+};
+
+// options: vs_quant (none | int8 | binary), vs_rescore_factor
+QuantParams ParseQuantParams(const std::map<std::string, std::string> &options);
+
+class CHNSWIndex;
+class CMappedFile;
+
 class CVectorStore
 {
 public:
     CVectorStore(DistanceStrategy vec_cmp, int emb_len,
                 std::function<void (const std::string &, float *)> text_emb, const char *fn);
 
+    // `texts_emb`: embeds all texts at once, embedding of texts[i] goes to `emb + i * emb_len`
+    CVectorStore(DistanceStrategy vec_cmp, int emb_len,
+                std::function<void (const std::vector<std::string> &, float *)> texts_emb, const char *fn);
+
     CVectorStore(DistanceStrategy vec_cmp, const char *fn);
     CVectorStore(DistanceStrategy vec_cmp, const std::vector<std::string> &files);
 
+    ~CVectorStore();
+
+    // db files are saved in the columnar layout (version 3, or 2 without quantized embeddings), which is loaded by mapping:
+    // embeddings are used in place when there is only one db file, and
+    // contents & metadata are fetched lazily by `GetRecord`.
+    // the legacy layout (version 1) is still loadable.
+
+    // the index is saved next to the db file by `ExportDB`.
+    // when the store is loaded from a single db file, a saved index is loaded, otherwise it's built.
+    void SetIndex(VectorIndexType type, const ANNParams &params = ANNParams());
+
+    // without an index, quantized embeddings are scanned to find candidates, which are then rescored.
+    // quantized embeddings are saved into the db file by `ExportDB`.
+    void SetQuantization(const QuantParams &params);
+
     void ExportDB(const char *fn);
 
     void Query(const text_vector &vec, std::vector<int64_t> &indices, int top_n = 20);
 
+    // `vecs`: `num` query vectors one after another, top-n of `vecs + i * emb_len` goes to `indices[i]`
+    void Query(const float *vecs, int num, std::vector<std::vector<int64_t>> &indices, int top_n = 20);
+
+    // 0: use all hardware threads
+    void SetThreads(int n);
+
     size_t GetSize(void);
 
     bool GetRecord(int64_t index, std::string &content, std::string &meta);
 
 protected:
-    void Clear();
-    void FromPlainData(std::function<void (const std::string &, float *)> text_emb, const char *fn);
+    // records [first, first + size) are in `contents` & `metadata` starting from `offset`,
+    // or in a mapped db file (`file` is not null)
+    struct RecordSource
+    {
+        int64_t first;
+        int64_t size;
+        int64_t offset;
+        std::shared_ptr<CMappedFile> file;
+        const uint64_t *string_offsets;
+        const char *strings;
+        uint64_t strings_size;
+    };
+
+    void FromPlainData(const char *fn);
     void LoadDB(const char *fn);
+    void LoadLegacyDB(const char *fn);
+    void LoadMappedDB(const char *fn, std::shared_ptr<CMappedFile> file);
+    float *AppendEmbeddings(size_t n);
+    void BuildQuantization(void);
+    void QueryQuantized(const float *vecs, int num, std::vector<std::vector<int64_t>> &indices, int top_n);
+    void AddRecords(const RecordSource &source);
+    void PrepareNorms(void);
+    int GetThreads(void) const;
+    float VectorNorm(const float *vec) const;
+    float Score(const float *vec, float vec_norm, int64_t i) const;
+
+    friend class CHNSWIndex;
 
     DistanceStrategy vec_cmp;
     int emb_len;
+    int num_threads;
 
+    size_t num_records;
+    std::vector<RecordSource> sources;
     std::vector<std::string> contents;
     std::vector<std::string> metadata;
     std::vector<float> embeddings;
+    const float *emb_data;          // `embeddings`, or a mapped db file
+
+    VectorQuantization quant_type;
+    int rescore_factor;
+    size_t code_size;               // bytes per record
+    size_t num_codes;               // codes are rebuilt when records are added
+    std::vector<uint8_t> owned_codes;
+    std::vector<float> owned_code_params;
+    const uint8_t *codes;           // `owned_codes`, or a mapped db file
+    const float *code_params;       // per record: scale (int8) & norm
+    std::vector<float> norms;       // for CosineSimilarity
+    std::vector<std::string> db_files;
+
+    VectorIndexType index_type;
+    ANNParams ann_params;
+    std::unique_ptr<CHNSWIndex> index;
 };
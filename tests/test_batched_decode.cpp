@@ -0,0 +1,87 @@
+// sequences decoded together in KV slots must give the same tokens as each decoded alone,
+// while they are at different positions (`n_past`) within a decoding batch.
+
+#include "test_utils.h"
+
+#include <filesystem>
+
+using namespace chatllm;
+
+static const int MAX_LENGTH = 128;
+static const int NEW_TOKENS = 8;
+
+class TokenCollector : public BaseStreamer
+{
+public:
+    TokenCollector() : BaseStreamer(nullptr) {}
+    void put(const std::vector<int> &output_ids) override
+    {
+        ids.insert(ids.end(), output_ids.begin(), output_ids.end());
+    }
+    void put_chunk(bool first, const std::string &chunk) override {}
+    void put_thought_chunk(bool first, const std::string &chunk) override {}
+    void end_thought(void) override {}
+    void putln(const std::string &line, TextType type) override {}
+public:
+    std::vector<int> ids;
+};
+
+static std::vector<std::vector<int>> decode(const std::string &model_path, const std::map<std::string, std::string> &options,
+                                            const std::vector<std::vector<int>> &prompts, int slots)
+{
+    ModelObject::extra_args args(MAX_LENGTH, "", false, 1, 4096, "f16", "");
+    args.additional = options;
+    ModelObject obj(model_path, args);
+
+    const auto gen_config = test::greedy_config(MAX_LENGTH, NEW_TOKENS);
+    obj.model->reserve_kv_slots(slots);
+
+    std::vector<TokenCollector> collectors(prompts.size());
+    for (size_t i = 0; i < prompts.size(); i++)
+        obj.model->add_sequence(prompts[i], gen_config, &collectors[i]);
+    while (obj.model->step_sequences() > 0)
+        ;
+
+    std::vector<std::vector<int>> r;
+    for (auto &c : collectors)
+        r.push_back(c.ids);
+    return r;
+}
+
+int main()
+{
+    const std::string model_path = test::temp_path("chatllm_test_llama2.bin");
+    test::write_tiny_llama2(model_path, MAX_LENGTH);
+
+    // prompts of different lengths: both slots are decoded in one batch at different `n_past`
+    const std::vector<std::vector<int>> prompts = {
+        {1, 10, 11, 12, 13},
+        {1, 20, 21, 22, 23, 24, 25, 26, 27},
+    };
+
+    const std::vector<std::map<std::string, std::string>> configs = {
+        {},
+        {{"flash_attn", "1"}},
+        {{"v_cache_dtype", "q8_0"}},
+        {{"kv_page_size", "16"}},
+    };
+
+    for (auto &options : configs)
+    {
+        std::vector<std::vector<int>> expected;
+        for (auto &prompt : prompts)
+            expected.push_back(decode(model_path, options, {prompt}, 1)[0]);
+
+        auto batched = decode(model_path, options, prompts, (int)prompts.size());
+
+        for (size_t i = 0; i < prompts.size(); i++)
+        {
+            printf("sequence %d: %d tokens decoded alone, %d in batch\n", (int)i, (int)expected[i].size(), (int)batched[i].size());
+            TEST_CHECK(expected[i].size() > 0);
+            TEST_CHECK(expected[i] == batched[i]);
+        }
+    }
+
+    std::filesystem::remove(model_path);
+    return 0;
+}
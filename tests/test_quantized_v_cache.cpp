@@ -0,0 +1,64 @@
+// attention reading V from a quantized cache (`--set v_cache_dtype q8_0`) must stay close to reading it from F16.
+
+#include "test_utils.h"
+
+#include <cmath>
+#include <filesystem>
+
+using namespace chatllm;
+
+static const int MAX_LENGTH = 128;
+
+// logits of the prompt, then of a few decoding steps, which read V of all previous positions from the cache
+static std::vector<float> run(const std::string &model_path, const std::map<std::string, std::string> &options)
+{
+    ModelObject::extra_args args(MAX_LENGTH, "", false, 1, 4096, "f16", "");
+    args.additional = options;
+    ModelObject obj(model_path, args);
+
+    const auto gen_config = test::greedy_config(MAX_LENGTH);
+    std::vector<int> ids = {1, 20, 21, 22, 23, 24, 25, 26, 27};
+    std::vector<float> logits;
+    std::vector<float> r;
+
+    obj.model->set_n_past(0);
+    obj.model->set_ctx((int)ids.size());
+    for (int i = 0; i < 4; i++)
+    {
+        obj.model->generate_next_token(ids, gen_config, logits);
+        r.insert(r.end(), logits.begin(), logits.end());
+
+        obj.model->set_n_past(obj.model->get_n_past() + (int)ids.size());
+        ids = {4 + i * 7};
+    }
+    return r;
+}
+
+int main()
+{
+    const std::string model_path = test::temp_path("chatllm_test_llama2_v_cache.bin");
+    test::write_tiny_llama2(model_path, MAX_LENGTH);
+
+    for (const std::string flash_attn : {"0", "1"})
+    {
+        auto f16 = run(model_path, {{"flash_attn", flash_attn}});
+        auto q8  = run(model_path, {{"flash_attn", flash_attn}, {"v_cache_dtype", "q8_0"}});
+
+        float scale = 0.0f;
+        for (auto x : f16)
+            scale = std::max(scale, std::fabs(x));
+
+        TEST_CHECK(f16.size() > 0);
+        const float diff = test::max_abs_diff(f16, q8);
+        printf("flash_attn = %s: max abs diff of logits: %g (max abs logit %g)\n", flash_attn.c_str(), diff, scale);
+
+        // q8_0 keeps 8 bits per value: errors are not zero (i.e. V is really quantized), but of the order
+        // of those of a q8_0 K cache (about 5% of the largest logit with the random weights of the tiny model);
+        // reading wrong rows or blocks of V gives errors of the order of the logits themselves.
+        TEST_CHECK(diff > 0.0f);
+        TEST_CHECK(diff < 0.1f * scale);
+    }
+
+    std::filesystem::remove(model_path);
+    return 0;
+}
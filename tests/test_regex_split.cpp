@@ -0,0 +1,92 @@
+// pre-tokenizer regex of models using `\p{Lu}`, `\p{Ll}`, ... (gpt-oss, apertus, apriel) and llama3-like ones (gigachat):
+// each pattern must split texts like the reference implementation (Rust `fancy-regex`, as in HF tokenizers) does.
+// pieces not matched by a pattern are kept as pieces, and all are given in the byte-level form.
+
+#include "test_utils.h"
+#include "../src/unicode.h"
+
+struct Case
+{
+    const char *name;
+    std::string regex;
+    std::string text;
+    std::vector<std::string> expected;
+};
+
+static const std::string TEXT1 = "Hello WORLD's HTMLParser café ÉCOLE 12345!\n\n  end";
+// titlecase (Lt), other letters (Lo), and a combining mark (Mn)
+static const std::string TEXT2 = "ǅemal 中文 Öl e\xcc\x81x";
+
+static const std::string GPT_OSS_1  = "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?";
+static const std::string GPT_OSS_2  = "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?";
+static const std::string GPT_OSS_3  = "\\p{N}{1,3}";
+static const std::string GPT_OSS_4  = " ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+";
+static const std::string GPT_OSS_5  = "\\s+(?!\\S)|\\s+";
+// apertus & apriel
+static const std::string APERTUS    = "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+";
+static const std::string GIGACHAT   = "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+";
+
+static const std::vector<Case> cases = {
+    {"gpt-oss #1", GPT_OSS_1, TEXT1,
+        {"Hello", " WORLD", "'s", " HTMLParser", " café", " ÉCOLE 12345!\n\n ", " end"}},
+    {"gpt-oss #1", GPT_OSS_1, TEXT2,
+        {"ǅemal", " 中文", " Öl", " e\xcc\x81x"}},
+    {"gpt-oss #2", GPT_OSS_2, TEXT1,
+        {"Hello", " WORLD's", " HTMLParser", " café", " ÉCOLE", " 12345!\n\n  end"}},
+    {"gpt-oss #2", GPT_OSS_2, TEXT2,
+        {"ǅemal", " 中文", " Öl", " e", "\xcc\x81x"}},
+    {"gpt-oss #3", GPT_OSS_3, TEXT1,
+        {"Hello WORLD's HTMLParser café ÉCOLE ", "123", "45", "!\n\n  end"}},
+    {"gpt-oss #4", GPT_OSS_4, TEXT1,
+        {"Hello WORLD", "'", "s HTMLParser café ÉCOLE 12345", "!\n\n", "  end"}},
+    {"gpt-oss #5", GPT_OSS_5, TEXT1,
+        {"Hello", " ", "WORLD's", " ", "HTMLParser", " ", "café", " ", "ÉCOLE", " ", "12345!", "\n\n ", " ", "end"}},
+    {"apertus/apriel", APERTUS, TEXT1,
+        {"Hello", " WORLD", "'s", " HTMLParser", " café", " ÉCOLE", " ", "1", "2", "3", "4", "5", "!\n\n", " ", " end"}},
+    {"apertus/apriel", APERTUS, TEXT2,
+        {"ǅemal", " 中文", " Öl", " e\xcc\x81x"}},
+    {"gigachat", GIGACHAT, TEXT1,
+        {"Hello", " WORLD", "'s", " HTMLParser", " café", " ÉCOLE", " ", "123", "45", "!\n\n", " ", " end"}},
+    {"gigachat", GIGACHAT, TEXT2,
+        {"ǅemal", " 中文", " Öl", " e", "\xcc\x81x"}},
+};
+
+static std::vector<std::string> byte_level(const std::vector<std::string> &pieces)
+{
+    std::vector<std::string> r;
+    for (auto &s : pieces)
+    {
+        std::string t;
+        for (uint8_t c : s)
+            t += unicode_byte_to_utf8(c);
+        r.push_back(t);
+    }
+    return r;
+}
+
+static void print_pieces(const char *title, const std::vector<std::string> &pieces)
+{
+    fprintf(stderr, "  %s:", title);
+    for (auto &s : pieces)
+        fprintf(stderr, " [%s]", s.c_str());
+    fprintf(stderr, "\n");
+}
+
+int main()
+{
+    int failed = 0;
+    for (auto &c : cases)
+    {
+        auto pieces   = unicode_regex_split(c.text, {c.regex});
+        auto expected = byte_level(c.expected);
+        if (pieces == expected) continue;
+
+        failed++;
+        fprintf(stderr, "%s: splits differ\n", c.name);
+        print_pieces("expected", expected);
+        print_pieces("actual", pieces);
+    }
+
+    TEST_CHECK(failed == 0);
+    return 0;
+}
@@ -0,0 +1,129 @@
+// a re-quantized model saved to the cache (`--set requant_cache DIR`) must give the same logits when reloaded.
+// Qwen3.5 adds 1 to its norm weights at load time (`RMSNormWeightPlus1`), which must not be saved into the cache.
+
+#include "test_utils.h"
+#include "../src/models.h"
+#include "../src/models_priv.h"
+
+#include <filesystem>
+
+using namespace chatllm;
+
+static const int MODEL_TYPE_QWEN3_5 = MODEL_TYPE_QWEN2_5_VL + 3;
+
+static const int HIDDEN     = 64;
+static const int HEADS      = 4;
+static const int KV_HEADS   = 2;
+static const int HEAD_DIM   = 16;
+static const int INTER      = 128;
+static const int LAYERS     = 2;
+static const int MAX_LENGTH = 128;
+
+static void write_model(const std::string &path)
+{
+    test::ModelWriter w(path, MODEL_TYPE_QWEN3_5);
+
+    const int vocab_size = 256 + 3;
+
+    // BaseConfig
+    w.write_i32((int)ggml::type::GGML_TYPE_F32);
+    w.write_i32(vocab_size);
+    w.write_i32(HIDDEN);
+    w.write_i32(HEADS);
+    w.write_i32(LAYERS);
+    w.write_i32(INTER);
+    w.write_i32(MAX_LENGTH);
+    w.write_i32(256);   // bos
+    w.write_i32(256);   // eos
+    w.write_i32(256);   // pad
+    w.write_i32(-1);    // sep
+
+    w.write_i32(KV_HEADS);
+    w.write_i32(1);     // attn_output_gate
+    w.write_i32(4);     // linear_conv_kernel_dim
+    w.write_i32(16);    // linear_key_head_dim
+    w.write_i32(2);     // linear_num_key_heads
+    w.write_i32(2);     // linear_num_value_heads
+    w.write_i32(16);    // linear_value_head_dim
+    w.write_i32(HEAD_DIM);
+    w.write_f32(10000.0f);
+    w.write_i32(8);     // rope_dim
+    for (int s : {2, 1, 1, 0})
+        w.write_i32(s);
+    w.write_i32(0);     // moe_intermediate_size
+    w.write_i32(0);     // shared_expert_intermediate_size
+    w.write_i32(0);     // num_experts_per_tok
+    w.write_i32(0);     // num_experts
+    w.write_i32(0);     // tie_word_embeddings
+    w.write_i32(0);     // mtp_num_hidden_layers
+    w.write_f32(0.0f);  // router_aux_loss_coef
+    for (int i = 0; i < 128; i++)
+        w.write_i32(0); // layer_is_la: all layers use full attention
+
+    w.begin_tokenizer();
+    w.write_byte_level_vocab({"<|endoftext|>", "<|im_start|>", "<|im_end|>"});
+
+    // norm weights are centered at 0 (+1 at load time). some are stored as F16 to be converted at load time,
+    // while F32 ones are mapped in place.
+    w.begin_tensors();
+    w.write_tensor("model.embed_tokens.weight", {vocab_size, HIDDEN});
+    for (int i = 0; i < LAYERS; i++)
+    {
+        const std::string prefix = "model.layers." + std::to_string(i) + ".";
+        w.write_tensor(prefix + "input_layernorm.weight",           {HIDDEN}, ggml::type::GGML_TYPE_F16, 0.1f);
+        w.write_tensor(prefix + "post_attention_layernorm.weight",  {HIDDEN}, ggml::type::GGML_TYPE_F32, 0.1f);
+        w.write_tensor(prefix + "self_attn.q_proj.weight",          {HEADS * HEAD_DIM, HIDDEN});
+        w.write_tensor(prefix + "self_attn.k_proj.weight",          {KV_HEADS * HEAD_DIM, HIDDEN});
+        w.write_tensor(prefix + "self_attn.v_proj.weight",          {KV_HEADS * HEAD_DIM, HIDDEN});
+        w.write_tensor(prefix + "self_attn.o_proj.weight",          {HIDDEN, HEADS * HEAD_DIM});
+        w.write_tensor(prefix + "self_attn.gate_proj.weight",       {HEADS * HEAD_DIM, HIDDEN});
+        w.write_tensor(prefix + "self_attn.q_norm.weight",          {HEAD_DIM}, ggml::type::GGML_TYPE_F16, 0.1f);
+        w.write_tensor(prefix + "self_attn.k_norm.weight",          {HEAD_DIM}, ggml::type::GGML_TYPE_F32, 0.1f);
+        w.write_tensor(prefix + "mlp.gate_proj.weight",             {INTER, HIDDEN});
+        w.write_tensor(prefix + "mlp.up_proj.weight",               {INTER, HIDDEN});
+        w.write_tensor(prefix + "mlp.down_proj.weight",             {HIDDEN, INTER});
+    }
+    w.write_tensor("model.norm.weight", {HIDDEN}, ggml::type::GGML_TYPE_F16, 0.1f);
+    w.write_tensor("lm_head.weight",    {vocab_size, HIDDEN});
+}
+
+static std::vector<float> run(const std::string &model_path, const std::string &cache_dir)
+{
+    ModelObject::extra_args args(MAX_LENGTH, "", false, 1, 4096, "f16", "q8_0");
+    args.additional["requant_cache"] = cache_dir;
+
+    ModelObject obj(model_path, args);
+
+    const std::vector<int> ids = {256, 72, 101, 108, 108, 111, 44, 32, 119, 111, 114, 108, 100};
+    std::vector<float> logits;
+    obj.model->set_n_past(0);
+    obj.model->set_ctx((int)ids.size());
+    obj.model->generate_next_token(ids, test::greedy_config(MAX_LENGTH), logits);
+    return logits;
+}
+
+int main()
+{
+    const std::string model_path = test::temp_path("chatllm_test_qwen3_5.bin");
+    const std::string cache_dir  = test::temp_path("chatllm_test_requant_cache");
+
+    std::filesystem::remove_all(cache_dir);
+    std::filesystem::create_directories(cache_dir);
+    write_model(model_path);
+
+    const std::string cache_path = ModelLoader::requant_cache_path(model_path, cache_dir, ggml::type::GGML_TYPE_Q8_0);
+
+    // the first run converts the model and writes the cache, the second one loads from it
+    auto original = run(model_path, cache_dir);
+    TEST_CHECK(std::filesystem::exists(cache_path));
+    auto reloaded = run(model_path, cache_dir);
+
+    TEST_CHECK(original.size() > 0);
+    const float diff = test::max_abs_diff(original, reloaded);
+    printf("max abs diff of logits: %g\n", diff);
+    TEST_CHECK(diff < 1e-4f);
+
+    std::filesystem::remove_all(cache_dir);
+    std::filesystem::remove(model_path);
+    return 0;
+}
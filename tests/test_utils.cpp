@@ -0,0 +1,229 @@
+#include "test_utils.h"
+
+#include <cmath>
+#include <filesystem>
+#include <random>
+
+#include "../src/unicode.h"
+
+void log_internal(int level, const char * text)
+{
+    if (level >= GGML_LOG_LEVEL_WARN)
+        fputs(text, stderr);
+}
+
+namespace chatllm::test
+{
+    ModelWriter::ModelWriter(const std::string &path, int model_type, int version, const std::string &meta)
+        : f(fopen(path.c_str(), "wb")), seed(0)
+    {
+        CHATLLM_CHECK(f != nullptr) << "cannot create file " << path;
+
+        fwrite("ggmm", 1, 4, f);
+        const uint32_t header[] = {1, 0, 0, 0};
+        fwrite(header, sizeof(header), 1, f);
+        fwrite(meta.data(), 1, meta.size(), f);
+        patch_offset(8);
+
+        write_i32(model_type);
+        write_i32(version);
+    }
+
+    ModelWriter::~ModelWriter()
+    {
+        close();
+    }
+
+    void ModelWriter::close(void)
+    {
+        if (f) fclose(f);
+        f = nullptr;
+    }
+
+    void ModelWriter::patch_offset(long at)
+    {
+        const uint32_t offset = (uint32_t)ftell(f);
+        fseek(f, at, SEEK_SET);
+        fwrite(&offset, sizeof(offset), 1, f);
+        fseek(f, 0, SEEK_END);
+    }
+
+    void ModelWriter::write_i32(int v)
+    {
+        fwrite(&v, sizeof(v), 1, f);
+    }
+
+    void ModelWriter::write_f32(float v)
+    {
+        fwrite(&v, sizeof(v), 1, f);
+    }
+
+    void ModelWriter::write_u8(uint8_t v)
+    {
+        fwrite(&v, sizeof(v), 1, f);
+    }
+
+    void ModelWriter::write_string(const std::string &s)
+    {
+        write_i32((int)s.size());
+        fwrite(s.data(), 1, s.size(), f);
+    }
+
+    void ModelWriter::begin_tokenizer(void)
+    {
+        patch_offset(12);
+    }
+
+    void ModelWriter::begin_tensors(void)
+    {
+        patch_offset(16);
+    }
+
+    void ModelWriter::write_tensor(const std::string &name, const std::vector<int> &shape, ggml::type type, float scale, float mean)
+    {
+        CHATLLM_CHECK((type == ggml::type::GGML_TYPE_F32) || (type == ggml::type::GGML_TYPE_F16)) << "unsupported type";
+
+        write_string(name);
+        write_i32((int)shape.size());
+        size_t n = 1;
+        for (auto d : shape)
+        {
+            write_i32(d);
+            n *= d;
+        }
+        write_i32((int)type);
+
+        const long pos = ftell(f);
+        const long aligned = (pos + 15) / 16 * 16;
+        for (long i = pos; i < aligned; i++) write_u8(0);
+
+        std::mt19937 gen(++seed);
+        std::normal_distribution<float> dist(mean, scale);
+        for (size_t i = 0; i < n; i++)
+        {
+            const float v = scale > 0 ? dist(gen) : mean;
+            if (type == ggml::type::GGML_TYPE_F32)
+            {
+                write_f32(v);
+            }
+            else
+            {
+                ggml_fp16_t h = ggml_fp32_to_fp16(v);
+                fwrite(&h, sizeof(h), 1, f);
+            }
+        }
+    }
+
+    void ModelWriter::write_sp_vocab(const std::vector<std::string> &pieces)
+    {
+        for (size_t i = 0; i < pieces.size(); i++)
+        {
+            write_string(pieces[i]);
+            write_f32(-(float)i);
+        }
+        write_i32(-1);
+    }
+
+    int ModelWriter::write_byte_level_vocab(const std::vector<std::string> &special)
+    {
+        const uint8_t NORMAL  = 1;
+        const uint8_t CONTROL = 3;
+
+        for (int i = 0; i < 256; i++)
+        {
+            write_string(unicode_byte_to_utf8((uint8_t)i));
+            write_u8(NORMAL);
+        }
+        for (auto &s : special)
+        {
+            write_string(s);
+            write_u8(CONTROL);
+        }
+        write_i32(-1);
+
+        // no merges
+        write_i32(-1);
+        return 256 + (int)special.size();
+    }
+
+    void write_tiny_llama2(const std::string &path, int max_length)
+    {
+        const int MODEL_TYPE_LLAMA2 = 0x150;
+        const int VOCAB     = 64;
+        const int HIDDEN    = 64;
+        const int HEADS     = 2;    // head_dim 32, a whole block of quantized types
+        const int INTER     = 128;
+        const int LAYERS    = 2;
+
+        ModelWriter w(path, MODEL_TYPE_LLAMA2);
+
+        // BaseConfig
+        w.write_i32((int)ggml::type::GGML_TYPE_F32);
+        w.write_i32(VOCAB);
+        w.write_i32(HIDDEN);
+        w.write_i32(HEADS);
+        w.write_i32(LAYERS);
+        w.write_i32(INTER);
+        w.write_i32(max_length);
+        w.write_i32(1);     // bos
+        w.write_i32(2);     // eos
+        w.write_i32(3);     // pad
+        w.write_i32(-1);    // sep
+
+        w.begin_tokenizer();
+        std::vector<std::string> pieces({"<unk>", "<s>", "</s>", "<pad>"});
+        for (int i = (int)pieces.size(); i < VOCAB; i++)
+            pieces.push_back("\xe2\x96\x81" + std::string(1, (char)('0' + i)));
+        w.write_sp_vocab(pieces);
+
+        w.begin_tensors();
+        w.write_tensor("model.embed_tokens.weight", {VOCAB, HIDDEN});
+        for (int i = 0; i < LAYERS; i++)
+        {
+            const std::string prefix = "model.layers." + std::to_string(i) + ".";
+            w.write_tensor(prefix + "input_layernorm.weight",           {HIDDEN}, ggml::type::GGML_TYPE_F32, 0.1f, 1.0f);
+            w.write_tensor(prefix + "mlp.down_proj.weight",             {HIDDEN, INTER});
+            w.write_tensor(prefix + "mlp.gate_proj.weight",             {INTER, HIDDEN});
+            w.write_tensor(prefix + "mlp.up_proj.weight",               {INTER, HIDDEN});
+            w.write_tensor(prefix + "post_attention_layernorm.weight",  {HIDDEN}, ggml::type::GGML_TYPE_F32, 0.1f, 1.0f);
+            w.write_tensor(prefix + "self_attn.k_proj.weight",          {HIDDEN, HIDDEN});
+            w.write_tensor(prefix + "self_attn.o_proj.weight",          {HIDDEN, HIDDEN});
+            w.write_tensor(prefix + "self_attn.q_proj.weight",          {HIDDEN, HIDDEN});
+            w.write_tensor(prefix + "self_attn.v_proj.weight",          {HIDDEN, HIDDEN});
+        }
+        w.write_tensor("model.norm.weight", {HIDDEN}, ggml::type::GGML_TYPE_F32, 0.1f, 1.0f);
+        w.write_tensor("lm_head.weight",    {VOCAB, HIDDEN});
+    }
+
+    std::string temp_path(const std::string &name)
+    {
+        return (std::filesystem::temp_directory_path() / name).string();
+    }
+
+    float max_abs_diff(const std::vector<float> &a, const std::vector<float> &b)
+    {
+        CHATLLM_CHECK(a.size() == b.size()) << "size mismatch: " << a.size() << " vs " << b.size();
+        float r = 0.0f;
+        for (size_t i = 0; i < a.size(); i++)
+            r = std::max(r, std::fabs(a[i] - b[i]));
+        return r;
+    }
+
+    int argmax(const float *logits, int n)
+    {
+        int r = 0;
+        for (int i = 1; i < n; i++)
+            if (logits[i] > logits[r]) r = i;
+        return r;
+    }
+
+    GenerationConfig greedy_config(int max_length, int max_new_tokens)
+    {
+        GenerationConfig gen_config(max_length, max_length, false, false, 1, 1.0f, 1.0f, 1, "greedy", 0.0f, 1.0f);
+        gen_config.repeat_penalty    = 1.0f;
+        gen_config.frequency_penalty = 0.0f;
+        gen_config.penalty_window    = 256;
+        gen_config.max_new_tokens    = max_new_tokens;
+        return gen_config;
+    }
+}
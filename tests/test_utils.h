@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "../src/chat.h"
+
+// tiny models are written at runtime, so tests need no downloads.
+
+#define TEST_CHECK(cond)                                                            \
+    do {                                                                            \
+        if (!(cond))                                                                \
+        {                                                                           \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);\
+            return 1;                                                               \
+        }                                                                           \
+    } while (0)
+
+namespace chatllm::test
+{
+    // writes a GGMM file: header, meta, config, tokenizer, then tensors.
+    class ModelWriter
+    {
+    public:
+        ModelWriter(const std::string &path, int model_type, int version = 1, const std::string &meta = "{}");
+        ~ModelWriter();
+
+        void write_i32(int v);
+        void write_f32(float v);
+        void write_u8(uint8_t v);
+        void write_string(const std::string &s);
+
+        // call in this order, after the config (and the tokenizer) are written
+        void begin_tokenizer(void);
+        void begin_tensors(void);
+
+        // `shape` is in PyTorch order, i.e. the last one is `ne[0]`.
+        // values are random (normally distributed with std `scale`) around `mean`.
+        void write_tensor(const std::string &name, const std::vector<int> &shape, ggml::type type = ggml::type::GGML_TYPE_F32,
+                          float scale = 0.3f, float mean = 0.0f);
+
+        // sentencepiece-like vocab for `BPEProcessor1`: (piece, score)
+        void write_sp_vocab(const std::vector<std::string> &pieces);
+
+        // byte level BPE vocab for `BPEProcessor2`: the 256 byte tokens, then `special` ones, no merges.
+        // returns the vocab size.
+        int write_byte_level_vocab(const std::vector<std::string> &special);
+
+        void close(void);
+
+    private:
+        void patch_offset(long at);
+
+        FILE *f;
+        uint32_t seed;
+    };
+
+    // LLaMA2 (`MODEL_TYPE_LLAMA2`) of 2 layers, hidden size 64, 2 heads & a vocab of 64 pieces:
+    // <unk>, <s> (bos), </s> (eos), <pad>, then plain ones.
+    void write_tiny_llama2(const std::string &path, int max_length);
+
+    std::string temp_path(const std::string &name);
+
+    float max_abs_diff(const std::vector<float> &a, const std::vector<float> &b);
+
+    int argmax(const float *logits, int n);
+
+    // plain, greedy generation config
+    GenerationConfig greedy_config(int max_length, int max_new_tokens = -1);
+}